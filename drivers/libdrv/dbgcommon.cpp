@@ -250,6 +250,9 @@ const char *device_control_name(ULONG ioctl_code)
 	case vhci::ioctl::GET_IMPORTED_DEVICES: return "vhci_get_imported_devices";
 	case vhci::ioctl::GET_PERSISTENT: return "vhci_get_persistent";
 	case vhci::ioctl::SET_PERSISTENT: return "vhci_set_persistent";
+	case vhci::ioctl::PLUGIN_HARDWARE_BATCH: return "vhci_plugin_hardware_batch";
+	case vhci::ioctl::GET_ATTACH_TIMELINE: return "vhci_get_attach_timeline";
+	case vhci::ioctl::GET_IMPORTED_DEVICES_DELTA: return "vhci_get_imported_devices_delta";
 
 	case IOCTL_USB_DIAG_IGNORE_HUBS_ON: return "USB_DIAG_IGNORE_HUBS_ON";
 	case IOCTL_USB_DIAG_IGNORE_HUBS_OFF: return "USB_DIAG_IGNORE_HUBS_OFF";
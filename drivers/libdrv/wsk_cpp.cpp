@@ -773,6 +773,23 @@ PAGED NTSTATUS wsk::get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, i
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::get_rcvbuf(_In_ SOCKET *sock, int &optval)
+{
+        PAGED_CODE();
+        return getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+}
+
+/*
+ * SO_SNDBUF is not supported, WSK does not buffer outgoing data, caller's buffers are used.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::set_rcvbuf(_In_ SOCKET *sock, int optval)
+{
+        PAGED_CODE();
+        return setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+}
+
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS wsk::initialize()
 {
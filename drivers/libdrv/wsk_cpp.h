@@ -99,6 +99,12 @@ PAGED NTSTATUS get_keepalive_opts(_In_ SOCKET *sock, int *idle, int *cnt, int *i
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS set_keepalive(_In_ SOCKET *sock, int idle = 0, int cnt = 0, int intvl = 0);
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS get_rcvbuf(_In_ SOCKET *sock, int &optval);
+
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS set_rcvbuf(_In_ SOCKET *sock, int optval);
+
 //
 
 _IRQL_requires_max_(APC_LEVEL)
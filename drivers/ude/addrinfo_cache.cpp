@@ -0,0 +1,357 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "addrinfo_cache.h"
+#include "trace.h"
+#include "addrinfo_cache.tmh"
+
+#include "driver.h"
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum : ULONGLONG { // KeQueryInterruptTime units
+        POSITIVE_TTL = 60*wdm::second,
+        NEGATIVE_TTL = 5*wdm::second, // less than the delay between retries of plugin_persistent_devices
+};
+
+struct addrinfo_cache_entry
+{
+        LIST_ENTRY entry; // head is addrinfo_cache::entries
+        ULONGLONG expires; // KeQueryInterruptTime
+        NTSTATUS status; // failure of name resolution is cached if !NT_SUCCESS
+
+        UNICODE_STRING host; // .Buffer-s point to the memory after this struct
+        UNICODE_STRING service;
+
+        int socktype;
+        int protocol;
+
+        ULONG count;
+        SOCKADDR_INET addrs[8];
+};
+
+struct cached_addrinfo
+{
+        ADDRINFOEXW ai; // must be the first
+        SOCKADDR_INET addr;
+};
+
+inline auto& get_entry(_In_ LIST_ENTRY *entry)
+{
+        return *CONTAINING_RECORD(entry, addrinfo_cache_entry, entry);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto equal(
+        _In_ const addrinfo_cache_entry &e, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        return RtlEqualUnicodeString(&e.host, &host, true) &&
+               RtlEqualUnicodeString(&e.service, &service, false);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void remove(_Inout_ addrinfo_cache &cache, _Inout_ addrinfo_cache_entry &e)
+{
+        PAGED_CODE();
+
+        NT_ASSERT(cache.count);
+        --cache.count;
+
+        RemoveEntryList(&e.entry);
+        ExFreePoolWithTag(&e, pooltag);
+}
+
+/*
+ * Expired entries are removed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED addrinfo_cache_entry* find(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+        auto now = KeQueryInterruptTime();
+
+        for (auto head = &cache.entries, entry = head->Flink; entry != head; ) {
+                auto &e = get_entry(entry);
+                entry = entry->Flink;
+
+                if (e.expires <= now) {
+                        remove(cache, e);
+                } else if (equal(e, host, service)) {
+                        return &e;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto make_entry(_In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service, _In_ NTSTATUS status)
+{
+        PAGED_CODE();
+
+        auto len = sizeof(addrinfo_cache_entry) + host.Length + service.Length;
+
+        auto e = (addrinfo_cache_entry*)ExAllocatePoolZero(PagedPool, len, pooltag);
+        if (!e) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", len);
+                return e;
+        }
+
+        struct {
+                UNICODE_STRING &dst;
+                const UNICODE_STRING &src;
+        } const v[] = {
+                { e->host, host },
+                { e->service, service },
+        };
+
+        auto buf = reinterpret_cast<WCHAR*>(e + 1);
+
+        for (auto &[dst, src]: v) {
+                RtlCopyMemory(buf, src.Buffer, src.Length);
+                dst.Buffer = buf;
+                dst.Length = dst.MaximumLength = src.Length;
+                buf += src.Length/sizeof(*buf);
+        }
+
+        e->status = status;
+        e->expires = KeQueryInterruptTime() + (NT_SUCCESS(status) ? POSITIVE_TTL : NEGATIVE_TTL);
+
+        return e;
+}
+
+/*
+ * The least recently used entry is evicted if the cache is full.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void push(_Inout_ addrinfo_cache &cache, _Inout_ addrinfo_cache_entry &e)
+{
+        PAGED_CODE();
+
+        if (auto old = find(cache, e.host, e.service)) {
+                remove(cache, *old);
+        }
+
+        if (cache.count == cache.MAX_ENTRIES) {
+                auto &lru = get_entry(cache.entries.Blink);
+                TraceDbg("evict %!USTR!:%!USTR!", &lru.host, &lru.service);
+                remove(cache, lru);
+        }
+
+        InsertHeadList(&cache.entries, &e.entry);
+        ++cache.count;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto make_addrinfo(_In_ const addrinfo_cache_entry &e)
+{
+        PAGED_CODE();
+        NT_ASSERT(e.count);
+
+        auto v = (cached_addrinfo*)ExAllocatePoolZero(PagedPool, e.count*sizeof(cached_addrinfo), pooltag);
+        if (!v) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu cached_addrinfo", e.count);
+                return static_cast<ADDRINFOEXW*>(nullptr);
+        }
+
+        for (ULONG i = 0; i < e.count; ++i) {
+                auto &[ai, addr] = v[i];
+                addr = e.addrs[i];
+
+                ai.ai_family = addr.si_family;
+                ai.ai_socktype = e.socktype;
+                ai.ai_protocol = e.protocol;
+                ai.ai_addrlen = addr.si_family == AF_INET ? sizeof(addr.Ipv4) : sizeof(addr.Ipv6);
+                ai.ai_addr = reinterpret_cast<SOCKADDR*>(&addr);
+                ai.ai_next = i + 1 < e.count ? &v[i + 1].ai : nullptr;
+        }
+
+        static_assert(!offsetof(cached_addrinfo, ai));
+        return &v->ai;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void log_stat(_In_ const addrinfo_cache &cache, _In_ const char *what,
+        _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        TraceDbg("%s %!USTR!:%!USTR!, hits %I64u, negative hits %I64u, misses %I64u, invalidated %I64u, entries %lu",
+                  what, &host, &service, cache.hits, cache.negative_hits, cache.misses, cache.invalidated, cache.count);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init(_Inout_ addrinfo_cache &cache, _In_ WDFOBJECT parent)
+{
+        PAGED_CODE();
+
+        InitializeListHead(&cache.entries);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = parent;
+
+        if (auto err = WdfWaitLockCreate(&attr, &cache.lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::clear(_Inout_ addrinfo_cache &cache)
+{
+        PAGED_CODE();
+
+        if (!cache.lock) { // init was not called or failed
+                return;
+        }
+
+        TraceDbg("hits %I64u, negative hits %I64u, misses %I64u, invalidated %I64u, entries %lu",
+                  cache.hits, cache.negative_hits, cache.misses, cache.invalidated, cache.count);
+
+        wdf::WaitLock lck(cache.lock);
+
+        while (!IsListEmpty(&cache.entries)) {
+                auto &e = get_entry(cache.entries.Flink);
+                remove(cache, e);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::lookup(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service,
+        _Out_ ADDRINFOEXW* &result, _Out_ NTSTATUS &status)
+{
+        PAGED_CODE();
+
+        result = nullptr;
+        status = STATUS_NOT_FOUND;
+
+        wdf::WaitLock lck(cache.lock);
+
+        auto e = find(cache, host, service);
+        if (!e) {
+                ++cache.misses;
+                log_stat(cache, "miss", host, service);
+                return false;
+        }
+
+        if (!NT_SUCCESS(e->status)) {
+                status = e->status;
+                ++cache.negative_hits;
+        } else if (!(result = make_addrinfo(*e))) {
+                ++cache.misses;
+                return false;
+        } else {
+                status = STATUS_SUCCESS;
+                ++cache.hits;
+        }
+
+        RemoveEntryList(&e->entry);
+        InsertHeadList(&cache.entries, &e->entry); // most recently used
+
+        log_stat(cache, NT_SUCCESS(status) ? "hit" : "negative hit", host, service);
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::insert(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service,
+        _In_ const ADDRINFOEXW *ai)
+{
+        PAGED_CODE();
+
+        auto e = make_entry(host, service, STATUS_SUCCESS);
+        if (!e) {
+                return;
+        }
+
+        if (ai) {
+                e->socktype = ai->ai_socktype;
+                e->protocol = ai->ai_protocol;
+        }
+
+        for ( ; ai && e->count < ARRAYSIZE(e->addrs); ai = ai->ai_next) {
+                if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) &&
+                     ai->ai_addrlen <= sizeof(*e->addrs)) {
+                        RtlCopyMemory(&e->addrs[e->count++], ai->ai_addr, ai->ai_addrlen);
+                }
+        }
+
+        if (!e->count) {
+                ExFreePoolWithTag(e, pooltag);
+                return;
+        }
+
+        wdf::WaitLock lck(cache.lock);
+        push(cache, *e);
+
+        TraceDbg("%!USTR!:%!USTR!, %lu address(es)", &host, &service, e->count);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::insert(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service,
+        _In_ NTSTATUS failure)
+{
+        PAGED_CODE();
+        NT_ASSERT(is_name_not_found(failure));
+
+        if (auto e = make_entry(host, service, failure)) {
+                wdf::WaitLock lck(cache.lock);
+                push(cache, *e);
+                TraceDbg("%!USTR!:%!USTR!, %!STATUS!", &host, &service, failure);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::invalidate(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+        wdf::WaitLock lck(cache.lock);
+
+        if (auto e = find(cache, host, service)) {
+                remove(cache, *e);
+                ++cache.invalidated;
+                log_stat(cache, "invalidated", host, service);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free_cached(_In_opt_ ADDRINFOEXW *ai)
+{
+        PAGED_CODE();
+
+        if (ai) {
+                ExFreePoolWithTag(ai, pooltag);
+        }
+}
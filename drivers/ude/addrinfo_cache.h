@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <wsk.h>
+
+namespace usbip
+{
+
+/*
+ * Bounded TTL cache of resolved addresses, the key is host:service.
+ *
+ * Persistent devices are usually reattached in bulk after a network failure, most of them reside
+ * on the same server. The cache saves WskGetAddressInfo calls during such attach storm.
+ * Authoritative failures of name resolution are cached as well, but for a shorter period.
+ */
+struct addrinfo_cache
+{
+        LIST_ENTRY entries; // addrinfo_cache_entry::entry (see .cpp), most recently used first
+        ULONG count;
+        enum { MAX_ENTRIES = 32 };
+
+        WDFWAITLOCK lock;
+
+        // statistics
+        UINT64 hits;
+        UINT64 negative_hits; // a cached failure was returned
+        UINT64 misses;
+        UINT64 invalidated;
+};
+
+/*
+ * Authoritative answer of name resolution, only such failures are cached.
+ * Timeouts, unreachable DNS server, etc. are transient.
+ */
+constexpr auto is_name_not_found(_In_ NTSTATUS status)
+{
+        return status == STATUS_NOT_FOUND || status == STATUS_NO_MATCH; // WSAHOST_NOT_FOUND, WSANO_DATA
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_Inout_ addrinfo_cache &cache, _In_ WDFOBJECT parent);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void clear(_Inout_ addrinfo_cache &cache);
+
+/*
+ * @return true if the entry is found, status is the result of cached name resolution
+ * @param result must be released by free_cached() if status is success
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool lookup(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service,
+        _Out_ ADDRINFOEXW* &result, _Out_ NTSTATUS &status);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void insert(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service,
+        _In_ const ADDRINFOEXW *ai);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void insert(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service,
+        _In_ NTSTATUS failure);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void invalidate(
+        _Inout_ addrinfo_cache &cache, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free_cached(_In_opt_ ADDRINFOEXW *ai);
+
+} // namespace usbip
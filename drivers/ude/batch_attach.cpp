@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "batch_attach.h"
+#include "trace.h"
+#include "batch_attach.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "persistent.h"
+
+#include <resources/messages.h>
+
+namespace
+{
+
+using namespace usbip;
+
+struct batch_ctx;
+
+/*
+ * IOCTL_PLUGIN_HARDWARE that is sent to itself.
+ */
+struct batch_child
+{
+        batch_ctx *batch;
+
+        WDFREQUEST request;
+        WDFMEMORY memory; // for req
+        NTSTATUS status;
+        volatile LONG sent; // the cancel routine cancels the request if it is set
+
+        ULONG leader; // index of the first item of the same server
+        vhci::ioctl::plugin_hardware req;
+};
+
+/*
+ * Context space of IOCTL_PLUGIN_HARDWARE_BATCH request, its size depends on the number of items.
+ * It is accessed by the completion and the cancel routines.
+ */
+struct batch_ctx
+{
+        WDFREQUEST request; // IOCTL_PLUGIN_HARDWARE_BATCH
+        vhci::ioctl::plugin_hardware_batch *items; // input and output buffer of the request
+
+        WDFIOTARGET target; // vhci itself, the parent of children's requests
+        WDFWORKITEM workitem; // advances the batch when all sent children are completed
+
+        enum phase_t { LEADERS, OTHERS, DONE };
+        phase_t phase;
+
+        LONG pending; // sent children that are not completed yet
+        volatile LONG cancelled;
+        KEVENT cancel_done; // the cancel routine has finished
+
+        ULONG count;
+        batch_child children[ANYSIZE_ARRAY];
+};
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(batch_ctx, get_batch_ctx)
+
+constexpr auto get_batch_ctx_size(_In_ ULONG cnt)
+{
+        auto n = offsetof(batch_ctx, children) + cnt*sizeof(*batch_ctx::children);
+        return max(n, sizeof(batch_ctx));
+}
+
+/*
+ * The server is unreachable, the result of attach to other devices will be the same.
+ */
+constexpr auto is_server_error(_In_ NTSTATUS status)
+{
+        switch (status) {
+        case STATUS_NOT_FOUND: // WskGetAddressInfo
+        case STATUS_NO_MATCH:
+        case STATUS_IO_TIMEOUT: // WskConnect
+        case STATUS_CONNECTION_REFUSED:
+        case STATUS_HOST_UNREACHABLE:
+        case STATUS_NETWORK_UNREACHABLE:
+        case STATUS_HOST_DOWN:
+                return true;
+        default:
+                return false;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto same_server(_In_ const vhci::imported_device_location &a, _In_ const vhci::imported_device_location &b)
+{
+        PAGED_CODE();
+
+        return !_strnicmp(a.host, b.host, sizeof(a.host)) && 
+               !strncmp(a.service, b.service, sizeof(a.service));
+}
+
+_Function_class_(EVT_WDF_REQUEST_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI child_complete(
+        _In_ WDFREQUEST, _In_ WDFIOTARGET, _In_ WDF_REQUEST_COMPLETION_PARAMS *params, _In_ WDFCONTEXT context)
+{
+        auto &child = *static_cast<batch_child*>(context);
+        child.status = params->IoStatus.Status;
+
+        if (auto &batch = *child.batch; !InterlockedDecrement(&batch.pending)) {
+                WdfWorkItemEnqueue(batch.workitem); // -> advance
+        }
+}
+
+/*
+ * Attached devices remain attached, the rest are not attached.
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI cancel(_In_ WDFREQUEST request)
+{
+        auto &batch = *get_batch_ctx(request);
+        TraceDbg("req %04x", ptr04x(request));
+
+        InterlockedExchange(&batch.cancelled, true);
+
+        for (ULONG i = 0; i < batch.count; ++i) {
+                if (auto &child = batch.children[i]; InterlockedOr(&child.sent, 0)) {
+                        WdfRequestCancelSentRequest(child.request);
+                }
+        }
+
+        KeSetEvent(&batch.cancel_done, IO_NO_INCREMENT, false);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto init_child(
+        _Inout_ batch_child &child, _In_ WDFIOTARGET target, 
+        _In_ const vhci::imported_device_location &location)
+{
+        PAGED_CODE();
+
+        auto &req = child.req;
+        static_cast<vhci::imported_device_location&>(req) = location;
+        req.size = sizeof(req);
+        req.port = 0;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = target;
+
+        if (auto err = WdfRequestCreate(&attr, target, &child.request)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestCreate %!STATUS!", err);
+                return err;
+        }
+
+        attr.ParentObject = child.request;
+
+        if (auto err = WdfMemoryCreatePreallocated(&attr, &req, sizeof(req), &child.memory)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                return err;
+        }
+
+        WDFMEMORY_OFFSET output{ .BufferLength = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port) };
+
+        if (auto err = WdfIoTargetFormatRequestForIoctl(target, child.request, vhci::ioctl::PLUGIN_HARDWARE, 
+                                                        child.memory, nullptr, child.memory, &output)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetFormatRequestForIoctl %!STATUS!", err);
+                return err;
+        }
+
+        WdfRequestSetCompletionRoutine(child.request, child_complete, &child);
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The bias of batch.pending guarantees that the child is not deleted while it is being sent.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void send(_Inout_ batch_ctx &batch, _Inout_ batch_child &child)
+{
+        PAGED_CODE();
+        InterlockedIncrement(&batch.pending);
+
+        if (!WdfRequestSend(child.request, batch.target, WDF_NO_SEND_OPTIONS)) { // completion routine is not called
+                child.status = WdfRequestGetStatus(child.request);
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestSend %!STATUS!", child.status);
+                NT_VERIFY(InterlockedDecrement(&batch.pending));
+                return;
+        }
+
+        InterlockedExchange(&child.sent, true);
+
+        if (InterlockedOr(&batch.cancelled, 0)) { // the cancel routine could miss it
+                WdfRequestCancelSentRequest(child.request);
+        }
+}
+
+/*
+ * @param leaders send the first items of each server or the rest
+ * @return true if child_complete will advance the batch
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool send(_Inout_ batch_ctx &batch, _In_ bool leaders)
+{
+        PAGED_CODE();
+        batch.pending = 1; // bias
+
+        for (ULONG i = 0; i < batch.count; ++i) {
+                auto &child = batch.children[i];
+
+                if (child.status != STATUS_PENDING) { // failed to init or completed
+                        //
+                } else if (batch.cancelled) {
+                        child.status = STATUS_CANCELLED;
+                } else if (leaders) {
+                        if (child.leader == i) {
+                                send(batch, child);
+                        }
+                } else if (auto st = batch.children[child.leader].status; is_server_error(st)) {
+                        child.status = st; // do not connect again
+                } else {
+                        send(batch, child);
+                }
+        }
+
+        return InterlockedDecrement(&batch.pending);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void finish(_Inout_ batch_ctx &batch)
+{
+        PAGED_CODE();
+        auto &r = *batch.items;
+
+        for (ULONG i = 0; i < batch.count; ++i) {
+                auto &child = batch.children[i];
+                auto &item = r.items[i];
+
+                item.status = child.status;
+                item.port = NT_SUCCESS(child.status) ? child.req.port : 0;
+
+                TraceDbg("%s:%s/%s, port %d, %!STATUS!", item.host, item.service, item.busid, item.port, item.status);
+        }
+
+        auto request = batch.request;
+
+        if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED) { // the cancel routine accesses children
+                NT_VERIFY(!KeWaitForSingleObject(&batch.cancel_done, Executive, KernelMode, false, nullptr));
+        }
+
+        WdfObjectDelete(batch.target); // and requests of children
+        batch.target = WDF_NO_HANDLE;
+
+        if (batch.cancelled) {
+                WdfRequestComplete(request, STATUS_CANCELLED);
+        } else {
+                WdfRequestCompleteWithInformation(request, STATUS_SUCCESS,
+                                                  vhci::ioctl::plugin_hardware_batch_size(batch.count));
+        }
+}
+
+/*
+ * Devices of different servers are attached concurrently. The first device of each server is attached 
+ * before the others, so they take resolved address from vhci_ctx::addrinfo and do not try 
+ * to connect to unreachable server.
+ *
+ * The thread that calls it is not blocked, the request is completed by the last phase.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void advance(_Inout_ batch_ctx &batch)
+{
+        PAGED_CODE();
+
+        while (batch.phase != batch.DONE) {
+                auto leaders = batch.phase == batch.LEADERS;
+                batch.phase = leaders ? batch.OTHERS : batch.DONE; // before the children are sent
+
+                if (send(batch, leaders)) {
+                        return;
+                }
+        }
+
+        finish(batch);
+}
+
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void NTAPI advance(_In_ WDFWORKITEM wi)
+{
+        PAGED_CODE();
+
+        auto request = static_cast<WDFREQUEST>(WdfWorkItemGetParentObject(wi));
+        advance(*get_batch_ctx(request));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(
+        _Inout_ batch_ctx &batch, _In_ WDFREQUEST request, _Inout_ vhci::ioctl::plugin_hardware_batch &r)
+{
+        PAGED_CODE();
+
+        batch.request = request;
+        batch.items = &r;
+        batch.count = r.count;
+        KeInitializeEvent(&batch.cancel_done, NotificationEvent, false);
+
+        WDF_WORKITEM_CONFIG cfg;
+        WDF_WORKITEM_CONFIG_INIT(&cfg, advance);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = request;
+
+        if (auto err = WdfWorkItemCreate(&cfg, &attr, &batch.workitem)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWorkItemCreate %!STATUS!", err);
+                return err;
+        }
+
+        auto target = make_target(get_vhci(request));
+        if (!target) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (ULONG i = 0; i < batch.count; ++i) {
+                auto &child = batch.children[i];
+                child.batch = &batch;
+                child.status = STATUS_PENDING;
+
+                for (child.leader = 0; !same_server(r.items[child.leader], r.items[i]); ++child.leader);
+
+                if (auto err = init_child(child, target.get<WDFIOTARGET>(), r.items[i])) {
+                        child.status = err;
+                }
+        }
+
+        batch.target = static_cast<WDFIOTARGET>(target.release());
+        return STATUS_SUCCESS;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::plugin_hardware_batch(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::plugin_hardware_batch *r{};
+        constexpr auto hdr_size = vhci::ioctl::plugin_hardware_batch_size(0);
+
+        if (size_t length{};
+            auto err = WdfRequestRetrieveInputBuffer(request, hdr_size, reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "plugin_hardware_batch.size %lu != sizeof(plugin_hardware_batch) %Iu", 
+                                          r->size, sizeof(*r));
+                return USBIP_ERROR_ABI;
+        } else if (!(r->count && r->count <= MAX_PORTS)) {
+                Trace(TRACE_LEVEL_ERROR, "count %lu", r->count);
+                return STATUS_INVALID_PARAMETER;
+        } else if (length != vhci::ioctl::plugin_hardware_batch_size(r->count)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        auto size = vhci::ioctl::plugin_hardware_batch_size(r->count);
+
+        if (void *out{}; auto err = WdfRequestRetrieveOutputBuffer(request, size, &out, nullptr)) {
+                return err;
+        } else {
+                NT_ASSERT(out == r); // METHOD_BUFFERED
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%lu device(s)", r->count);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, batch_ctx);
+        attr.ContextSizeOverride = get_batch_ctx_size(r->count);
+
+        batch_ctx *batch{};
+        if (auto err = WdfObjectAllocateContext(request, &attr, reinterpret_cast<PVOID*>(&batch))) {
+                Trace(TRACE_LEVEL_ERROR, "WdfObjectAllocateContext(%Iu) %!STATUS!", attr.ContextSizeOverride, err);
+                return err;
+        }
+
+        if (auto err = init(*batch, request, *r)) {
+                return err;
+        }
+
+        if (auto err = WdfRequestMarkCancelableEx(request, cancel)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestMarkCancelableEx %!STATUS!", err);
+                WdfObjectDelete(batch->target);
+                return err;
+        }
+
+        advance(*batch);
+        return STATUS_PENDING;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+namespace usbip
+{
+
+/*
+ * Handler of vhci::ioctl::PLUGIN_HARDWARE_BATCH.
+ * Items are forwarded as IOCTL_PLUGIN_HARDWARE to itself, the request is pending until they are completed.
+ * The request is cancelable, devices that are attached at that moment remain attached.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS plugin_hardware_batch(_In_ WDFREQUEST request);
+
+} // namespace usbip
@@ -17,7 +17,7 @@
   */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-seqnum_t usbip::next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in)
+seqnum_t usbip::next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in, _In_ ULONG count)
 {
 	static_assert(!USBIP_DIR_OUT);
 	static_assert(USBIP_DIR_IN);
@@ -26,7 +26,9 @@ seqnum_t usbip::next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in)
 	static_assert(sizeof(seqnum) == sizeof(LONG));
 
 	while (true) {
-		if (seqnum_t num = InterlockedIncrement(reinterpret_cast<LONG*>(&seqnum)) << 1) {
+		auto last = seqnum_t(InterlockedAdd(reinterpret_cast<LONG*>(&seqnum), LONG(count)));
+
+		if (seqnum_t num = (last - (count - 1)) << 1; num && extract_num(num) <= extract_num(last << 1)) { // no wrap
 			return num |= seqnum_t(dir_in);
 		}
 	}
@@ -74,8 +76,15 @@ PAGED void usbip::free(_In_ device_ctx_ext *ext)
         PAGED_CODE();
 
         NT_ASSERT(ext);
+        NT_ASSERT(!ext->next_sock);
         free(ext->sock);
 
+        while (auto r = ext->retired) {
+                ext->retired = r->next;
+                free(r->sock);
+                ExFreePoolWithTag(r, pooltag);
+        }
+
         libdrv::FreeUnicodeString(ext->node_name, pooltag); // @see RtlFreeUnicodeString
         libdrv::FreeUnicodeString(ext->service_name, pooltag);
         libdrv::FreeUnicodeString(ext->busid, pooltag);
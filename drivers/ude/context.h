@@ -10,6 +10,10 @@
 
 #include <usbip\proto.h>
 
+#include "addrinfo_cache.h"
+#include "descriptor_cache.h"
+#include "frame_clock.h"
+
 #include <wdfusb.h>
 #include <UdeCx.h>
 
@@ -29,17 +33,34 @@ namespace wsk
 namespace usbip
 {
 
-enum { 
-        USB2_PORTS = 30,
+/*
+ * The number of ports of the root hub can be lowered by REG_DWORD Usb2Ports and Usb3Ports
+ * in the Parameters key of the driver. USB2 ports go first, USB3 ports follow them.
+ *
+ * UDECX_WDF_DEVICE_CONFIG does not document the maximal NumberOfUsb20Ports/NumberOfUsb30Ports,
+ * 30 of each kind is the configuration this driver has always used, larger values are not verified.
+ */
+enum {
+        USB2_PORTS = 30, // default and maximum
         USB3_PORTS = USB2_PORTS,
-        TOTAL_PORTS = USB2_PORTS + USB3_PORTS
+        MAX_PORTS = USB2_PORTS + USB3_PORTS,
 };
 
 constexpr auto is_valid_port(int port)
 {
-        return port > 0 && port <= TOTAL_PORTS;
+        return port > 0 && port <= MAX_PORTS;
 }
 
+/*
+ * Free ports of one kind (USB2 or USB3) of the root hub.
+ */
+struct roothub_ports
+{
+        RTL_BITMAP bitmap; // a bit is set if the port is occupied
+        ULONG bits[(MAX_PORTS + 31)/32];
+        int first; // port number of bit zero
+};
+
 /*
  * Context space for WDFDEVICE, Virtual Host Controller Interface.
  * The parent is WDFDRIVER.
@@ -48,9 +69,21 @@ struct vhci_ctx
 {
         WDFQUEUE sequential_queue; // see also WdfDeviceGetDefaultQueue
 
-        UDECXUSBDEVICE devices[TOTAL_PORTS]; // do not access directly, functions must be used
+        UDECXUSBDEVICE devices[MAX_PORTS]; // do not access directly, functions must be used
         WDFSPINLOCK devices_lock;
 
+        roothub_ports usb2_ports;
+        roothub_ports usb3_ports;
+        int total_ports; // usb2 + usb3, set at startup
+
+        UCHAR occupied[MAX_PORTS]; // dense list of claimed ports, the order is arbitrary
+        UCHAR occupied_pos[MAX_PORTS]; // occupied[occupied_pos[port - 1]] == port
+        int occupied_cnt;
+
+        UINT64 first_generation; // system time at startup, distinguishes instances of the driver
+        UINT64 generation; // starts from first_generation, incremented on every plug, unplug and state change of a port
+        UINT64 port_generation[MAX_PORTS]; // value of generation after the last change of the port
+
         LIST_ENTRY fileobjects; // @see fileobject_ctx::entry
         WDFQUEUE reads; // IRP_MJ_READ
         int events_subscribers; // SUM(fileobject_ctx::process_events)
@@ -58,6 +91,8 @@ struct vhci_ctx
 
         _KTHREAD *attach_thread;
         KEVENT attach_thread_stop;
+
+        addrinfo_cache addrinfo; // for ioctl::plugin_hardware
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(vhci_ctx, get_vhci_ctx)
 
@@ -70,6 +105,16 @@ inline auto get_handle(_In_ vhci_ctx *ctx)
 struct wsk_context;
 struct device_ctx;
 
+/*
+ * Sockets replaced by session recovery, see vhci::reconnect.
+ * A socket is closed but not freed while the device exists, see close_socket.
+ */
+struct retired_socket
+{
+        retired_socket *next;
+        wsk::SOCKET *sock;
+};
+
 /*
  * Context extention for device_ctx. 
  *
@@ -86,6 +131,8 @@ struct device_ctx_ext
 {
         device_ctx *ctx;
         wsk::SOCKET *sock;
+        wsk::SOCKET *next_sock; // is being connected by vhci::reconnect, protected by device_ctx::sock_lock
+        retired_socket *retired; // list head, protected by device_ctx::sock_lock
 
         // from ioctl::plugin_hardware
         // .Buffer-s are allocated in PagedPool, see create_device_ctx_ext
@@ -93,10 +140,27 @@ struct device_ctx_ext
         UNICODE_STRING service_name;
         UNICODE_STRING busid;
         //
+
+        SOCKADDR_INET remote; // address of the server, for session recovery
         
         vhci::imported_device_properties dev; // for ioctl::get_imported_devices
+        USHORT bcdDevice; // from OP_REP_IMPORT, see descriptor_snapshot.h
+        ULONGLONG rtt; // of OP_REQ_IMPORT, KeQueryInterruptTime units
+
+        ULONGLONG timeline[static_cast<int>(vhci::attach_stage::count)]; // KeQueryInterruptTime, see mark_stage
 };
 
+/*
+ * Only the first occurrence of a stage is recorded.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void mark_stage(_Inout_ device_ctx_ext &ext, _In_ vhci::attach_stage stage)
+{
+        if (auto &t = ext.timeline[static_cast<int>(stage)]; !t) {
+                t = KeQueryInterruptTime();
+        }
+}
+
 /*
  * Context space for UDECXUSBDEVICE - emulated USB device.
  */
@@ -121,11 +185,18 @@ struct device_ctx
         volatile bool unplugged; // initiated detach that may still be ongoing
         KEVENT detach_completed;
 
+        ULONG recovery_period; // seconds, zero if session recovery is disabled, see device::recover
+        volatile bool recovering; // connection is being reestablished, protected by send_lock
+        WDFWAITLOCK sock_lock; // for closing and replacement of ext->sock, ext->next_sock
+
         WDFWAITLOCK delete_lock; // serialize UdecxUsbDevicePlugOutAndDelete and UDECX_USB_DEVICE_STATE_CHANGE_CALLBACKS
 
         LIST_ENTRY requests; // list head, requests that are waiting for USBIP_RET_SUBMIT from a server
         WDFSPINLOCK requests_lock;
 
+        descriptor_cache descriptors; // responses on GET_DESCRIPTOR
+        frame_clock frames; // of the server's host controller
+
         // statistics
         UINT64 sent_requests; // were sent successfully
         UINT64 cancelable_requests; // marked as
@@ -174,11 +245,61 @@ struct request_ctx
 {
         LIST_ENTRY entry; // head is device_ctx::requests
         UDECXUSBENDPOINT endpoint;
-        seqnum_t seqnum;
+        seqnum_t seqnum; // of the first part
         bool cancelable;
+
+        // isoch URB with NumberOfPackets > USBIP_MAX_ISO_PACKETS is sent in parts, see isoch_part
+        USHORT parts; // seqnum of i-th part is seqnum + 2*i
+        USHORT unsent; // the request is marked cancelable when all parts are sent
+        USHORT pending; // parts without RET_SUBMIT
+        bool busy; // RET_SUBMIT of a part is being processed, see device::release_request
+        bool cancelled; // while it was busy
+        NTSTATUS error; // the first one, the request is completed with it when sends of all parts are completed
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
+constexpr auto contains(_In_ const request_ctx &req, _In_ seqnum_t seqnum)
+{
+        auto d = seqnum - req.seqnum;
+        return !(d & 1) && d/2 < req.parts;
+}
+
+enum { MAX_ISOCH_PARTS = 8 };
+
+/*
+ * Packets [first, first + count) and bytes [offset, offset + length) of TransferBuffer.
+ */
+struct isoch_part
+{
+        ULONG first;
+        ULONG count;
+        ULONG offset;
+        ULONG length;
+};
+
+constexpr ULONG isoch_parts(_In_ ULONG NumberOfPackets)
+{
+        return NumberOfPackets ? (NumberOfPackets - 1)/USBIP_MAX_ISO_PACKETS + 1 : 1;
+}
+
+/*
+ * Offsets of IsoPacket[] must be validated, see repack.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto get_isoch_part(_In_ const _URB_ISOCH_TRANSFER &r, _In_ ULONG index)
+{
+        isoch_part p{ .first = index*USBIP_MAX_ISO_PACKETS };
+        NT_ASSERT(!p.first || p.first < r.NumberOfPackets);
+
+        p.count = min(r.NumberOfPackets - p.first, ULONG(USBIP_MAX_ISO_PACKETS));
+        p.offset = p.first ? r.IsoPacket[p.first].Offset : 0;
+
+        auto end = p.first + p.count;
+        p.length = (end < r.NumberOfPackets ? r.IsoPacket[end].Offset : r.TransferBufferLength) - p.offset;
+
+        return p;
+}
+
 inline auto get_handle(_In_ request_ctx *ctx)
 {
         NT_ASSERT(ctx);
@@ -206,8 +327,8 @@ struct fileobject_ctx
 {
         LIST_ENTRY entry; // head is vhci_ctx::fileobjects
 
-        WDFCOLLECTION events; // WDFMEMORY(device_state) that are waiting for IRP_MJ_READ
-        enum { MAX_EVENTS = 2*TOTAL_PORTS }; // arbitrary
+        WDFCOLLECTION events; // WDFMEMORY(device_state) that are waiting for IRP_MJ_READ, one per device
+        enum { MAX_EVENTS = 2*MAX_PORTS }; // arbitrary
 
         bool process_events; // if IRP_MJ_READ was issued, see vhci_ctx::events_subscribers
 };
@@ -220,9 +341,12 @@ inline auto get_handle(_In_ fileobject_ctx *ctx)
 }
 
 
+/*
+ * @param count of consecutive seqnums to reserve, the first one is returned
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-seqnum_t next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in);
+seqnum_t next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in, _In_ ULONG count = 1);
 
 constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
 constexpr auto extract_dir(seqnum_t seqnum) { return usbip_dir(seqnum & 1); }
@@ -0,0 +1,533 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_cache.h"
+#include "trace.h"
+#include "descriptor_cache.tmh"
+
+#include "driver.h"
+
+#include <libdrv\ch9.h>
+
+namespace
+{
+
+using namespace usbip;
+
+struct descriptor_cache_entry
+{
+        LIST_ENTRY entry; // head is descriptor_cache::entries
+
+        USHORT wValue; // descriptor type and index
+        USHORT wIndex; // language id for string descriptors
+
+        USHORT requested; // wLength of the request
+        USHORT length; // of data, actual length of the response
+        bool complete; // the whole descriptor is cached, requests with greater wLength can be served
+        bool prewarmed; // loaded from a snapshot, was not received from the device yet
+
+        UCHAR data[ANYSIZE_ARRAY];
+};
+
+/*
+ * Serialized descriptor_cache_entry, see save() and load().
+ */
+#include <pshpack1.h>
+struct descriptor_record
+{
+        USHORT wValue;
+        USHORT wIndex;
+        USHORT requested;
+        USHORT length;
+        bool complete;
+        UCHAR data[ANYSIZE_ARRAY];
+};
+#include <poppack.h>
+
+constexpr auto record_size(_In_ ULONG length)
+{
+        return ULONG(offsetof(descriptor_record, data)) + length;
+}
+
+constexpr USHORT DEVICE_DESCRIPTOR = USB_DEVICE_DESCRIPTOR_TYPE << 8; // wValue
+
+inline auto& get_entry(_In_ LIST_ENTRY *entry)
+{
+        return *CONTAINING_RECORD(entry, descriptor_cache_entry, entry);
+}
+
+constexpr auto get_type(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r)
+{
+        return r.wValue.HiByte;
+}
+
+/*
+ * The response is shorter than requested or the length of descriptor (wTotalLength, bLength) is reached.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_complete(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r, _In_ const UCHAR *data, _In_ ULONG length)
+{
+        if (length < r.wLength) {
+                return true;
+        }
+
+        switch (get_type(r)) {
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                static_assert(offsetof(USB_CONFIGURATION_DESCRIPTOR, wTotalLength) ==
+                              offsetof(USB_BOS_DESCRIPTOR, wTotalLength));
+
+                if (length >= sizeof(USB_BOS_DESCRIPTOR)) {
+                        auto &d = *reinterpret_cast<const USB_BOS_DESCRIPTOR*>(data);
+                        return d.wTotalLength == length;
+                }
+                break;
+        default:
+                return data[0] == length; // bLength
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+descriptor_cache_entry* find(_In_ descriptor_cache &cache, _In_ USHORT wValue, _In_ USHORT wIndex)
+{
+        for (auto head = &cache.entries, entry = head->Flink; entry != head; entry = entry->Flink) {
+                if (auto &e = get_entry(entry); e.wValue == wValue && e.wIndex == wIndex) {
+                        return &e;
+                }
+        }
+
+        return nullptr;
+}
+
+inline auto find(_In_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r)
+{
+        return find(cache, r.wValue.W, r.wIndex.W);
+}
+
+/*
+ * @return the index of serial number string or zero
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UCHAR get_serial_number_index(_In_ descriptor_cache &cache)
+{
+        auto e = find(cache, DEVICE_DESCRIPTOR, 0);
+        return e && e->length == sizeof(USB_DEVICE_DESCRIPTOR) ?
+                reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(e->data)->iSerialNumber : 0;
+}
+
+/*
+ * Prewarmed entry is not used until the snapshot is verified. Serial number is always read from the device.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto can_use(_In_ descriptor_cache &cache, _In_ const descriptor_cache_entry &e)
+{
+        if (!e.prewarmed) {
+                return true;
+        } else if (!cache.snapshot_verified) {
+                return false;
+        }
+
+        auto idx = get_serial_number_index(cache);
+        return !(idx && e.wValue == ((USB_STRING_DESCRIPTOR_TYPE << 8) | idx));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void remove(_Inout_ descriptor_cache &cache, _Inout_ descriptor_cache_entry &e)
+{
+        NT_ASSERT(cache.count);
+        --cache.count;
+
+        if (e.prewarmed) {
+                NT_ASSERT(cache.prewarmed);
+                --cache.prewarmed;
+        }
+
+        RemoveEntryList(&e.entry);
+        ExFreePoolWithTag(&e, pooltag);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void remove_all(_Inout_ descriptor_cache &cache)
+{
+        while (!IsListEmpty(&cache.entries)) {
+                auto &e = get_entry(cache.entries.Flink);
+                remove(cache, e);
+        }
+
+        NT_ASSERT(!cache.count);
+        NT_ASSERT(!cache.prewarmed);
+
+        cache.snapshot_verified = false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void remove_prewarmed(_Inout_ descriptor_cache &cache)
+{
+        for (auto head = &cache.entries, entry = head->Flink; entry != head; ) {
+                auto &e = get_entry(entry);
+                entry = entry->Flink;
+
+                if (e.prewarmed) {
+                        remove(cache, e);
+                }
+        }
+
+        NT_ASSERT(!cache.prewarmed);
+        cache.snapshot_verified = false;
+}
+
+/*
+ * A response from the device is compared with prewarmed entry.
+ * @return false if they differ, prewarmed entries were removed
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto verify(_Inout_ descriptor_cache &cache, _Inout_ descriptor_cache_entry &old, _In_ const descriptor_cache_entry &e)
+{
+        NT_ASSERT(old.prewarmed);
+
+        if (auto len = min(old.length, e.length); RtlCompareMemory(old.data, e.data, len) != len) {
+                Trace(TRACE_LEVEL_INFORMATION, "wValue %#x, wIndex %#x differs, %lu prewarmed entries removed",
+                                                e.wValue, e.wIndex, cache.prewarmed);
+                remove_prewarmed(cache);
+                return false;
+        }
+
+        if (e.length >= old.length || e.complete) {
+                old.prewarmed = false;
+                --cache.prewarmed;
+        }
+
+        if (e.wValue == DEVICE_DESCRIPTOR && e.length == sizeof(USB_DEVICE_DESCRIPTOR)) {
+                cache.snapshot_verified = true;
+                TraceDbg("snapshot verified, %lu prewarmed entries", cache.prewarmed);
+        }
+
+        return true;
+}
+
+/*
+ * @return bytes written or zero if the cache does not have the device descriptor
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG serialize(_In_ descriptor_cache &cache, _Out_writes_bytes_opt_(size) void *buffer, _In_ ULONG size)
+{
+        if (auto e = find(cache, DEVICE_DESCRIPTOR, 0); !e || e->prewarmed) {
+                return 0;
+        }
+
+        auto buf = static_cast<UCHAR*>(buffer);
+        ULONG written = 0;
+
+        for (auto head = &cache.entries, entry = head->Flink; entry != head; entry = entry->Flink) {
+
+                auto &e = get_entry(entry);
+                auto sz = record_size(e.length);
+
+                if (e.prewarmed) {
+                        continue;
+                } else if (written + sz > size) {
+                        break;
+                } else if (buf) {
+                        descriptor_record r {
+                                .wValue = e.wValue,
+                                .wIndex = e.wIndex,
+                                .requested = e.requested,
+                                .length = e.length,
+                                .complete = e.complete
+                        };
+
+                        RtlCopyMemory(buf + written, &r, offsetof(descriptor_record, data));
+                        RtlCopyMemory(buf + written + offsetof(descriptor_record, data), e.data, e.length);
+                }
+
+                written += sz;
+        }
+
+        return written;
+}
+
+/*
+ * Serialized entries will be saved on detach if the cache is empty then.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void take_snapshot(_Inout_ descriptor_cache &cache)
+{
+        auto len = serialize(cache, nullptr, cache.MAX_SNAPSHOT);
+        if (!len) {
+                return;
+        }
+
+        auto buf = ExAllocatePoolUninitialized(NonPagedPoolNx, len, pooltag);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", len);
+                return;
+        }
+
+        NT_VERIFY(serialize(cache, buf, len) == len);
+
+        if (cache.snapshot) {
+                ExFreePoolWithTag(cache.snapshot, pooltag);
+        }
+
+        cache.snapshot = buf;
+        cache.snapshot_length = len;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void log_stat(_In_ const descriptor_cache &cache, _In_ const char *what)
+{
+        auto total = cache.hits + cache.misses;
+
+        TraceDbg("%s: hits %lu of %lu (%lu%%), %lu bytes were not transferred; "
+                 "lifetime hits %I64u, misses %I64u, invalidated %lu",
+                  what, cache.hits, total, total ? 100*cache.hits/total : 0, cache.saved_bytes,
+                  cache.total_hits, cache.total_misses, cache.invalidated);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init(_Inout_ descriptor_cache &cache, _In_ WDFOBJECT parent)
+{
+        PAGED_CODE();
+
+        InitializeListHead(&cache.entries);
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = parent;
+
+        if (auto err = WdfSpinLockCreate(&attr, &cache.lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::clear(_Inout_ descriptor_cache &cache)
+{
+        if (!cache.lock) { // init was not called or failed
+                return;
+        }
+
+        wdf::Lock lck(cache.lock);
+
+        log_stat(cache, "clear");
+        remove_all(cache);
+
+        if (auto &ptr = cache.snapshot) {
+                ExFreePoolWithTag(ptr, pooltag);
+                ptr = nullptr;
+                cache.snapshot_length = 0;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r)
+{
+        if (!(r.bmRequestType.B == (USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) &&
+              r.bRequest == USB_REQUEST_GET_DESCRIPTOR && r.wLength)) {
+                return false;
+        }
+
+        switch (get_type(r)) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_STRING_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return true;
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::lookup(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r,
+        _Out_writes_bytes_(length) void *buffer, _Inout_ ULONG &length)
+{
+        NT_ASSERT(is_cacheable(r));
+        wdf::Lock lck(cache.lock);
+
+        auto e = find(cache, r);
+        ULONG len = e ? min(r.wLength, length) : 0;
+
+        if (!e || !can_use(cache, *e) || !(len <= e->length || e->complete)) {
+                ++cache.misses;
+                ++cache.total_misses;
+                return false;
+        }
+
+        length = min(len, e->length);
+        RtlCopyMemory(buffer, e->data, length);
+
+        ++cache.hits;
+        ++cache.total_hits;
+        cache.saved_bytes += length;
+
+        TraceDbg("%!usb_descriptor_type! #%d, wIndex %#x, wLength %d -> %lu%s, hits %lu, misses %lu",
+                  get_type(r), r.wValue.LowByte, r.wIndex.W, r.wLength, length,
+                  e->prewarmed ? " (prewarmed)" : "", cache.hits, cache.misses);
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::insert(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r,
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length)
+{
+        NT_ASSERT(is_cacheable(r));
+
+        if (!length || length > cache.MAX_LENGTH || length > r.wLength) {
+                return;
+        }
+
+        auto sz = offsetof(descriptor_cache_entry, data) + length;
+
+        auto e = (descriptor_cache_entry*)ExAllocatePoolZero(NonPagedPoolNx, sz, pooltag);
+        if (!e) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sz);
+                return;
+        }
+
+        e->wValue = r.wValue.W;
+        e->wIndex = r.wIndex.W;
+        e->requested = r.wLength;
+        e->length = static_cast<USHORT>(length);
+        RtlCopyMemory(e->data, data, length);
+        e->complete = is_complete(r, e->data, length);
+
+        wdf::Lock lck(cache.lock);
+
+        auto old = find(cache, r);
+
+        if (old && old->prewarmed && !verify(cache, *old, *e)) {
+                old = nullptr; // was removed
+        }
+
+        if (!old) {
+                //
+        } else if (old->complete || old->length >= length) { // already has the same or more data
+                ExFreePoolWithTag(e, pooltag);
+                return;
+        } else {
+                remove(cache, *old);
+        }
+
+        if (cache.count == cache.MAX_ENTRIES) {
+                ExFreePoolWithTag(e, pooltag);
+                return;
+        }
+
+        InsertTailList(&cache.entries, &e->entry);
+        ++cache.count;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::invalidate(_Inout_ descriptor_cache &cache, _In_ const char *reason)
+{
+        wdf::Lock lck(cache.lock);
+
+        ++cache.invalidated;
+        log_stat(cache, reason);
+
+        take_snapshot(cache);
+        remove_all(cache);
+
+        cache.hits = 0;
+        cache.misses = 0;
+        cache.saved_bytes = 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::save(_Inout_ descriptor_cache &cache, _Out_writes_bytes_(size) void *buffer, _In_ ULONG size)
+{
+        wdf::Lock lck(cache.lock);
+
+        if (auto len = serialize(cache, nullptr, size); len) {
+                return serialize(cache, buffer, len);
+        }
+
+        if (auto len = cache.snapshot_length; len && len <= size) {
+                RtlCopyMemory(buffer, cache.snapshot, len);
+                return len;
+        }
+
+        return 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::load(_Inout_ descriptor_cache &cache, _In_reads_bytes_(size) const void *buffer, _In_ ULONG size)
+{
+        auto buf = static_cast<const UCHAR*>(buffer);
+        ULONG cnt = 0;
+
+        wdf::Lock lck(cache.lock);
+        NT_ASSERT(!cache.count);
+
+        for (ULONG off = 0; off < size && cache.count < cache.MAX_ENTRIES; ) {
+
+                descriptor_record r;
+                if (off + offsetof(descriptor_record, data) > size) {
+                        break;
+                }
+                RtlCopyMemory(&r, buf + off, offsetof(descriptor_record, data));
+
+                auto sz = record_size(r.length);
+                if (!r.length || r.length > cache.MAX_LENGTH || r.length > r.requested || off + sz > size) {
+                        Trace(TRACE_LEVEL_ERROR, "Invalid record at offset %lu, length %d", off, r.length);
+                        break;
+                }
+
+                auto e_sz = offsetof(descriptor_cache_entry, data) + r.length;
+
+                auto e = (descriptor_cache_entry*)ExAllocatePoolZero(NonPagedPoolNx, e_sz, pooltag);
+                if (!e) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", e_sz);
+                        break;
+                }
+
+                e->wValue = r.wValue;
+                e->wIndex = r.wIndex;
+                e->requested = r.requested;
+                e->length = r.length;
+                e->complete = r.complete;
+                e->prewarmed = true;
+                RtlCopyMemory(e->data, buf + off + offsetof(descriptor_record, data), r.length);
+
+                InsertTailList(&cache.entries, &e->entry);
+                ++cache.count;
+                ++cache.prewarmed;
+                ++cnt;
+
+                off += sz;
+        }
+
+        return cnt;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usbspec.h>
+
+namespace usbip
+{
+
+/*
+ * Responses on standard GET_DESCRIPTOR requests to the device (device, configuration, string, BOS).
+ *
+ * Windows enumeration and class drivers read the same descriptors over and over again,
+ * each request is a round trip to the server. Cached descriptors are returned locally.
+ * The cache is invalidated by SET_CONFIGURATION and port reset.
+ *
+ * The cache can be prewarmed from a snapshot, see descriptor_snapshot.h. Prewarmed entries are not used
+ * until the device descriptor is received from the device and matches the one from the snapshot.
+ * The serial number string is always requested from the device, if it differs, prewarmed entries are dropped.
+ */
+struct descriptor_cache
+{
+        LIST_ENTRY entries; // descriptor_cache_entry::entry (see .cpp)
+        ULONG count;
+        enum { MAX_ENTRIES = 32, MAX_LENGTH = 4096, MAX_SNAPSHOT = 16*1024 };
+
+        WDFSPINLOCK lock;
+
+        ULONG prewarmed; // entries from a snapshot that were not received from the device
+        bool snapshot_verified; // the device descriptor from the snapshot matches the one of the device
+
+        void *snapshot; // serialized entries before the last invalidation, NonPagedPoolNx
+        ULONG snapshot_length;
+
+        // statistics since the last invalidation, i.e. per enumeration
+        ULONG hits; // round trips saved
+        ULONG misses;
+        ULONG saved_bytes;
+
+        // statistics for the device lifetime
+        UINT64 total_hits;
+        UINT64 total_misses;
+        ULONG invalidated;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_Inout_ descriptor_cache &cache, _In_ WDFOBJECT parent);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void clear(_Inout_ descriptor_cache &cache);
+
+/*
+ * @return true if a request can be cached
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r);
+
+/*
+ * @param length IN - size of buffer, OUT - bytes copied
+ * @return true if the response is found in the cache and copied to buffer
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool lookup(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r,
+        _Out_writes_bytes_(length) void *buffer, _Inout_ ULONG &length);
+
+/*
+ * @param data the response of the server
+ * @param length actual length of the response
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void insert(
+        _Inout_ descriptor_cache &cache, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r,
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void invalidate(_Inout_ descriptor_cache &cache, _In_ const char *reason);
+
+/*
+ * Entries that were received from the device are serialized. If the cache does not have the device descriptor,
+ * the entries that were cached before the last invalidation are returned (the enumeration usually ends
+ * with SET_CONFIGURATION).
+ * @return bytes written, zero if there is nothing to save or buffer is too small
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG save(_Inout_ descriptor_cache &cache, _Out_writes_bytes_(size) void *buffer, _In_ ULONG size);
+
+/*
+ * Entries serialized by save() are added as prewarmed.
+ * @return number of loaded entries
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG load(_Inout_ descriptor_cache &cache, _In_reads_bytes_(size) const void *buffer, _In_ ULONG size);
+
+} // namespace usbip
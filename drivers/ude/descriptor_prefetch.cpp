@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_prefetch.h"
+#include "trace.h"
+#include "descriptor_prefetch.tmh"
+
+#include "context.h"
+#include "network.h"
+#include "persistent.h"
+#include "driver.h"
+#include "wsk_receive.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\pdu.h>
+#include <libdrv\usbd_helper.h>
+#include <libdrv\dbgcommon.h>
+#include <libdrv\irp.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum {
+        MAX_REQUESTS = 8, // in a batch
+        MAX_LANGIDS = 2, // strings are prefetched for these languages only
+        BUF_LEN = descriptor_cache::MAX_LENGTH,
+};
+
+constexpr auto PREFETCH_TIMEOUT = 5*wdm::second; // for both round trips
+
+struct batch
+{
+        USB_DEFAULT_PIPE_SETUP_PACKET setup[MAX_REQUESTS];
+        seqnum_t seqnum[MAX_REQUESTS];
+
+        void *dst[MAX_REQUESTS]; // optional, a copy of the response
+        ULONG dst_len[MAX_REQUESTS]; // IN - size of dst, OUT - bytes copied
+
+        int count;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void add(
+        _Inout_ batch &b, _In_ UCHAR type, _In_ UCHAR index, _In_ USHORT wIndex, _In_ USHORT wLength,
+        _Out_writes_bytes_opt_(dst_len) void *dst = nullptr, _In_ ULONG dst_len = 0)
+{
+        PAGED_CODE();
+        NT_ASSERT(b.count < MAX_REQUESTS);
+
+        b.dst[b.count] = dst;
+        b.dst_len[b.count] = dst_len;
+
+        b.setup[b.count++] = USB_DEFAULT_PIPE_SETUP_PACKET {
+                .bmRequestType{.B = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE},
+                .bRequest = USB_REQUEST_GET_DESCRIPTOR,
+                .wValue{.W = USHORT((type << 8) | index)},
+                .wIndex{.W = wIndex},
+                .wLength = wLength,
+        };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto send_requests(_Inout_ device_ctx &dev, _Inout_ batch &b)
+{
+        PAGED_CODE();
+
+        usbip_header hdr[MAX_REQUESTS]{};
+        const ULONG flags = to_linux_flags(USBD_SHORT_TRANSFER_OK | USBD_TRANSFER_DIRECTION_IN, true);
+
+        for (int i = 0; i < b.count; ++i) {
+                auto &h = hdr[i];
+                auto &setup = b.setup[i];
+
+                h.base.command = USBIP_CMD_SUBMIT;
+                h.base.seqnum = b.seqnum[i] = next_seqnum(dev, true);
+                h.base.devid = dev.devid();
+                h.base.direction = USBIP_DIR_IN;
+                h.base.ep = 0;
+
+                auto &cmd = h.u.cmd_submit;
+                cmd.transfer_flags = flags;
+                cmd.transfer_buffer_length = setup.wLength;
+                cmd.number_of_packets = number_of_packets_non_isoch;
+
+                static_assert(sizeof(cmd.setup) == sizeof(setup));
+                RtlCopyMemory(cmd.setup, &setup, sizeof(setup));
+
+                byteswap_header(h, swap_dir::host2net);
+        }
+
+        return send(dev.sock(), memory::stack, hdr, b.count*sizeof(*hdr)); // the whole batch at once
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto find(_In_ const batch &b, _In_ seqnum_t seqnum)
+{
+        PAGED_CODE();
+
+        for (int i = 0; i < b.count; ++i) {
+                if (b.seqnum[i] == seqnum) {
+                        return i;
+                }
+        }
+
+        return -1;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS recv_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        auto event = static_cast<KEVENT*>(context);
+        KeSetEvent(event, IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+/*
+ * Synchronous receive that is cancelled at the deadline, a server that does not respond must not stall the attach.
+ * @param deadline KeQueryInterruptTime
+ * @return STATUS_IO_TIMEOUT if the deadline has passed, the connection is in unknown state after that
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS recv(
+        _Inout_ device_ctx &dev, _In_ memory pool, _Out_writes_bytes_(len) void *data, _In_ ULONG len,
+        _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+
+        Mdl mdl(data, len);
+        if (auto err = pool == memory::nonpaged ? mdl.prepare_nonpaged() : mdl.prepare_paged(IoWriteAccess)) {
+                return err;
+        }
+
+        libdrv::irp_ptr irp(CCHAR(1), false);
+        if (!irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp error");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KEVENT done;
+        KeInitializeEvent(&done, NotificationEvent, false);
+
+        IoSetCompletionRoutine(irp.get(), recv_complete, &done, true, true, true);
+
+        WSK_BUF buf{ .Mdl = mdl.get(), .Length = len };
+        if (auto st = receive(dev.sock(), &buf, WSK_FLAG_WAITALL, irp.get()); st == STATUS_NOT_SUPPORTED) {
+                return st; // the socket is closed, IRP was not passed to WSK
+        }
+
+        auto now = KeQueryInterruptTime();
+        auto timeout = make_timeout(now < deadline ? deadline - now : 0, wdm::period::relative);
+
+        bool expired = false;
+
+        if (KeWaitForSingleObject(&done, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT) {
+                expired = IoCancelIrp(irp.get());
+                KeWaitForSingleObject(&done, Executive, KernelMode, false, nullptr);
+        }
+
+        auto &ios = irp.get()->IoStatus;
+
+        if (expired && ios.Status == STATUS_CANCELLED) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, no response in %I64u ms",
+                                          ptr04x(get_handle(&dev)), PREFETCH_TIMEOUT/wdm::msec);
+                return STATUS_IO_TIMEOUT;
+        } else if (NT_SUCCESS(ios.Status) && ios.Information != len) {
+                return STATUS_RECEIVE_PARTIAL;
+        }
+
+        return ios.Status;
+}
+
+/*
+ * Responses can arrive in any order.
+ * Responses are processed as the receive thread does, see post_get_descriptor.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS recv_responses(_Inout_ device_ctx &dev, _Inout_ batch &b, _Inout_ UCHAR *buf, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+
+        for (int cnt = 0; cnt < b.count; ++cnt) {
+
+                usbip_header hdr;
+                if (auto err = recv(dev, memory::stack, &hdr, sizeof(hdr), deadline)) {
+                        return err;
+                }
+                byteswap_header(hdr, swap_dir::net2host);
+
+                auto &ret = hdr.u.ret_submit;
+                auto i = hdr.base.command == USBIP_RET_SUBMIT ? find(b, hdr.base.seqnum) : -1;
+
+                if (i < 0 || ret.actual_length < 0 || ret.actual_length > b.setup[i].wLength) {
+                        Trace(TRACE_LEVEL_ERROR, "Unexpected response: command %u, seqnum %u, actual_length %d",
+                                                  hdr.base.command, hdr.base.seqnum, ret.actual_length);
+                        return USBIP_ERROR_PROTOCOL;
+                }
+
+                auto len = static_cast<ULONG>(ret.actual_length);
+
+                if (!len) {
+                        //
+                } else if (auto err = recv(dev, memory::nonpaged, buf, len, deadline)) {
+                        return err;
+                }
+
+                auto &setup = b.setup[i];
+                TraceDbg("%!usb_descriptor_type! #%d, wIndex %#x, status %d, actual_length %lu",
+                          setup.wValue.HiByte, setup.wValue.LowByte, setup.wIndex.W, ret.status, len);
+
+                if (ret.status || !len) {
+                        b.dst_len[i] = 0;
+                        continue;
+                }
+
+                auto dsc = reinterpret_cast<USB_COMMON_DESCRIPTOR*>(buf);
+                if (len >= sizeof(*dsc)) {
+                        post_get_descriptor(dev, dsc, static_cast<USHORT>(len));
+                }
+
+                insert(dev.descriptors, setup, buf, len); // after post_get_descriptor
+
+                if (auto dst = b.dst[i]) {
+                        auto &dst_len = b.dst_len[i];
+                        dst_len = min(dst_len, len);
+                        RtlCopyMemory(dst, buf, dst_len);
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto run(_Inout_ device_ctx &dev, _Inout_ batch &b, _Inout_ UCHAR *buf, _In_ ULONGLONG deadline)
+{
+        PAGED_CODE();
+
+        if (!b.count) {
+                return STATUS_SUCCESS;
+        }
+
+        if (auto err = send_requests(dev, b)) {
+                return err;
+        }
+
+        return recv_responses(dev, b, buf, deadline);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::prefetch_descriptors(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        NT_ASSERT(!dev.recv_thread);
+
+        if (!get_parameter(L"PrefetchDescriptors")) {
+                return STATUS_SUCCESS;
+        }
+
+        unique_ptr buf(NonPagedPoolNx, BUF_LEN);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", BUF_LEN);
+                return STATUS_SUCCESS; // not an error for attach
+        }
+
+        auto start = KeQueryInterruptTime();
+        auto deadline = start + PREFETCH_TIMEOUT;
+
+        USB_DEVICE_DESCRIPTOR dd{};
+        struct {
+                UCHAR bLength;
+                UCHAR bDescriptorType;
+                USHORT wLANGID[MAX_LANGIDS];
+        } langids{};
+
+        batch b{};
+        add(b, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, sizeof(dd), &dd, sizeof(dd));
+        add(b, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, 1024);
+        add(b, USB_STRING_DESCRIPTOR_TYPE, 0, 0, MAXUCHAR, &langids, sizeof(langids));
+
+        if (auto err = run(dev, b, buf.get<UCHAR>(), deadline)) {
+                Trace(TRACE_LEVEL_ERROR, "%!STATUS!", err);
+                return err;
+        }
+
+        if (b.dst_len[0] != sizeof(dd)) {
+                return STATUS_SUCCESS;
+        }
+
+        ULONG langid_cnt = 0;
+        if (auto len = min(b.dst_len[2], ULONG(langids.bLength)); len > offsetof(decltype(langids), wLANGID)) {
+                langid_cnt = ULONG(len - offsetof(decltype(langids), wLANGID))/sizeof(*langids.wLANGID);
+        }
+
+        const UCHAR indices[] = { dd.iManufacturer, dd.iProduct, dd.iSerialNumber };
+        b.count = 0;
+
+        for (ULONG i = 0; i < langid_cnt; ++i) {
+                for (auto idx: indices) {
+                        if (idx && b.count < MAX_REQUESTS) {
+                                add(b, USB_STRING_DESCRIPTOR_TYPE, idx, langids.wLANGID[i], MAXUCHAR);
+                        }
+                }
+        }
+
+        if (auto err = run(dev, b, buf.get<UCHAR>(), deadline)) {
+                Trace(TRACE_LEVEL_ERROR, "%!STATUS!", err);
+                return err;
+        }
+
+        TraceDbg("dev %04x, %lu descriptors cached in %I64u ms", ptr04x(get_handle(&dev)), dev.descriptors.count,
+                  (KeQueryInterruptTime() - start)/wdm::msec);
+
+        return STATUS_SUCCESS;
+}
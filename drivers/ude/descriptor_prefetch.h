@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * Windows enumeration reads the device, configuration and string descriptors one by one,
+ * each request is a round trip to the server. If REG_DWORD PrefetchDescriptors in the Parameters key
+ * of the driver is not zero, these requests are pipelined before the device is plugged in
+ * and responses are put into the descriptor cache. It takes two round trips.
+ *
+ * Must be called before the receive thread is started.
+ * @return error if the connection is broken or the server does not respond in time
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS prefetch_descriptors(_Inout_ device_ctx &dev);
+
+} // namespace usbip
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_snapshot.h"
+#include "trace.h"
+#include "descriptor_snapshot.tmh"
+
+#include "context.h"
+#include "persistent.h"
+#include "driver.h"
+
+#include <ntstrsafe.h>
+
+namespace
+{
+
+using namespace usbip;
+
+const auto snapshots_subkey = L"DescriptorSnapshots";
+
+struct snapshot_header
+{
+        USHORT size; // self size
+        USHORT idVendor;
+        USHORT idProduct;
+        USHORT bcdDevice;
+        LONG64 saved; // KeQuerySystemTime, the least recently saved snapshots are evicted first
+};
+
+/*
+ * Context space of the work item that writes a snapshot, its size depends on the length of the value name.
+ */
+struct snapshot_ctx
+{
+        ULONG max_cnt; // of snapshots
+        ULONG length; // of the value, header and descriptors
+        UNICODE_STRING name;
+
+        snapshot_header hdr; // save() acquires a spin lock, context space is allocated from nonpaged pool
+        UCHAR descriptors[descriptor_cache::MAX_SNAPSHOT];
+
+        WCHAR name_buf[ANYSIZE_ARRAY];
+};
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(snapshot_ctx, get_snapshot_ctx)
+
+static_assert(offsetof(snapshot_ctx, descriptors) == offsetof(snapshot_ctx, hdr) + sizeof(snapshot_header));
+
+constexpr auto get_snapshot_ctx_size(_In_ USHORT name_size)
+{
+        auto n = offsetof(snapshot_ctx, name_buf) + name_size;
+        return max(n, sizeof(snapshot_ctx));
+}
+
+/*
+ * @return the maximal number of stored snapshots, zero if snapshots are disabled
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto max_snapshots()
+{
+        PAGED_CODE();
+        return get_parameter(L"DescriptorSnapshots");
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto make_header(_In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        return snapshot_header {
+                .size = sizeof(snapshot_header),
+                .idVendor = ext.dev.vendor,
+                .idProduct = ext.dev.product,
+                .bcdDevice = ext.bcdDevice,
+        };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS open_snapshots_key(_Out_ Registry &key, _In_ ACCESS_MASK DesiredAccess)
+{
+        PAGED_CODE();
+
+        Registry params;
+        if (auto err = open_parameters_key(params, KEY_CREATE_SUB_KEY)) {
+                return err;
+        }
+
+        UNICODE_STRING name;
+        RtlUnicodeStringInit(&name, snapshots_subkey);
+
+        WDFKEY k{};
+        auto st = WdfRegistryCreateKey(params.get(), &name, DesiredAccess, REG_OPTION_NON_VOLATILE,
+                                       nullptr, WDF_NO_OBJECT_ATTRIBUTES, &k);
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "WdfRegistryCreateKey('%!USTR!') %!STATUS!", &name, st);
+        }
+
+        key.reset(k);
+        return st;
+}
+
+/*
+ * @return size in bytes of the value name host:service/busid
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_value_name_size(_In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto len = ext.node_name.Length + ext.service_name.Length + ext.busid.Length + 2*sizeof(WCHAR);
+        return static_cast<USHORT>(len);
+}
+
+/*
+ * @param name.Buffer must have get_value_name_size(ext) bytes
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS make_value_name(_Inout_ UNICODE_STRING &name, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        name.Length = 0;
+        name.MaximumLength = get_value_name_size(ext);
+
+        return RtlUnicodeStringPrintf(&name, L"%wZ:%wZ/%wZ", &ext.node_name, &ext.service_name, &ext.busid);
+}
+
+/*
+ * @param buf will hold the value name host:service/busid
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS make_value_name(_Out_ UNICODE_STRING &name, _Out_ unique_ptr &buf, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto len = get_value_name_size(ext);
+
+        buf = unique_ptr(PagedPool, len);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %u bytes", len);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        name.Buffer = buf.get<WCHAR>();
+        return make_value_name(name, ext);
+}
+
+/*
+ * Values of other types and snapshots of older formats are the oldest ones.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_saved_time(_In_ const KEY_VALUE_PARTIAL_INFORMATION &info, _In_ NTSTATUS status)
+{
+        PAGED_CODE();
+
+        auto &hdr = *reinterpret_cast<const snapshot_header*>(info.Data);
+
+        return status == STATUS_SUCCESS && info.Type == REG_BINARY && info.DataLength > sizeof(hdr) &&
+               hdr.size == sizeof(hdr) ? hdr.saved : 0LL;
+}
+
+/*
+ * @param buf is used for KEY_VALUE_PARTIAL_INFORMATION
+ * @param cnt the number of values in the key
+ * @param oldest index of the least recently saved snapshot
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS find_oldest(
+        _In_ HANDLE key, _Out_ ULONG &cnt, _Out_ ULONG &oldest, _Inout_ unique_ptr &buf, _In_ ULONG buf_size)
+{
+        PAGED_CODE();
+
+        cnt = 0;
+        oldest = 0;
+
+        auto &info = *buf.get<KEY_VALUE_PARTIAL_INFORMATION>();
+        auto oldest_time = MAXLONG64;
+
+        for (;; ++cnt) {
+                ULONG len{};
+                auto st = ZwEnumerateValueKey(key, cnt, KeyValuePartialInformation, &info, buf_size, &len);
+
+                if (st == STATUS_NO_MORE_ENTRIES) {
+                        return STATUS_SUCCESS;
+                } else if (NT_ERROR(st)) { // STATUS_BUFFER_OVERFLOW is a warning
+                        Trace(TRACE_LEVEL_ERROR, "ZwEnumerateValueKey(%lu) %!STATUS!", cnt, st);
+                        return st;
+                }
+
+                if (auto t = get_saved_time(info, st); t < oldest_time) {
+                        oldest_time = t;
+                        oldest = cnt;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS remove_value(_In_ HANDLE key, _In_ ULONG index, _Inout_ unique_ptr &buf, _In_ ULONG buf_size)
+{
+        PAGED_CODE();
+
+        auto &info = *buf.get<KEY_VALUE_BASIC_INFORMATION>();
+        ULONG len{};
+
+        if (auto err = ZwEnumerateValueKey(key, index, KeyValueBasicInformation, &info, buf_size, &len)) {
+                Trace(TRACE_LEVEL_ERROR, "ZwEnumerateValueKey(%lu) %!STATUS!", index, err);
+                return err;
+        }
+
+        UNICODE_STRING name {
+                .Length = static_cast<USHORT>(info.NameLength),
+                .MaximumLength = static_cast<USHORT>(info.NameLength),
+                .Buffer = info.Name
+        };
+
+        auto st = ZwDeleteValueKey(key, &name);
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "ZwDeleteValueKey('%!USTR!') %!STATUS!", &name, st);
+        } else {
+                TraceDbg("'%!USTR!' evicted", &name);
+        }
+
+        return st;
+}
+
+/*
+ * Removes the least recently saved snapshots while there are more than max_cnt of them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void evict(_In_ WDFKEY key, _In_ ULONG max_cnt)
+{
+        PAGED_CODE();
+
+        constexpr ULONG maxlen = sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(snapshot_ctx::hdr) +
+                                 sizeof(snapshot_ctx::descriptors);
+
+        unique_ptr buf(PagedPool, maxlen);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", maxlen);
+                return;
+        }
+
+        auto h = WdfRegistryWdmGetHandle(key);
+
+        for (ULONG cnt, oldest; !find_oldest(h, cnt, oldest, buf, maxlen) && cnt > max_cnt; ) {
+                if (remove_value(h, oldest, buf, maxlen)) {
+                        break;
+                }
+        }
+}
+
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void NTAPI write_snapshot(_In_ WDFWORKITEM wi)
+{
+        PAGED_CODE();
+        auto &ctx = *get_snapshot_ctx(wi);
+
+        if (Registry key; !open_snapshots_key(key, KEY_QUERY_VALUE | KEY_SET_VALUE)) {
+                if (auto err = WdfRegistryAssignValue(key.get(), &ctx.name, REG_BINARY, ctx.length, &ctx.hdr)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryAssignValue('%!USTR!') %!STATUS!", &ctx.name, err);
+                } else {
+                        TraceDbg("'%!USTR!', %lu bytes", &ctx.name, ctx.length);
+                        evict(key.get(), ctx.max_cnt);
+                }
+        }
+
+        WdfObjectDelete(wi);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::load_descriptor_snapshot(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (!max_snapshots()) {
+                return;
+        }
+
+        auto &ext = *dev.ext;
+
+        UNICODE_STRING name;
+        unique_ptr name_buf;
+
+        if (make_value_name(name, name_buf, ext)) {
+                return;
+        }
+
+        Registry key;
+        if (open_snapshots_key(key, KEY_QUERY_VALUE)) {
+                return;
+        }
+
+        constexpr ULONG maxlen = sizeof(snapshot_header) + descriptor_cache::MAX_SNAPSHOT;
+
+        unique_ptr buf(NonPagedPoolNx, maxlen); // load() acquires a spin lock
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", maxlen);
+                return;
+        }
+
+        ULONG len{};
+        ULONG type{};
+
+        if (auto err = WdfRegistryQueryValue(key.get(), &name, maxlen, buf.get(), &len, &type)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryValue('%!USTR!') %!STATUS!", &name, err);
+                }
+                return;
+        }
+
+        auto &hdr = *buf.get<snapshot_header>();
+
+        if (auto expected = make_header(ext);
+            !(type == REG_BINARY && len > sizeof(hdr) &&
+              RtlEqualMemory(&hdr, &expected, offsetof(snapshot_header, saved)))) {
+                TraceDbg("'%!USTR!' is stale, type %lu, length %lu", &name, type, len);
+                return;
+        }
+
+        auto cnt = load(dev.descriptors, &hdr + 1, len - sizeof(hdr));
+        Trace(TRACE_LEVEL_INFORMATION, "'%!USTR!', %lu descriptors loaded", &name, cnt);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::save_descriptor_snapshot(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto max_cnt = max_snapshots();
+        if (!max_cnt) {
+                return;
+        }
+
+        auto &ext = *dev.ext;
+
+        WDF_WORKITEM_CONFIG cfg;
+        WDF_WORKITEM_CONFIG_INIT(&cfg, write_snapshot);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr; // WdfSynchronizationScopeNone is inherited from the driver object
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, snapshot_ctx);
+        attr.ContextSizeOverride = get_snapshot_ctx_size(get_value_name_size(ext));
+        attr.ParentObject = dev.vhci;
+
+        WDFWORKITEM wi{};
+        if (auto err = WdfWorkItemCreate(&cfg, &attr, &wi)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWorkItemCreate %!STATUS!", err);
+                return;
+        }
+
+        auto &ctx = *get_snapshot_ctx(wi);
+        ctx.max_cnt = max_cnt;
+
+        ctx.hdr = make_header(ext);
+        KeQuerySystemTime(reinterpret_cast<LARGE_INTEGER*>(&ctx.hdr.saved));
+
+        ctx.name.Buffer = ctx.name_buf;
+
+        if (auto len = save(dev.descriptors, ctx.descriptors, sizeof(ctx.descriptors));
+            len && !make_value_name(ctx.name, ext)) {
+                ctx.length = sizeof(ctx.hdr) + len;
+                WdfWorkItemEnqueue(wi); // -> write_snapshot
+        } else {
+                WdfObjectDelete(wi);
+        }
+}
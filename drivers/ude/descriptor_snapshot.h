@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * Descriptors of the device are stored in the registry on detach if REG_DWORD DescriptorSnapshots
+ * in the Parameters key of the driver is not zero. The value name is host:service/busid,
+ * the snapshot is used only if idVendor, idProduct and bcdDevice from OP_REP_IMPORT are the same.
+ * DescriptorSnapshots is the maximal number of stored snapshots, the least recently saved are removed.
+ *
+ * On the next attach the descriptor cache is prewarmed from the snapshot, the enumeration
+ * reads from the device only the device descriptor and the serial number to verify it.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void load_descriptor_snapshot(_Inout_ device_ctx &dev);
+
+/*
+ * Descriptors are serialized immediately, the registry is updated by a work item.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void save_descriptor_snapshot(_Inout_ device_ctx &dev);
+
+} // namespace usbip
@@ -14,6 +14,9 @@
 #include "wsk_receive.h"
 #include "ioctl.h"
 #include "vhci.h"
+#include "vhci_ioctl.h"
+#include "persistent.h"
+#include "descriptor_snapshot.h"
 
 #include <libdrv/dbgcommon.h>
 #include <libdrv/wait_timeout.h>
@@ -76,6 +79,8 @@ PAGED void device_cleanup(_In_ WDFOBJECT Object)
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x, cancelable(%!UINT64!) / sent(%!UINT64!) requests",
                 ptr04x(device), dev.cancelable_requests, dev.sent_requests);
 
+        clear(dev.descriptors);
+
         // all resources must be freed except for device_ctx_ext*
         NT_ASSERT(IsListEmpty(&dev.requests));
         NT_ASSERT(dev.unplugged);
@@ -514,7 +519,7 @@ PAGED auto prepare_init(_In_ _UDECXUSBDEVICE_INIT *init, _In_ device_ctx_ext &ex
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto create_delete_lock(_Out_ WDFWAITLOCK &handle, _In_ WDFOBJECT parent)
+PAGED auto create_wait_lock(_Out_ WDFWAITLOCK &handle, _In_ WDFOBJECT parent)
 {
         PAGED_CODE();
 
@@ -566,7 +571,22 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
                 }
         }
 
-        if (auto err = create_delete_lock(dev.delete_lock, device)) {
+        WDFWAITLOCK *locks[] = {
+                &dev.delete_lock,
+                &dev.sock_lock,
+        };
+
+        for (auto i: locks) {
+                if (auto err = create_wait_lock(*i, device)) {
+                        return err;
+                }
+        }
+
+        if (auto err = init(dev.descriptors, device)) {
+                return err;
+        }
+
+        if (auto err = init(dev.frames, device)) {
                 return err;
         }
 
@@ -596,6 +616,28 @@ PAGED auto plugout_and_delete(_In_ UDECXUSBDEVICE dev, _In_ WDFWAITLOCK delete_l
         return true;
 }
 
+/*
+ * Closing of the socket wakes up the receive thread.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void disconnect(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+        auto &dev = *get_device_ctx(device);
+
+        wdf::WaitLock lck(dev.sock_lock);
+
+        if (close_socket(dev.ext->next_sock)) { // session recovery is in progress
+                TraceDbg("dev %04x, reconnection aborted", ptr04x(device));
+        }
+
+        if (close_socket(dev.sock())) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
+                device_state_changed(dev, vhci::state::disconnected);
+        }
+}
+
 /*
  * Call UdecxUsbDevicePlugOutAndDelete if UdecxUsbDevicePlugIn was successful.
  * After UdecxUsbDevicePlugOutAndDelete the client driver can no longer use UDECXUSBDEVICE.
@@ -621,12 +663,9 @@ PAGED void detach(_In_ UDECXUSBDEVICE device)
         auto &dev = *get_device_ctx(device);
 	NT_ASSERT(dev.unplugged);
 
-        if (close_socket(dev.sock())) {
-                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
-                device_state_changed(dev, vhci::state::disconnected);
-        }
-
+        disconnect(device);
         recv_thread_join(device);
+        save_descriptor_snapshot(dev);
 
         auto port = vhci::reclaim_roothub_port(device);
         if (port) {
@@ -700,9 +739,35 @@ PAGED auto wait_detach(_In_ UDECXUSBDEVICE device, _In_opt_ LARGE_INTEGER *timeo
         return st;
 }
 
+enum : LONGLONG { DETACH_TIMEOUT = 30*wdm::second };
+
 constexpr auto wait_detach_timeout()
 {
-        return make_timeout(30*wdm::second, wdm::period::relative);
+        return make_timeout(DETACH_TIMEOUT, wdm::period::relative);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_recovering(_Inout_ device_ctx &dev, _In_ bool recovering)
+{
+        wdf::Lock lck(dev.send_lock); // see device_ioctl.cpp, send
+        dev.recovering = recovering;
+}
+
+/*
+ * Requests that were sent to the broken connection will never be completed by the server.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_sent_requests(_Inout_ device_ctx &dev, _In_ NTSTATUS status)
+{
+        int cnt = 0;
+
+        for ( ; auto request = device::remove_request(dev, device::request_search::any_t()); ++cnt) {
+                complete(request, status);
+        }
+
+        TraceDbg("dev %04x, %d request(s) completed", ptr04x(get_handle(&dev)), cnt);
 }
 
 } // namespace
@@ -739,6 +804,8 @@ PAGED NTSTATUS usbip::device::create(_Out_ UDECXUSBDEVICE &device, _In_ WDFDEVIC
         ctx.ext = ext;
         ext->ctx = &ctx;
 
+        ctx.recovery_period = get_parameter(L"RecoveryPeriod");
+
         if (auto err = init_device(device, ctx)) {
                 return err;
         }
@@ -830,6 +897,42 @@ PAGED NTSTATUS usbip::device::plugout_and_delete(_In_ UDECXUSBDEVICE device)
         return st;
 }
 
+/*
+ * Detach of all devices is started at once and the sockets are closed here,
+ * so the receive threads wake up together, without waiting for the work items.
+ * The total time is the time of the slowest device rather than the sum.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::device::plugout_and_delete_all(_In_reads_(cnt) const wdf::ObjectRef *devices, _In_ int cnt)
+{
+        PAGED_CODE();
+        auto start = KeQueryInterruptTime();
+
+        for (int i = 0; i < cnt; ++i) {
+                if (auto device = devices[i].get<UDECXUSBDEVICE>(); async_plugout_and_delete(device) == STATUS_SUCCESS) {
+                        disconnect(device);
+                }
+        }
+
+        auto deadline = start + DETACH_TIMEOUT; // for all devices
+
+        for (int i = 0; i < cnt; ++i) {
+                auto device = devices[i].get<UDECXUSBDEVICE>();
+
+                if (!get_device_ctx(device)->unplugged) { // async_plugout_and_delete failed
+                        continue;
+                }
+
+                auto now = KeQueryInterruptTime();
+                auto timeout = make_timeout(now < deadline ? deadline - now : 0, wdm::period::relative);
+
+                wait_detach(device, &timeout);
+        }
+
+        TraceDbg("%d device(s) detached in %I64u ms", cnt, (KeQueryInterruptTime() - start)/wdm::msec);
+}
+
 /*
  * @see plugout_and_delete
  */
@@ -849,3 +952,57 @@ PAGED NTSTATUS usbip::device::detach(_In_ UDECXUSBDEVICE device)
         auto timeout = wait_detach_timeout();
         return wait_detach(device, &timeout); // concurrent calls wait for the completion
 }
+
+/*
+ * Session recovery is disabled by default, see RecoveryPeriod (seconds) in the Parameters key of the driver.
+ * 
+ * UDECXUSBDEVICE remains plugged in while the driver is trying to reconnect to the same server 
+ * and import the device again. The stack of the device is not torn down and function drivers 
+ * are not reloaded if the connection is reestablished in time.
+ * 
+ * @return true if the connection is reestablished
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::device::recover(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        if (!dev.recovery_period || dev.unplugged) {
+                return false;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection is broken, recovery period %lu sec", 
+                ptr04x(device), dev.recovery_period);
+
+        set_recovering(dev, true);
+
+        if (wdf::WaitLock lck(dev.sock_lock); close_socket(dev.sock())) {
+                TraceDbg("dev %04x, connection closed", ptr04x(device));
+        }
+
+        complete_sent_requests(dev, RECOVERY_STATUS);
+
+        auto deadline = KeQueryInterruptTime() + dev.recovery_period*ULONGLONG(wdm::second);
+
+        for (int attempt = 1; !dev.unplugged && KeQueryInterruptTime() < deadline; ++attempt) {
+
+                if (auto err = vhci::reconnect(dev)) {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, attempt #%d, %!STATUS!", ptr04x(device), attempt, err);
+                } else {
+                        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection is reestablished, attempt #%d", 
+                                ptr04x(device), attempt);
+
+                        set_recovering(dev, false);
+                        return true;
+                }
+
+                if (auto timeout = make_timeout(wdm::second, wdm::period::relative); !dev.unplugged) {
+                        KeDelayExecutionThread(KernelMode, false, &timeout);
+                }
+        }
+
+        Trace(TRACE_LEVEL_ERROR, "dev %04x, recovery failed", ptr04x(device));
+        return false;
+}
@@ -20,6 +20,12 @@ namespace usbip
 namespace usbip::device
 {
 
+/*
+ * Requests are completed with this status while the connection is being reestablished.
+ * Function drivers treat it as transient error and retry a request.
+ */
+constexpr auto RECOVERY_STATUS = STATUS_IO_TIMEOUT;
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create(_Out_ UDECXUSBDEVICE &device, _In_ WDFDEVICE vhci, _In_ device_ctx_ext *ext);
@@ -36,8 +42,19 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS plugout_and_delete(_In_ UDECXUSBDEVICE device);
 
+/*
+ * Concurrent plugout_and_delete with the overall timeout.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugout_and_delete_all(_In_reads_(cnt) const wdf::ObjectRef *devices, _In_ int cnt);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS detach(_In_ UDECXUSBDEVICE device);
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool recover(_In_ UDECXUSBDEVICE device);
+
 } // namespace usbip::device
@@ -53,21 +53,18 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
                   ptr04x(request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
 
+        if (request && NT_SUCCESS(wsk.Status)) {
+                ++dev.sent_requests;
+        }
+
         if (!request) {
                 // nothing to do
-        } else if (NT_SUCCESS(wsk.Status)) {
-                ++dev.sent_requests;
-                if (auto seqnum = ctx.seqnum(true); auto err = device::mark_request_cancelable(dev, seqnum)) {
-                        auto device = get_handle(&dev);
-                        device::send_cmd_unlink_and_complete(device, request, err);
-                }
-        } else if (device::remove_request(dev, request, false)) {
-                complete(request, wsk.Status);
-        } else {
-                TraceDbg("req %04x not found, could not complete", ptr04x(request));
+        } else if (auto seqnum = ctx.seqnum(true); auto err = device::sent_request(dev, seqnum, wsk.Status)) {
+                auto device = get_handle(&dev);
+                device::send_cmd_unlink_and_complete(device, request, err); // other parts could be sent
         }
 
-        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
+        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !(dev.unplugged || dev.recovery_period)) { // see device::recover
                 auto device = get_handle(&dev);
                 TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(device), wsk.Status);
                 device::async_plugout_and_delete(device);
@@ -76,14 +73,19 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         return StopCompletion;
 }
 
+/*
+ * @param offset, length of a part of the transfer buffer to send
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
+auto prepare_wsk_buf(
+        _Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer,
+        _In_ ULONG offset = 0, _In_ ULONG length = URB_BUF_LEN)
 {
         NT_ASSERT(!ctx.mdl_buf);
 
         if (transfer_buffer && is_transfer_dir_out(ctx.hdr)) { // TransferFlags can have wrong direction
-                if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, URB_BUF_LEN, IoReadAccess, *transfer_buffer)) {
+                if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, length, IoReadAccess, *transfer_buffer, offset)) {
                         Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
                         return err;
                 }
@@ -118,33 +120,27 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
-        _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr)
+auto submit(_In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev, _In_ WSK_BUF &buf, _In_ bool log_setup)
 {
         auto request = ctx->request; // can be WDF_NO_HANDLE, do not access after send
 
-        WSK_BUF buf{};
-        if (auto err = prepare_wsk_buf(buf, *ctx, transfer_buffer)) {
-                return err;
-        } else {
+        {
                 char str[DBG_USBIP_HDR_BUFSZ];
                 TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x -> %Iu%s",
                         ptr04x(request), buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, log_setup));
         }
 
-        if (request) {
-                device::append_request(dev, *ctx, endpoint);
-        }
-
         byteswap_header(ctx->hdr, swap_dir::host2net);
 
         auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
+        auto wsk_ctx = ctx.release();
+        IoSetCompletionRoutine(wsk_irp, send_complete, wsk_ctx, true, true, true);
 
         NTSTATUS st;
         {
                 wdf::Lock lck(dev.send_lock); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
-                st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
+                st = dev.recovering ? STATUS_NOT_SUPPORTED : // ext->sock can be replaced
+                     send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
         }
 
         switch (st) {
@@ -155,14 +151,72 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_
         default:
                 Trace(TRACE_LEVEL_ERROR, "req %04x -> wsk irp %04x, %!STATUS!", ptr04x(request), ptr04x(wsk_irp), st);
                 // WskSend does not complete IRP for this status only
-                if (st == STATUS_NOT_SUPPORTED && device::remove_request(dev, request, false)) {
-                        complete(request, st);
+                if (st != STATUS_NOT_SUPPORTED) {
+                        break;
+                }
+
+                ctx.reset(wsk_ctx, true);
+
+                if (!request) {
+                        // nothing to do
+                } else if (auto seqnum = ctx.seqnum(true);
+                           auto err = device::sent_request(dev, seqnum, dev.recovering ? device::RECOVERY_STATUS : st)) {
+                        complete(request, err); // the socket is closed, CMD_UNLINK can't be sent
                 }
         }
 
         return STATUS_PENDING;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
+        _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr)
+{
+        WSK_BUF buf{};
+        if (auto err = prepare_wsk_buf(buf, *ctx, transfer_buffer)) {
+                return err;
+        }
+
+        if (ctx->request) {
+                device::append_request(dev, *ctx, endpoint);
+        }
+
+        return submit(ctx, dev, buf, log_setup);
+}
+
+/*
+ * @return true if the response is copied to the transfer buffer from the cache
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_cached_descriptor(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _In_ ULONG buf_len)
+{
+        UCHAR *buf{};
+        ULONG len{};
+
+        if (UdecxUrbRetrieveBuffer(request, &buf, &len)) {
+                return false;
+        }
+
+        len = min(len, buf_len);
+
+        if (!lookup(dev.descriptors, pkt, buf, len)) {
+                return false;
+        }
+
+        UdecxUrbSetBytesCompleted(request, len);
+        return true;
+}
+
+constexpr auto is_set_configuration(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &r)
+{
+        return r.bmRequestType.B == (USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE) &&
+               r.bRequest == USB_REQUEST_SET_CONFIGURATION;
+}
+
 using urb_function_t = NTSTATUS (device_ctx&, UDECXUSBENDPOINT, endpoint_ctx&, WDFREQUEST, URB&);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -208,6 +262,12 @@ auto control_transfer(
                 return STATUS_INVALID_PARAMETER;
         }
 
+        if (is_set_configuration(pkt)) {
+                invalidate(dev.descriptors, "SET_CONFIGURATION");
+        } else if (is_cacheable(pkt) && get_cached_descriptor(dev, request, pkt, buf_len)) {
+                return STATUS_SUCCESS; // a round trip is saved
+        }
+
         wsk_context_ptr ctx(&dev, request);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
@@ -222,6 +282,7 @@ auto control_transfer(
         static_assert(sizeof(ctx->hdr.u.cmd_submit.setup) == sizeof(pkt));
         RtlCopyMemory(ctx->hdr.u.cmd_submit.setup, &pkt, sizeof(pkt));
 
+        mark_stage(*dev.ext, vhci::attach_stage::first_control);
         return send(endpoint, ctx, dev, true, &urb);
 }
 
@@ -263,19 +324,20 @@ auto bulk_or_interrupt_transfer(
 
 /*
  * USBD_ISO_PACKET_DESCRIPTOR.Length is not used (zero) for USB_DIR_OUT transfer.
+ * Offsets of the part are relative to its first packet.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto repack(_In_ usbip_iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r)
+auto repack(_In_ usbip_iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r, _In_ const isoch_part &part)
 {
         ULONG length = 0;
 
-        for (ULONG i = 0; i < r.NumberOfPackets; ++d) {
+        for (auto i = part.first, end = part.first + part.count; i < end; ++d) {
 
                 auto offset = r.IsoPacket[i].Offset;
                 auto next_offset = ++i < r.NumberOfPackets ? r.IsoPacket[i].Offset : r.TransferBufferLength;
 
-                if (next_offset >= offset && next_offset <= r.TransferBufferLength) {
-                        d->offset = offset;
+                if (offset >= part.offset && next_offset >= offset && next_offset <= r.TransferBufferLength) {
+                        d->offset = offset - part.offset;
                         d->length = next_offset - offset;
                         d->actual_length = 0;
                         d->status = 0;
@@ -287,12 +349,86 @@ auto repack(_In_ usbip_iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER
                 }
         }
 
-        NT_ASSERT(length == r.TransferBufferLength);
+        NT_ASSERT(length == part.length);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto prepare_isoch_part(
+        _Inout_ wsk_context &ctx, _Inout_ device_ctx &dev, _In_ const endpoint_ctx &endp,
+        _In_ const _URB_ISOCH_TRANSFER &r, _In_ const isoch_part &part, _In_ ULONG TransferFlags, _In_ ULONG start_frame)
+{
+        if (auto err = set_cmd_submit_usbip_header(ctx.hdr, dev, endp.descriptor, TransferFlags, part.length)) {
+                return err;
+        }
+
+        if (auto err = repack(ctx.isoc, r, part)) {
+                return err;
+        }
+
+        auto &cmd = ctx.hdr.u.cmd_submit;
+        cmd.start_frame = start_frame;
+        cmd.number_of_packets = part.count;
+
         return STATUS_SUCCESS;
 }
 
 /*
- * USBD_START_ISO_TRANSFER_ASAP is appended because URB_GET_CURRENT_FRAME_NUMBER is not implemented.
+ * The parts are prepared before the request is appended to the list, the URB must not be accessed after that.
+ * The second and next parts are sent with USBD_START_ISO_TRANSFER_ASAP, the server schedules them
+ * right after the previous one.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto send_isoch_parts(
+        _In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ endpoint_ctx &endp,
+        _In_ WDFREQUEST request, _In_ URB &urb, _In_ ULONG TransferFlags, _In_ ULONG start_frame)
+{
+        auto &r = urb.UrbIsochronousTransfer;
+        auto parts = isoch_parts(r.NumberOfPackets);
+        NT_ASSERT(parts > 1 && parts <= MAX_ISOCH_PARTS);
+
+        wsk_context_ptr ctx[MAX_ISOCH_PARTS];
+        WSK_BUF buf[MAX_ISOCH_PARTS]{};
+
+        auto seqnum = next_seqnum(dev, !usb_endpoint_dir_out(endp.descriptor), parts); // see request_ctx::parts
+
+        for (ULONG i = 0; i < parts; ++i) {
+                auto part = get_isoch_part(r, i);
+                auto &c = ctx[i];
+
+                c = wsk_context_ptr(&dev, request, part.count);
+                if (!c) {
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                auto flags = i ? TransferFlags | USBD_START_ISO_TRANSFER_ASAP : TransferFlags;
+
+                if (auto err = prepare_isoch_part(*c, dev, endp, r, part, flags, i ? 0 : start_frame)) {
+                        return err;
+                }
+
+                c->hdr.base.seqnum = seqnum + 2*i;
+
+                if (auto err = prepare_wsk_buf(buf[i], *c, &urb, part.offset, part.length)) {
+                        return err;
+                }
+        }
+
+        TraceUrb("req %04x -> %lu parts, seqnum %u", ptr04x(request), parts, seqnum);
+        device::append_request(dev, *ctx[0], endpoint, static_cast<USHORT>(parts));
+
+        for (ULONG i = 0; i < parts; ++i) {
+                submit(ctx[i], dev, buf[i], false);
+        }
+
+        return STATUS_PENDING;
+}
+
+/*
+ * StartFrame is meaningful for the server only if the frame clock is synchronized,
+ * otherwise USBD_START_ISO_TRANSFER_ASAP is appended. See frame_clock.h.
+ *
+ * URB with NumberOfPackets > USBIP_MAX_ISO_PACKETS is sent in parts, see isoch_part.
  */
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
@@ -320,32 +456,54 @@ auto isoch_transfer(
                         func);
         }
 
-        if (r.NumberOfPackets > USBIP_MAX_ISO_PACKETS) {
-                Trace(TRACE_LEVEL_ERROR, "NumberOfPackets(%lu) > USBIP_MAX_ISO_PACKETS(%d)", 
-                                          r.NumberOfPackets, USBIP_MAX_ISO_PACKETS);
+        auto parts = isoch_parts(r.NumberOfPackets);
+
+        if (parts > MAX_ISOCH_PARTS) {
+                Trace(TRACE_LEVEL_ERROR, "NumberOfPackets(%lu) > USBIP_MAX_ISO_PACKETS(%d)*MAX_ISOCH_PARTS(%d)", 
+                                          r.NumberOfPackets, USBIP_MAX_ISO_PACKETS, MAX_ISOCH_PARTS);
                 return STATUS_INVALID_PARAMETER;
         }
 
+        auto flags = r.TransferFlags;
+        auto start_frame = r.StartFrame;
+
+        if (flags & USBD_START_ISO_TRANSFER_ASAP) {
+                //
+        } else if (dev.frames.explicit_start && is_synced(dev.frames)) {
+                start_frame = to_server_frame(dev.frames, start_frame);
+        } else {
+                flags |= USBD_START_ISO_TRANSFER_ASAP;
+        }
+
+        if (parts > 1) {
+                return send_isoch_parts(dev, endpoint, endp, request, urb, flags, start_frame);
+        }
+
         wsk_context_ptr ctx(&dev, request, r.NumberOfPackets);
         if (!ctx) {
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, 
-                               r.TransferFlags | USBD_START_ISO_TRANSFER_ASAP, r.TransferBufferLength)) {
+        if (auto err = prepare_isoch_part(*ctx, dev, endp, r, get_isoch_part(r, 0), flags, start_frame)) {
                 return err;
         }
 
-        if (auto err = repack(ctx->isoc, r)) {
-                return err;
-        }
+        return send(endpoint, ctx, dev, false, &urb);
+}
 
-        if (auto cmd = &ctx->hdr.u.cmd_submit) {
-                cmd->start_frame = r.StartFrame;
-                cmd->number_of_packets = r.NumberOfPackets;
-        }
+/*
+ * Completed locally, the frame number is estimated from start_frame of isoch transfers.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Function_class_(urb_function_t)
+auto get_current_frame_number(
+        _In_ device_ctx &dev, _In_ UDECXUSBENDPOINT, _In_ endpoint_ctx&, _In_ WDFREQUEST request, _In_ URB &urb)
+{
+        auto &r = urb.UrbGetCurrentFrameNumber;
+        r.FrameNumber = get_frame_number(dev.frames);
 
-        return send(endpoint, ctx, dev, false, &urb);
+        TraceUrb("req %04x -> FrameNumber %lu", ptr04x(request), r.FrameNumber);
+        return STATUS_SUCCESS;
 }
 
 /*
@@ -394,6 +552,9 @@ auto usb_submit_urb(
         case URB_FUNCTION_CONTROL_TRANSFER:
                 handler = control_transfer;
                 break;
+        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+                handler = get_current_frame_number;
+                break;
         default:
                 Trace(TRACE_LEVEL_ERROR, "%s(%#04x), dev %04x, endp %04x", urb_function_str(func), func, 
                                           ptr04x(endp.device), ptr04x(endpoint));
@@ -464,13 +625,18 @@ void usbip::device::send_cmd_unlink_and_complete(_In_ UDECXUSBDEVICE device, _In
 
         TraceDbg("dev %04x, seqnum %u", ptr04x(device), req.seqnum);
 
-        if (dev.unplugged) {
-                TraceDbg("Unplugged, do not send unlink");
-        } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
-                set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
-                ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
-        } else {
-                Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), req.seqnum);
+        for (USHORT i = 0; i < req.parts; ++i) { // all parts of isoch URB, see request_ctx
+                auto seqnum = req.seqnum + 2*i;
+
+                if (dev.unplugged) {
+                        TraceDbg("Unplugged, do not send unlink");
+                        break;
+                } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
+                        set_cmd_unlink_usbip_header(ctx->hdr, dev, seqnum);
+                        ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
+                } else {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), seqnum);
+                }
         }
 
         complete(request, status);
@@ -533,6 +699,11 @@ NTSTATUS usbip::device::set_configuration(
 {
         TraceDbg("dev %04x, ConfigurationValue %d", ptr04x(device), ConfigurationValue);
 
+        auto &dev = *get_device_ctx(device);
+
+        mark_stage(*dev.ext, vhci::attach_stage::set_configuration);
+        invalidate(dev.descriptors, "set_configuration");
+
         auto r = make_set_configuration(ConfigurationValue);
         return send_ep0_out(device, request, r);
 }
@@ -580,6 +751,7 @@ NTSTATUS usbip::device::reset_port(_In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUE
         auto port = static_cast<USHORT>(dev.port); // meaningless for a server which ignores it
 
         TraceDbg("dev %04x, port %d", ptr04x(device), port);
+        invalidate(dev.descriptors, "reset_port");
 
         auto r = make_reset_port(port);
         return send_ep0_out(device, request, r);
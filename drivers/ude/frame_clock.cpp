@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "frame_clock.h"
+#include "trace.h"
+#include "frame_clock.tmh"
+
+#include "persistent.h"
+
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+enum : ULONG {
+        MIN_MODULUS = 256, // the smallest periodic schedule of EHCI
+        MAX_MODULUS = 1UL << 31,
+        MAX_PHASE_ERROR = 64, // frames, a greater error is not filtered
+        MAX_DRIFT_PPM = 500,
+        SYNC_SAMPLES = 16,
+};
+
+constexpr auto PPM = 1'000'000LL;
+constexpr auto DRIFT_INTERVAL = 10*wdm::second;
+constexpr auto SYNC_TIME = 2*wdm::second; // the counter of xHCI wraps at 2048 frames, the modulus is known
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto estimate(_In_ const frame_clock &clock, _In_ ULONGLONG now)
+{
+        if (!clock.samples) {
+                return LONGLONG(now/wdm::msec);
+        }
+
+        auto dt = LONGLONG(now - clock.base_time);
+        return clock.base_frame + dt*(PPM + clock.drift_ppm)/(PPM*wdm::msec);
+}
+
+/*
+ * @return difference in range [-modulus/2, modulus/2)
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto phase_error(_In_ const frame_clock &clock, _In_ ULONG server_frame, _In_ LONGLONG frame)
+{
+        auto d = (server_frame - ULONG(frame)) & (clock.modulus - 1);
+        return d < clock.modulus/2 ? LONG(d) : LONG(d) - LONG(clock.modulus);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_drift(_Inout_ frame_clock &clock, _In_ ULONGLONG now, _In_ LONGLONG frame)
+{
+        auto dt = LONGLONG(now - clock.drift_time);
+        if (dt < DRIFT_INTERVAL) {
+                return;
+        }
+
+        auto ppm = (frame - clock.drift_frame)*PPM*wdm::msec/dt - PPM;
+        ppm = max(-LONGLONG(MAX_DRIFT_PPM), min(ppm, LONGLONG(MAX_DRIFT_PPM)));
+
+        clock.drift_ppm = LONG((3*clock.drift_ppm + ppm)/4); // network jitter is smoothed
+        clock.drift_time = now;
+        clock.drift_frame = frame;
+
+        TraceDbg("drift %ld ppm, modulus %lu, samples %lu", clock.drift_ppm, clock.modulus, clock.samples);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::init(_Inout_ frame_clock &clock, _In_ WDFOBJECT parent)
+{
+        PAGED_CODE();
+
+        clock.modulus = MIN_MODULUS;
+        clock.explicit_start = get_parameter(L"IsochExplicitStart");
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = parent;
+
+        if (auto err = WdfSpinLockCreate(&attr, &clock.lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::update(_Inout_ frame_clock &clock, _In_ ULONG start_frame, _In_ ULONG elapsed)
+{
+        auto now = KeQueryInterruptTime();
+        wdf::Lock lck(clock.lock);
+
+        if (start_frame >= clock.modulus) { // the congruence is changed, start over
+                while (start_frame >= clock.modulus && clock.modulus < MAX_MODULUS) {
+                        clock.modulus <<= 1;
+                }
+                clock.samples = 0;
+        }
+
+        auto server_frame = (start_frame + elapsed) & (clock.modulus - 1); // wraps as the server's counter
+        auto frame = estimate(clock, now);
+        auto err = phase_error(clock, server_frame, frame);
+
+        if (!clock.samples) {
+                clock.first_time = clock.drift_time = now;
+                clock.base_frame = clock.drift_frame = frame + err;
+                clock.drift_ppm = 0;
+        } else if (err < -LONG(MAX_PHASE_ERROR) || err > LONG(MAX_PHASE_ERROR)) {
+                TraceDbg("phase error %ld, modulus %lu", err, clock.modulus);
+                clock.base_frame = clock.drift_frame = frame + err;
+                clock.drift_time = now;
+        } else {
+                clock.base_frame = frame + err/4; // low-pass filter
+                update_drift(clock, now, frame + err);
+        }
+
+        clock.base_time = now;
+
+        if (clock.samples < MAXULONG) {
+                ++clock.samples;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::reset(_Inout_ frame_clock &clock)
+{
+        wdf::Lock lck(clock.lock);
+
+        clock.modulus = MIN_MODULUS;
+        clock.samples = 0;
+        clock.drift_ppm = 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::get_frame_number(_Inout_ frame_clock &clock)
+{
+        auto now = KeQueryInterruptTime();
+        wdf::Lock lck(clock.lock);
+
+        return ULONG(estimate(clock, now));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::is_synced(_Inout_ frame_clock &clock)
+{
+        auto now = KeQueryInterruptTime();
+        wdf::Lock lck(clock.lock);
+
+        return clock.samples >= SYNC_SAMPLES && now - clock.first_time >= SYNC_TIME;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::to_server_frame(_Inout_ frame_clock &clock, _In_ ULONG frame)
+{
+        wdf::Lock lck(clock.lock);
+        return frame & (clock.modulus - 1);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::from_server_frame(_Inout_ frame_clock &clock, _In_ ULONG server_frame)
+{
+        auto now = KeQueryInterruptTime();
+        wdf::Lock lck(clock.lock);
+
+        auto frame = estimate(clock, now);
+        return ULONG(frame + phase_error(clock, server_frame, frame));
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+namespace usbip
+{
+
+/*
+ * Estimator of the frame counter (1 ms frames) of the server's host controller.
+ *
+ * The server reports start_frame of isoch transfers in RET_SUBMIT. The counter of the server wraps
+ * (usually at 1024 or 2048), the modulus is learnt from the samples. Returned frame numbers are
+ * continuous, they are close to KeQueryInterruptTime in milliseconds and congruent to the server's frame
+ * numbers modulo the modulus. Drift between the clocks is corrected.
+ *
+ * If REG_DWORD IsochExplicitStart in the Parameters key of the driver is not zero, StartFrame of isoch URBs
+ * without USBD_START_ISO_TRANSFER_ASAP is sent to the server, otherwise the flag is always appended.
+ */
+struct frame_clock
+{
+        WDFSPINLOCK lock;
+
+        ULONG modulus; // of server's frame counter, power of two
+        ULONG samples;
+
+        ULONGLONG first_time; // KeQueryInterruptTime of the first sample
+        ULONGLONG base_time; // KeQueryInterruptTime
+        LONGLONG base_frame; // estimated frame number at base_time
+
+        ULONGLONG drift_time; // start of drift measurement interval
+        LONGLONG drift_frame;
+        LONG drift_ppm; // the server's clock is faster if positive
+
+        bool explicit_start; // IsochExplicitStart
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init(_Inout_ frame_clock &clock, _In_ WDFOBJECT parent);
+
+/*
+ * @param start_frame raw frame number of the server, the modulus is learnt from it
+ * @param elapsed frames since start_frame, the frame number of the server at this moment is
+ *        (start_frame + elapsed) mod modulus
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update(_Inout_ frame_clock &clock, _In_ ULONG start_frame, _In_ ULONG elapsed);
+
+/*
+ * Samples of the previous connection are discarded, see vhci::reconnect.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void reset(_Inout_ frame_clock &clock);
+
+/*
+ * @return the current frame number
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG get_frame_number(_Inout_ frame_clock &clock);
+
+/*
+ * @return true if enough samples were received to convert frame numbers to the server's ones
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool is_synced(_Inout_ frame_clock &clock);
+
+/*
+ * @param frame number returned by get_frame_number
+ * @return server's frame number
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG to_server_frame(_Inout_ frame_clock &clock, _In_ ULONG frame);
+
+/*
+ * @param server_frame start_frame from RET_SUBMIT
+ * @return frame number that is the nearest to the current one
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG from_server_frame(_Inout_ frame_clock &clock, _In_ ULONG server_frame);
+
+} // namespace usbip
@@ -7,6 +7,7 @@
 #include "persistent.tmh"
 
 #include "context.h"
+#include "driver.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wait_timeout.h>
@@ -82,191 +83,531 @@ PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICOD
 }
 
 /*
- * Target is self. 
+ * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
+ * This can happen after reboot if dnscache(?) service is not ready yet.
  */
+constexpr auto can_retry(_In_ NTSTATUS status)
+{
+        switch (as_usbip_status(status)) {
+        case USBIP_ERROR_VERSION:
+        case USBIP_ERROR_PROTOCOL:
+        case USBIP_ERROR_ABI:
+        // @see op_status_t
+        case USBIP_ERROR_ST_NA: 
+        case USBIP_ERROR_ST_DEV_BUSY:
+        case USBIP_ERROR_ST_DEV_ERR:
+        case USBIP_ERROR_ST_NODEV:
+        case USBIP_ERROR_ST_ERROR:
+                return false;
+        default:
+                return true;
+        }
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto make_target(_In_ WDFDEVICE vhci)
+PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
 {
         PAGED_CODE();
-        ObjectDelete target;
+        
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
 
-        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
-                return target;
-        } else {
-                target.reset(t);
+                UNICODE_STRING s{};
+                WdfStringGetUnicodeString(item, &s);
+                        
+                if (RtlEqualUnicodeString(&s, &str, true)) {
+                        return true;
+                }
         }
 
-        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+        return false;
+}
 
-        WDF_IO_TARGET_OPEN_PARAMS params;
-        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
+enum { MAX_INFLIGHT = 8 };
 
-        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
-                target.reset();
-        }
+/*
+ * Server is identified by host and service, .Buffer-s point to persistent_device::line.
+ */
+struct server_state
+{
+        UNICODE_STRING host;
+        UNICODE_STRING service;
 
-        return target;
+        ULONG failures; // consecutive, reset by successful attach of any device of this server
+        ULONGLONG retry_time; // KeQueryInterruptTime, do not connect to this server before
+        int inflight;
+};
+
+struct persistent_device
+{
+        UNICODE_STRING line; // host,service,busid; .Buffer points to WDFSTRING
+        server_state *server;
+
+        ULONG failures;
+        ULONGLONG retry_time; // KeQueryInterruptTime
+
+        enum state_t { WAITING, INFLIGHT, DONE };
+        state_t state;
+};
+
+/*
+ * Asynchronous IOCTL_PLUGIN_HARDWARE that is sent to itself.
+ */
+struct attach_slot
+{
+        WDFREQUEST request;
+        WDFMEMORY memory; // for req
+        KEVENT *completion; // restore_ctx::completion
+
+        persistent_device *dev; // nullptr if the slot is free
+        ULONG server_failures; // server_state::failures when the request was sent
+
+        volatile bool completed;
+        NTSTATUS status;
+
+        vhci::ioctl::plugin_hardware req;
+};
+
+/*
+ * Must be allocated from NonPagedPool, it is accessed by the completion routine.
+ */
+struct restore_ctx
+{
+        vhci_ctx *vhci;
+        WDFIOTARGET target;
+
+        ULONG dev_cnt;
+        persistent_device devices[ARRAYSIZE(vhci_ctx::devices)];
+
+        ULONG server_cnt;
+        server_state servers[ARRAYSIZE(vhci_ctx::devices)];
+
+        ULONG slot_cnt;
+        attach_slot slots[MAX_INFLIGHT];
+        int inflight;
+
+        KEVENT completion; // of any slot
+};
+
+/*
+ * The delay grows exponentially, first two attempts without a delay.
+ */
+constexpr ULONGLONG get_delay(_In_ ULONG failures)
+{
+        enum : ULONGLONG { UNIT = 10*wdm::second, MAX_DELAY = 30*60*wdm::second };
+        enum { MAX_SHIFT = 8 }; // UNIT << MAX_SHIFT > MAX_DELAY
+        return failures > 1 ? min(UNIT << min(failures - 2, ULONG(MAX_SHIFT)), MAX_DELAY) : 0;
 }
 
-constexpr auto get_delay(_In_ ULONG attempt, _In_ ULONG cnt)
+/*
+ * Signaled when the Parameters key of the driver is changed.
+ * The key must be closed before the destructor is called, that completes a pending notification.
+ * The destructor waits for the completion because it writes to m_iosb.
+ */
+class change_event
+{
+public:
+        change_event() = default;
+        ~change_event();
+
+        change_event(_In_ const change_event&) = delete;
+        change_event& operator =(_In_ const change_event&) = delete;
+
+        _IRQL_requires_(PASSIVE_LEVEL)
+        PAGED NTSTATUS create();
+
+        _IRQL_requires_(PASSIVE_LEVEL)
+        PAGED NTSTATUS notify(_In_ WDFKEY key);
+
+        auto get() const { return m_event; }
+        void signaled() { m_pending = false; } // the event was acquired by a wait
+
+private:
+        HANDLE m_handle{};
+        KEVENT *m_event{};
+
+        IO_STATUS_BLOCK m_iosb{}; // for ZwNotifyChangeKey
+        bool m_pending{};
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED change_event::~change_event()
 {
-        NT_ASSERT(cnt);
-        enum { UNIT = 10, MAX_DELAY = 30*60 }; // seconds
-        return attempt > 1 ? min(UNIT*attempt/cnt, MAX_DELAY) : 0; // first two attempts without a delay
+        PAGED_CODE();
+
+        if (m_pending) {
+                TraceDbg("waiting for the completion of the notification");
+                NT_VERIFY(!KeWaitForSingleObject(m_event, Executive, KernelMode, false, nullptr));
+        }
+
+        if (m_event) {
+                ObDereferenceObject(m_event);
+        }
+
+        if (m_handle) {
+                NT_VERIFY(NT_SUCCESS(ZwClose(m_handle)));
+        }
 }
 
 _IRQL_requires_same_
-_IRQL_requires_max_(APC_LEVEL)
-PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS change_event::create()
 {
         PAGED_CODE();
-        auto timeout = make_timeout(seconds*wdm::second, wdm::period::relative);
+        NT_ASSERT(!m_handle);
 
-        switch (auto st = KeWaitForSingleObject(&ctx.attach_thread_stop, Executive, KernelMode, false, &timeout)) {
-        case STATUS_SUCCESS:
-                TraceDbg("thread stop requested");
-                return false;
-        case STATUS_TIMEOUT:
-                break;
-        default:
-                Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", st);
+        OBJECT_ATTRIBUTES attr;
+        InitializeObjectAttributes(&attr, nullptr, OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+        if (auto err = ZwCreateEvent(&m_handle, EVENT_ALL_ACCESS, &attr, SynchronizationEvent, false)) {
+                Trace(TRACE_LEVEL_ERROR, "ZwCreateEvent %!STATUS!", err);
+                m_handle = nullptr;
+                return err;
+        }
+
+        if (auto err = ObReferenceObjectByHandle(m_handle, EVENT_ALL_ACCESS, *ExEventObjectType, KernelMode, 
+                                                 reinterpret_cast<PVOID*>(&m_event), nullptr)) {
+                Trace(TRACE_LEVEL_ERROR, "ObReferenceObjectByHandle %!STATUS!", err);
+                m_event = nullptr;
+                return err;
         }
 
-        return true;
+        return STATUS_SUCCESS;
 }
 
 /*
- * WskGetAddressInfo() can return STATUS_INTERNAL_ERROR(0xC00000E5), but after some delay it will succeed.
- * This can happen after reboot if dnscache(?) service is not ready yet.
+ * The key must be opened with KEY_NOTIFY access. Closing of the key cancels the notification.
  */
-constexpr auto can_retry(_In_ NTSTATUS status)
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS change_event::notify(_In_ WDFKEY key)
 {
-        switch (as_usbip_status(status)) {
-        case USBIP_ERROR_VERSION:
-        case USBIP_ERROR_PROTOCOL:
-        case USBIP_ERROR_ABI:
-        // @see op_status_t
-        case USBIP_ERROR_ST_NA: 
-        case USBIP_ERROR_ST_DEV_BUSY:
-        case USBIP_ERROR_ST_DEV_ERR:
-        case USBIP_ERROR_ST_NODEV:
-        case USBIP_ERROR_ST_ERROR:
-                return false;
-        default:
-                return true;
+        PAGED_CODE();
+        NT_ASSERT(!m_pending);
+
+        auto st = ZwNotifyChangeKey(WdfRegistryWdmGetHandle(key), m_handle, nullptr, nullptr, &m_iosb,
+                                    REG_NOTIFY_CHANGE_LAST_SET, false, nullptr, 0, true);
+
+        if (NT_ERROR(st)) {
+                Trace(TRACE_LEVEL_ERROR, "ZwNotifyChangeKey %!STATUS!", st);
+                return st;
+        }
+
+        m_pending = true; // the event is signaled on completion, STATUS_PENDING is a success code
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto find_server(_Inout_ restore_ctx &r, _In_ const UNICODE_STRING &host, _In_ const UNICODE_STRING &service)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < r.server_cnt; ++i) {
+                if (auto &s = r.servers[i]; 
+                    RtlEqualUnicodeString(&s.host, &host, true) && RtlEqualUnicodeString(&s.service, &service, false)) {
+                        return &s;
+                }
         }
+
+        NT_ASSERT(r.server_cnt < ARRAYSIZE(r.servers));
+        auto &s = r.servers[r.server_cnt++];
+
+        s.host = host;
+        s.service = service;
+
+        return &s;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void add_devices(_Inout_ restore_ctx &r, _In_ WDFCOLLECTION col)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt && r.dev_cnt < ARRAYSIZE(r.devices); ++i) {
+
+                auto &dev = r.devices[r.dev_cnt];
+                WdfStringGetUnicodeString((WDFSTRING)WdfCollectionGetItem(col, i), &dev.line);
+
+                UNICODE_STRING host;
+                UNICODE_STRING service;
+                UNICODE_STRING busid;
+
+                const auto sep = L',';
+
+                libdrv::split(host, busid, dev.line, sep);
+                libdrv::split(service, busid, busid, sep);
+
+                if (empty(host) || empty(service) || empty(busid)) {
+                        Trace(TRACE_LEVEL_ERROR, "'%!USTR!' is malformed", &dev.line);
+                        continue;
+                }
+
+                dev.server = find_server(r, host, service);
+                ++r.dev_cnt;
+        }
+
+        TraceDbg("%lu device(s), %lu server(s)", r.dev_cnt, r.server_cnt);
 }
 
 /*
- * @return true - do not try to connect to this device again
+ * Devices that were removed from the registry are not attached.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin_hardware(
-        _In_ const UNICODE_STRING &line, 
-        _In_ WDFIOTARGET target,
-        _Inout_ vhci::ioctl::plugin_hardware &req,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &input,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &output,
-        [[maybe_unused]] _In_ const ULONG outlen)
+PAGED void refresh(_Inout_ restore_ctx &r, _In_ WDFKEY key)
 {
         PAGED_CODE();
 
-        if (auto err = parse_string(req, line)) {
-                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &line, err);
-                return true; // remove malformed string
+        auto col = get_persistent_devices(key);
+
+        for (ULONG i = 0; i < r.dev_cnt; ++i) {
+                if (auto &dev = r.devices[i]; 
+                    dev.state == dev.WAITING && !(col && contains(col.get<WDFCOLLECTION>(), dev.line))) {
+                        TraceDbg("exclude %!USTR!", &dev.line);
+                        dev.state = dev.DONE;
+                }
         }
+}
 
-        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", req.host, req.service, req.busid);
-        req.port = 0;
+_Function_class_(EVT_WDF_REQUEST_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI attach_complete(
+        _In_ WDFREQUEST, _In_ WDFIOTARGET, _In_ WDF_REQUEST_COMPLETION_PARAMS *params, _In_ WDFCONTEXT context)
+{
+        auto &slot = *static_cast<attach_slot*>(context);
 
-        if (ULONG_PTR BytesReturned; // send IOCTL to itself
-            auto err = WdfIoTargetSendIoctlSynchronously(target, WDF_NO_HANDLE, vhci::ioctl::PLUGIN_HARDWARE, 
-                                                         &input, &output, nullptr, &BytesReturned)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetSendIoctlSynchronously %!STATUS!", err);
-                return !can_retry(err);
-        } else {
-                NT_ASSERT(BytesReturned == outlen);
-                return true;
+        slot.status = params->IoStatus.Status;
+        slot.completed = true;
+
+        KeSetEvent(slot.completion, IO_NO_INCREMENT, false);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS init_slots(_Inout_ restore_ctx &r, _In_ ULONG cnt)
+{
+        PAGED_CODE();
+        NT_ASSERT(cnt && cnt <= ARRAYSIZE(r.slots));
+
+        KeInitializeEvent(&r.completion, SynchronizationEvent, false);
+
+        for ( ; r.slot_cnt < cnt; ++r.slot_cnt) {
+                auto &slot = r.slots[r.slot_cnt];
+                slot.completion = &r.completion;
+
+                WDF_OBJECT_ATTRIBUTES attr;
+                WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+                attr.ParentObject = r.target;
+
+                if (auto err = WdfRequestCreate(&attr, r.target, &slot.request)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRequestCreate %!STATUS!", err);
+                        return err;
+                }
+
+                attr.ParentObject = slot.request;
+
+                if (auto err = WdfMemoryCreatePreallocated(&attr, &slot.req, sizeof(slot.req), &slot.memory)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreatePreallocated %!STATUS!", err);
+                        return err;
+                }
         }
+
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
+PAGED void finish(_Inout_ restore_ctx &r, _Inout_ attach_slot &slot, _In_ NTSTATUS status)
 {
         PAGED_CODE();
-        
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(col); i < cnt; ++i) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(col, i);
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
-                        
-                if (RtlEqualUnicodeString(&s, &str, true)) {
-                        return true;
+        auto &dev = *slot.dev;
+        auto &srv = *dev.server;
+
+        slot.dev = nullptr;
+        --r.inflight;
+        --srv.inflight;
+
+        auto now = KeQueryInterruptTime();
+
+        if (NT_SUCCESS(status)) {
+                Trace(TRACE_LEVEL_INFORMATION, "%!USTR! attached, port %d", &dev.line, slot.req.port);
+                dev.state = dev.DONE;
+                srv.failures = 0;
+                srv.retry_time = 0;
+        } else if (!can_retry(status)) {
+                Trace(TRACE_LEVEL_ERROR, "%!USTR! %!STATUS!, exclude", &dev.line, status);
+                dev.state = dev.DONE;
+        } else {
+                dev.state = dev.WAITING;
+                dev.retry_time = now + get_delay(++dev.failures);
+
+                if (srv.failures == slot.server_failures) { // concurrent attaches count as one failure
+                        srv.retry_time = now + get_delay(++srv.failures);
                 }
+
+                TraceDbg("%!USTR! %!STATUS!, failures: device %lu, server %lu", 
+                          &dev.line, status, dev.failures, srv.failures);
         }
+}
 
-        return false;
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void start(_Inout_ restore_ctx &r, _Inout_ attach_slot &slot, _Inout_ persistent_device &dev)
+{
+        PAGED_CODE();
+        NT_ASSERT(!slot.dev);
+
+        auto &req = slot.req;
+        RtlZeroMemory(&req, sizeof(req));
+        req.size = sizeof(req);
+
+        if (auto err = parse_string(req, dev.line)) {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &dev.line, err);
+                dev.state = dev.DONE;
+                return;
+        }
+
+        slot.dev = &dev;
+        slot.server_failures = dev.server->failures;
+        slot.completed = false;
+
+        dev.state = dev.INFLIGHT;
+        ++dev.server->inflight;
+        ++r.inflight;
+
+        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s, attempt #%lu", req.host, req.service, req.busid, dev.failures);
+
+        WDF_REQUEST_REUSE_PARAMS params;
+        WDF_REQUEST_REUSE_PARAMS_INIT(&params, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+        NT_VERIFY(NT_SUCCESS(WdfRequestReuse(slot.request, &params)));
+
+        WDFMEMORY_OFFSET output{ .BufferLength = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port) };
+
+        if (auto err = WdfIoTargetFormatRequestForIoctl(r.target, slot.request, vhci::ioctl::PLUGIN_HARDWARE, 
+                                                        slot.memory, nullptr, slot.memory, &output)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetFormatRequestForIoctl %!STATUS!", err);
+                finish(r, slot, err);
+                return;
+        }
+
+        WdfRequestSetCompletionRoutine(slot.request, attach_complete, &slot);
+
+        if (!WdfRequestSend(slot.request, r.target, WDF_NO_SEND_OPTIONS)) { // completion routine is not called
+                auto err = WdfRequestGetStatus(slot.request);
+                Trace(TRACE_LEVEL_ERROR, "WdfRequestSend %!STATUS!", err);
+                finish(r, slot, err);
+        }
 }
 
 /*
- * Remove from collection A items absent in collection B.
+ * If connection to a server fails, its devices are not attached concurrently until it succeeds.
+ */
+constexpr auto can_start(_In_ const persistent_device &dev, _In_ ULONGLONG now)
+{
+        auto &srv = *dev.server;
+
+        return dev.state == dev.WAITING && dev.retry_time <= now && 
+               srv.retry_time <= now && !(srv.failures && srv.inflight);
+}
+
+/*
+ * @return true if there are devices to attach
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void intersection(_In_ WDFCOLLECTION a, _In_ WDFCOLLECTION b)
+PAGED auto launch(_Inout_ restore_ctx &r, _Out_ LARGE_INTEGER &timeout, _Out_ bool &has_timeout)
 {
         PAGED_CODE();
 
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(a); i < cnt; ) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(a, i);
+        auto now = KeQueryInterruptTime();
+        auto next = MAXULONGLONG;
+        bool waiting = false;
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
+        for (ULONG i = 0, j = 0; i < r.dev_cnt; ++i) {
+                auto &dev = r.devices[i];
+
+                if (can_start(dev, now)) {
+                        for ( ; j < r.slot_cnt && r.slots[j].dev; ++j); // find a free slot
+                        if (j < r.slot_cnt) {
+                                start(r, r.slots[j], dev);
+                        }
+                }
+
+                if (dev.state != dev.WAITING) {
+                        continue;
+                }
+
+                waiting = true;
 
-                if (contains(b, s)) {
-                        ++i;
-                } else {
-                        TraceDbg("exclude %!USTR!", &s);
-                        WdfCollectionRemoveItem(a, i);
-                        --cnt;
+                if (auto t = max(dev.retry_time, dev.server->retry_time); t > now) {
+                        next = min(next, t);
+                } else if (!r.inflight) { // WdfRequestSend failed, completion will not wake up
+                        next = now;
                 }
         }
+
+        has_timeout = next != MAXULONGLONG;
+        if (has_timeout) {
+                timeout = make_timeout(next - now, wdm::period::relative);
+        }
+
+        return waiting || r.inflight;
 }
 
-/*
- * Refreshing allows to remove devices that constantly fail to attach.
- */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED ULONG get_count(_In_ WDFCOLLECTION col, _In_ WDFKEY key, _In_ bool refresh)
+PAGED void collect(_Inout_ restore_ctx &r)
 {
         PAGED_CODE();
 
-        if (!refresh) {
-                //
-        } else if (auto newcol = get_persistent_devices(key)) {
-                intersection(col, newcol.get<WDFCOLLECTION>());
-        } else {
-                return 0;
+        for (ULONG i = 0; i < r.slot_cnt; ++i) {
+                if (auto &slot = r.slots[i]; slot.dev && slot.completed) {
+                        finish(r, slot, slot.status);
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void cancel_and_wait(_Inout_ restore_ctx &r)
+{
+        PAGED_CODE();
+
+        for (ULONG i = 0; i < r.slot_cnt; ++i) {
+                if (auto &slot = r.slots[i]; slot.dev) {
+                        WdfRequestCancelSentRequest(slot.request);
+                }
         }
 
-        return min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+        while (r.inflight) {
+                NT_VERIFY(!KeWaitForSingleObject(&r.completion, Executive, KernelMode, false, nullptr));
+                collect(r);
+        }
 }
 
+/*
+ * Up to N devices are attached concurrently, each device has own exponential backoff.
+ * A dead server delays its devices only.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
+PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx, _Inout_ restore_ctx &r)
 {
         PAGED_CODE();
 
+        change_event changed; // must be destroyed after the key
+        if (auto err = changed.create()) {
+                return;
+        }
+
         Registry key;
-        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE)) {
+        if (auto err = open_parameters_key(key, KEY_QUERY_VALUE | KEY_NOTIFY)) {
                 return;
         }
 
@@ -275,51 +616,69 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
                 return;
         }
 
-        auto vhci = get_handle(&ctx);
-
-        auto target = make_target(vhci);
+        auto target = make_target(get_handle(&ctx));
         if (!target) {
                 return;
         }
 
-        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
+        r.vhci = &ctx;
+        r.target = target.get<WDFIOTARGET>();
 
-        WDF_MEMORY_DESCRIPTOR input;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&input, &req, sizeof(req));
+        add_devices(r, devices.get<WDFCOLLECTION>());
 
-        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port);
+        if (auto n = get_parameter(L"PersistentAttachConcurrency", 4); 
+            auto err = init_slots(r, max(1UL, min(n, ULONG(MAX_INFLIGHT))))) {
+                return;
+        }
 
-        WDF_MEMORY_DESCRIPTOR output;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&output, &req, outlen);
+        void *objects[] = { &ctx.attach_thread_stop, &r.completion, changed.get() };
+        auto obj_cnt = ARRAYSIZE(objects);
+        static_assert(ARRAYSIZE(objects) <= THREAD_WAIT_OBJECTS);
 
-        for (ULONG attempt = 0; true; ++attempt) {
+        if (auto err = changed.notify(key.get())) {
+                --obj_cnt; // work without notifications
+        }
 
-                auto cnt = get_count(devices.get<WDFCOLLECTION>(), key.get(), attempt);
-                if (!cnt) {
+        for (LARGE_INTEGER timeout; ; ) {
+
+                bool has_timeout;
+                if (!launch(r, timeout, has_timeout)) {
                         break;
                 }
 
-                if (auto secs = get_delay(attempt, cnt)) {
-                        TraceDbg("attempt #%lu, %lu device(s), sleep %lu sec.", attempt, cnt, secs);
-                        if (!sleep(ctx, secs)) {
-                                break;
+                auto st = KeWaitForMultipleObjects(ULONG(obj_cnt), objects, WaitAny, Executive, KernelMode, false, 
+                                                   has_timeout ? &timeout : nullptr, nullptr);
+
+                if (st == STATUS_WAIT_0) {
+                        TraceDbg("thread stop requested");
+                        break;
+                } else if (st == STATUS_WAIT_1) {
+                        collect(r);
+                } else if (st == STATUS_WAIT_2) {
+                        changed.signaled();
+                        refresh(r, key.get());
+                        if (auto err = changed.notify(key.get())) {
+                                --obj_cnt;
                         }
+                } else if (st != STATUS_TIMEOUT) {
+                        Trace(TRACE_LEVEL_ERROR, "KeWaitForMultipleObjects %!STATUS!", st);
+                        break;
                 }
+        }
 
-                for (ULONG i = 0; i < cnt && sleep(ctx, 0); ) {
-                        UNICODE_STRING str{};
-                        if (auto s = (WDFSTRING)WdfCollectionGetItem(devices.get<WDFCOLLECTION>(), i)) {
-                                WdfStringGetUnicodeString(s, &str);
-                        }
+        cancel_and_wait(r);
+}
 
-                        if (plugin_hardware(str, target.get<WDFIOTARGET>(), req, input, output, outlen)) {
-                                TraceDbg("exclude %!USTR!", &str);
-                                WdfCollectionRemoveItem(devices.get<WDFCOLLECTION>(), i);
-                                --cnt;
-                        } else {
-                                ++i;
-                        }
-                }
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
+{
+        PAGED_CODE();
+
+        if (unique_ptr r(NonPagedPoolNx, sizeof(restore_ctx)); !r) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(restore_ctx));
+        } else {
+                plugin_persistent_devices(ctx, *r.get<restore_ctx>());
         }
 }
 
@@ -373,6 +732,36 @@ PAGED void usbip::plugin_persistent_devices(_In_ vhci_ctx *vhci)
         }
 }
 
+/*
+ * Target is self. 
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ObjectDelete usbip::make_target(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+        ObjectDelete target;
+
+        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
+                return target;
+        } else {
+                target.reset(t);
+        }
+
+        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+
+        WDF_IO_TARGET_OPEN_PARAMS params;
+        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
+
+        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
+                target.reset();
+        }
+
+        return target;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS usbip::copy(
@@ -418,3 +807,29 @@ PAGED NTSTATUS usbip::open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK
         key.reset(k);
         return st;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::get_parameter(_In_ PCWSTR name, _In_ ULONG defval)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return defval;
+        }
+
+        UNICODE_STRING value_name;
+        RtlUnicodeStringInit(&value_name, name);
+
+        ULONG val{};
+
+        if (auto err = WdfRegistryQueryULong(key.get(), &value_name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong('%!USTR!') %!STATUS!", &value_name, err);
+                }
+                val = defval;
+        }
+
+        return val;
+}
@@ -17,6 +17,13 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK DesiredAccess);
 
+/*
+ * @return REG_DWORD value from the Parameters key of the driver or defval if it does not exist 
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG get_parameter(_In_ PCWSTR name, _In_ ULONG defval = 0);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS copy(
@@ -28,4 +35,11 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void plugin_persistent_devices(_In_ vhci_ctx *vhci);
 
+/*
+ * @return I/O target for sending IOCTLs to itself
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ObjectDelete make_target(_In_ WDFDEVICE vhci);
+
 } // namespace usbip
@@ -21,11 +21,13 @@ auto matches(_In_ WDFREQUEST request, _In_ const request_ctx &req, _In_ const de
 {
         switch (crit.what) {
         case crit.SEQNUM:
-                return crit.seqnum == req.seqnum;
+                return contains(req, crit.seqnum); // any part
         case crit.REQUEST:
                 return crit.request == request;
         case crit.ENDPOINT:
                 return crit.endpoint == req.endpoint;
+        case crit.ANY:
+                return true;
         }
 
         Trace(TRACE_LEVEL_ERROR, "Invalid union member selector %d", crit.what);
@@ -51,11 +53,17 @@ void cancel_request(_In_ WDFREQUEST request)
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void usbip::device::append_request(_Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint)
+void usbip::device::append_request(
+        _Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint, _In_ USHORT parts)
 {
         auto &req = *get_request_ctx(wsk.request); // is not zeroed
         req.cancelable = false;
 
+        NT_ASSERT(parts);
+        req.parts = req.unsent = req.pending = parts;
+        req.busy = req.cancelled = false;
+        req.error = STATUS_SUCCESS;
+
         NT_ASSERT(endpoint);
         req.endpoint = endpoint;
 
@@ -71,10 +79,13 @@ void usbip::device::append_request(_Inout_ device_ctx &dev, _In_ const wsk_conte
  * - request can be already completed and must be used for value comparison only
  * - if request is completed, the same request instance can be allocated from a cache
  *   for next transfer and put in the list
+ *
+ * If a part was not sent, the request is not completed until sends of other parts are completed,
+ * their MDLs describe the transfer buffer of the URB.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS usbip::device::mark_request_cancelable(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+NTSTATUS usbip::device::sent_request(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum, _In_ NTSTATUS status)
 {
         NT_ASSERT(is_valid_seqnum(seqnum));
 
@@ -82,9 +93,19 @@ NTSTATUS usbip::device::mark_request_cancelable(_Inout_ device_ctx &dev, _In_ se
 
         for (auto head = &dev.requests, entry = head->Flink; entry != head; entry = entry->Flink) {
 
-                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); req->seqnum != seqnum) {
-                        // continue;
-                } else if (auto request = get_handle(req); auto err = WdfRequestMarkCancelableEx(request, cancel_request)) {
+                auto req = CONTAINING_RECORD(entry, request_ctx, entry);
+                if (!contains(*req, seqnum)) {
+                        continue;
+                }
+
+                if (NT_ERROR(status) && !req->error) {
+                        req->error = status;
+                }
+
+                if ((req->unsent && --req->unsent) || req->busy) { // see release_request
+                        break;
+                } else if (auto request = get_handle(req);
+                           auto err = req->error ? req->error : WdfRequestMarkCancelableEx(request, cancel_request)) {
                         TraceDbg("%04x, %!STATUS!", ptr04x(request), err);
                         RemoveEntryList(entry);
                         return err; // must do the same as cancel_request after that
@@ -99,7 +120,11 @@ NTSTATUS usbip::device::mark_request_cancelable(_Inout_ device_ctx &dev, _In_ se
 }
 
 /*
- * Its rival is cancel_request if it is marked cancellable, otherwise mark_request_cancelable.
+ * Its rival is cancel_request if it is marked cancellable, otherwise sent_request.
+ *
+ * If RET_SUBMIT is received for a part that is not the last one, the request is left in the list,
+ * it becomes busy and not cancelable until release_request. Other searches skip a busy request
+ * and mark it cancelled instead.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -117,6 +142,24 @@ WDFREQUEST usbip::device::remove_request(
                         continue;
                 }
 
+                if (req->busy) { // is owned by the receive thread
+                        req->cancelled = true;
+                        continue;
+                }
+
+                if (crit.what == crit.SEQNUM && --req->pending) {
+                        if (!(unmark_cancelable && req->cancelable)) {
+                                // not required
+                        } else if (auto ret = WdfRequestUnmarkCancelable(request); ret == STATUS_CANCELLED) {
+                                TraceDbg("%04x, unmark cancelable %!STATUS!", ptr04x(request), ret);
+                                return WDF_NO_HANDLE; // cancel_request will unlink all parts
+                        }
+
+                        req->cancelable = false;
+                        req->busy = true;
+                        return request;
+                }
+
                 RemoveEntryList(entry);
 
                 if (!(unmark_cancelable && req->cancelable)) {
@@ -137,3 +180,39 @@ WDFREQUEST usbip::device::remove_request(
 
         return WDF_NO_HANDLE;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::release_request(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ NTSTATUS status)
+{
+        auto &req = *get_request_ctx(request);
+
+        wdf::Lock lck(dev.requests_lock);
+
+        NT_ASSERT(req.busy);
+        req.busy = false;
+
+        if (!status && req.cancelled) {
+                status = STATUS_CANCELLED;
+        }
+
+        if (status && !req.error) {
+                req.error = status;
+        }
+
+        if (req.unsent) {
+                return STATUS_SUCCESS; // sent_request will do that
+        } else if (req.error) {
+                status = req.error;
+        } else if (auto err = WdfRequestMarkCancelableEx(request, cancel_request)) {
+                status = err;
+        } else {
+                req.cancelable = true;
+                return STATUS_SUCCESS;
+        }
+
+        TraceDbg("%04x, %!STATUS!", ptr04x(request), status);
+        RemoveEntryList(&req.entry);
+
+        return status;
+}
@@ -25,6 +25,9 @@ struct request_search
         request_search(_In_ WDFREQUEST req) : request(req), what(REQUEST) {}
         request_search(_In_ UDECXUSBENDPOINT endp) : endpoint(endp), what(ENDPOINT) {}
 
+        struct any_t {};
+        request_search(_In_ any_t) : what(ANY) {}
+
         request_search(_In_ seqnum_t n) : 
                 request(reinterpret_cast<WDFREQUEST>(static_cast<uintptr_t>(n))), // for operator bool correctness
                 what(SEQNUM) { NT_ASSERT(seqnum == n); }
@@ -32,7 +35,7 @@ struct request_search
         explicit operator bool() const { return request; }; // largest in union
         auto operator !() const { return !request; }
 
-        auto multimatch() const { return what == ENDPOINT; }
+        auto multimatch() const { return what == ENDPOINT || what == ANY; }
 
         union {
                 WDFREQUEST request{};
@@ -40,21 +43,36 @@ struct request_search
                 seqnum_t seqnum;
         };
 
-        enum what_t { SEQNUM, REQUEST, ENDPOINT };
+        enum what_t { SEQNUM, REQUEST, ENDPOINT, ANY };
         what_t what; // union's member selector
 };
 
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void append_request(_Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint);
+void append_request(
+        _Inout_ device_ctx &dev, _In_ const wsk_context &wsk, _In_ UDECXUSBENDPOINT endpoint, _In_ USHORT parts = 1);
 
+/*
+ * Send of a part has been completed, the request is marked cancelable when all parts are sent.
+ * @param status of the send
+ * @return error if the request was removed from the list, it must be unlinked and completed with this status
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS mark_request_cancelable(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum);
+NTSTATUS sent_request(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum, _In_ NTSTATUS status);
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST remove_request(_In_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable = true);
 
+/*
+ * The request was returned by remove_request for RET_SUBMIT of a part that is not the last one.
+ * @param status of processing of RET_SUBMIT
+ * @return error if the request was removed from the list, it must be unlinked and completed with this status
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS release_request(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ NTSTATUS status);
+
 } // namespace usbip::device
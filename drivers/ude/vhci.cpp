@@ -59,6 +59,7 @@ PAGED void vhci_cleanup(_In_ WDFOBJECT object)
         TraceDbg("vhci %04x", ptr04x(vhci));
 
         attach_thread_join(vhci);
+        clear(get_vhci_ctx(vhci)->addrinfo);
 }
 
 _Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
@@ -90,6 +91,40 @@ PAGED auto create_read_queue(_Out_ WDFQUEUE &queue, _In_ WDF_OBJECT_ATTRIBUTES &
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init_ports(_Inout_ roothub_ports &r, _In_ int first, _In_ int count)
+{
+        PAGED_CODE();
+        NT_ASSERT(count <= ARRAYSIZE(r.bits)*sizeof(*r.bits)*CHAR_BIT);
+
+        RtlInitializeBitMap(&r.bitmap, r.bits, count);
+        RtlClearAllBits(&r.bitmap);
+
+        r.first = first;
+}
+
+/*
+ * Each kind of ports gets at least one port and at most the default number of ports, see USB2_PORTS.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init_ports(_Inout_ vhci_ctx &ctx)
+{
+        PAGED_CODE();
+
+        auto usb2 = max(1UL, min(get_parameter(L"Usb2Ports", USB2_PORTS), ULONG(USB2_PORTS)));
+        auto usb3 = max(1UL, min(get_parameter(L"Usb3Ports", USB3_PORTS), ULONG(USB3_PORTS)));
+
+        init_ports(ctx.usb2_ports, 1, usb2);
+        init_ports(ctx.usb3_ports, usb2 + 1, usb3);
+
+        ctx.total_ports = usb2 + usb3;
+        NT_ASSERT(ctx.total_ports <= MAX_PORTS);
+
+        Trace(TRACE_LEVEL_INFORMATION, "usb2 ports %lu, usb3 ports %lu", usb2, usb3);
+}
+
 using init_func_t = NTSTATUS(WDFDEVICE);
 
 _Function_class_(init_func_t)
@@ -118,6 +153,16 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
                 return err;
         }
 
+        if (auto err = init(ctx.addrinfo, vhci)) {
+                return err;
+        }
+
+        init_ports(ctx);
+
+        LARGE_INTEGER now;
+        KeQuerySystemTime(&now);
+        ctx.generation = ctx.first_generation = now.QuadPart;
+
         KeInitializeEvent(&ctx.attach_thread_stop, NotificationEvent, false);
         InitializeListHead(&ctx.fileobjects);
 
@@ -365,15 +410,17 @@ _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto add_usbdevice_emulation(_In_ WDFDEVICE vhci)
 {
         PAGED_CODE();
+        auto &ctx = *get_vhci_ctx(vhci);
 
         UDECX_WDF_DEVICE_CONFIG cfg;
         UDECX_WDF_DEVICE_CONFIG_INIT(&cfg, query_usb_capability);
 
-        cfg.NumberOfUsb20Ports = USB2_PORTS;
-        cfg.NumberOfUsb30Ports = USB3_PORTS;
+        cfg.NumberOfUsb20Ports = static_cast<USHORT>(ctx.usb2_ports.bitmap.SizeOfBitMap);
+        cfg.NumberOfUsb30Ports = static_cast<USHORT>(ctx.usb3_ports.bitmap.SizeOfBitMap);
 
-        if (auto err = UdecxWdfDeviceAddUsbDeviceEmulation(vhci, &cfg)) {
-                Trace(TRACE_LEVEL_ERROR, "UdecxWdfDeviceAddUsbDeviceEmulation %!STATUS!", err);
+        if (auto err = UdecxWdfDeviceAddUsbDeviceEmulation(vhci, &cfg)) { // fails the device add
+                Trace(TRACE_LEVEL_ERROR, "UdecxWdfDeviceAddUsbDeviceEmulation(usb2 ports %d, usb3 ports %d) %!STATUS!",
+                                          cfg.NumberOfUsb20Ports, cfg.NumberOfUsb30Ports, err);
                 return err;
         }
 
@@ -453,19 +500,20 @@ PAGED auto create_vhci(_Out_ WDFDEVICE &vhci, _In_ WDFDEVICE_INIT *init)
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto get_port_range(_In_ usb_device_speed speed)
+auto& get_roothub_ports(_In_ vhci_ctx &vhci, _In_ int port)
 {
-        struct{ int begin;  int end; } r;
-
-        if (speed < USB_SPEED_SUPER) {
-                r.begin = 0;
-                r.end = USB2_PORTS;
-        } else {
-                r.begin = USB2_PORTS;
-                r.end = TOTAL_PORTS;
-        }
+        return port < vhci.usb3_ports.first ? vhci.usb2_ports : vhci.usb3_ports;
+}
 
-        return r;
+/*
+ * vhci_ctx::devices_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+inline void bump_generation(_Inout_ vhci_ctx &vhci, _In_ int port)
+{
+        NT_ASSERT(is_valid_port(port));
+        vhci.port_generation[port - 1] = ++vhci.generation;
 }
 
 _IRQL_requires_same_
@@ -500,6 +548,45 @@ PAGED auto make_device_state(
         return mem;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto& get_device_state(_In_ WDFMEMORY evt)
+{
+        PAGED_CODE();
+        return *static_cast<vhci::device_state*>(WdfMemoryGetBuffer(evt, nullptr));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto same_device(_In_ const vhci::imported_device_location &a, _In_ const vhci::imported_device_location &b)
+{
+        PAGED_CODE();
+        return !(strcmp(a.busid, b.busid) || strcmp(a.service, b.service) || strcmp(a.host, b.host));
+}
+
+/*
+ * Called if the reader lags, the latest state of a device wins. A pending event of the same device
+ * is removed, thus there is at most one pending event per device.
+ * vhci_ctx::events_lock must be acquired.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto remove_pending_event(_In_ WDFCOLLECTION events, _In_ WDFMEMORY evt)
+{
+        PAGED_CODE();
+        auto &st = get_device_state(evt);
+
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(events); i < cnt; ++i) {
+                auto item = static_cast<WDFMEMORY>(WdfCollectionGetItem(events, i));
+                if (same_device(get_device_state(item), st)) {
+                        WdfCollectionRemove(events, item); // decrements reference count
+                        return item;
+                }
+        }
+
+        return WDFMEMORY(WDF_NO_HANDLE);
+}
+
 /*
  * vhci_ctx::events_lock must be acquired.
  */
@@ -515,9 +602,13 @@ PAGED void process_event(_In_ WDFQUEUE queue, _Inout_ fileobject_ctx &fobj, _In_
         switch (auto st = WdfIoQueueRetrieveRequestByFileObject(queue, fileobj, &request)) {
         case STATUS_SUCCESS:
                 NT_ASSERT(!WdfCollectionGetCount(fobj.events));
-                vhci::complete_read(request, evt);
+                vhci::complete_read(request, fobj.events, evt);
                 break;
         case STATUS_NO_MORE_ENTRIES:
+                if (auto old = remove_pending_event(fobj.events, evt)) {
+                        TraceDbg("fobj %04x, replace %04x", ptr04x(fileobj), ptr04x(old));
+                }
+
                 if (auto err = WdfCollectionAdd(fobj.events, evt)) { // append and increment reference count
                         Trace(TRACE_LEVEL_ERROR, "WdfCollectionAdd %!STATUS!", err);
                 } else if (auto cnt = WdfCollectionGetCount(fobj.events); cnt > fobj.MAX_EVENTS) {
@@ -595,22 +686,24 @@ int usbip::vhci::claim_roothub_port(_In_ UDECXUSBDEVICE device)
         NT_ASSERT(!dev.port);
         int port = 0;
 
-        auto [begin, end] = get_port_range(dev.speed());
+        auto &ports = dev.speed() < USB_SPEED_SUPER ? vhci.usb2_ports : vhci.usb3_ports;
 
         wdf::Lock lck(vhci.devices_lock); // function must be resident, do not use PAGED
 
-        for (auto i = begin; i < end; ++i) {
-                NT_ASSERT(i < ARRAYSIZE(vhci.devices));
+        if (auto i = RtlFindClearBitsAndSet(&ports.bitmap, 1, 0); i != ULONG(-1)) {
+                port = ports.first + i;
+                NT_ASSERT(is_valid_port(port));
 
-                if (auto &handle = vhci.devices[i]; !handle) {
-                        WdfObjectReference(handle = device);
-                        
-                        port = i + 1;
-                        NT_ASSERT(is_valid_port(port));
+                auto &handle = vhci.devices[port - 1];
+                NT_ASSERT(!handle);
+                WdfObjectReference(handle = device);
 
-                        dev.port = port;
-                        break;
-                }
+                auto pos = vhci.occupied_cnt++;
+                vhci.occupied[pos] = static_cast<UCHAR>(port);
+                vhci.occupied_pos[port - 1] = static_cast<UCHAR>(pos);
+
+                bump_generation(vhci, port);
+                dev.port = port;
         }
 
         lck.release();
@@ -634,8 +727,19 @@ int usbip::vhci::reclaim_roothub_port(_In_ UDECXUSBDEVICE device)
 
                 auto &handle = vhci.devices[port - 1];
                 NT_ASSERT(handle == device);
-
                 handle = WDF_NO_HANDLE;
+
+                auto &ports = get_roothub_ports(vhci, port);
+                RtlClearBit(&ports.bitmap, port - ports.first);
+
+                auto pos = vhci.occupied_pos[port - 1]; // swap with the last one
+                auto last = vhci.occupied[--vhci.occupied_cnt];
+                NT_ASSERT(vhci.occupied[pos] == port);
+
+                vhci.occupied[pos] = last;
+                vhci.occupied_pos[last - 1] = pos;
+
+                bump_generation(vhci, port);
                 port = 0;
         }
         lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
@@ -668,6 +772,70 @@ wdf::ObjectRef usbip::vhci::get_device(_In_ WDFDEVICE vhci, _In_ int port)
         return ptr;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int usbip::vhci::get_ports(_In_ WDFDEVICE vhci, _Out_writes_(MAX_PORTS) UCHAR *ports)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        wdf::Lock lck(ctx.devices_lock);
+        int cnt = ctx.occupied_cnt;
+        RtlCopyMemory(ports, ctx.occupied, cnt);
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+
+        for (int i = 1; i < cnt; ++i) { // insertion sort, the count is small
+                auto port = ports[i];
+                auto j = i;
+                for ( ; j && ports[j - 1] > port; --j) {
+                        ports[j] = ports[j - 1];
+                }
+                ports[j] = port;
+        }
+
+        return cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::vhci::port_changed(_In_ WDFDEVICE vhci, _In_ int port)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+
+        wdf::Lock lck(ctx.devices_lock); // function must be resident, do not use PAGED
+        bump_generation(ctx, port);
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 usbip::vhci::get_changed_ports(
+        _In_ WDFDEVICE vhci, _In_ UINT64 generation, _Out_writes_(MAX_PORTS) UCHAR *ports, _Out_ int &cnt,
+        _Out_ bool &full)
+{
+        auto &ctx = *get_vhci_ctx(vhci);
+        cnt = 0;
+
+        wdf::Lock lck(ctx.devices_lock);
+
+        auto current = ctx.generation;
+        full = generation < ctx.first_generation || generation > current; // zero or of another instance
+
+        if (full) {
+                generation = 0;
+        }
+
+        if (generation != current) {
+                for (int port = 1; port <= ctx.total_ports; ++port) {
+                        if (ctx.port_generation[port - 1] > generation) {
+                                ports[cnt++] = static_cast<UCHAR>(port);
+                        }
+                }
+        }
+
+        lck.release(); // explicit call to satisfy code analyzer and get rid of warning C28166
+        return current;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED void usbip::vhci::detach_all_devices(_In_ WDFDEVICE vhci, _In_ detach_call how)
@@ -675,10 +843,28 @@ PAGED void usbip::vhci::detach_all_devices(_In_ WDFDEVICE vhci, _In_ detach_call
         PAGED_CODE();
 
         TraceDbg("%04x", ptr04x(vhci));
+
+        UCHAR ports[MAX_PORTS];
+        auto cnt = get_ports(vhci, ports);
+
+        if (how == detach_call::async_wait) { // all at once
+                wdf::ObjectRef devices[MAX_PORTS];
+                int dev_cnt = 0;
+
+                for (int i = 0; i < cnt; ++i) {
+                        if (devices[dev_cnt] = get_device(vhci, ports[i]); devices[dev_cnt]) {
+                                ++dev_cnt;
+                        }
+                }
+
+                device::plugout_and_delete_all(devices, dev_cnt);
+                return;
+        }
+
         auto detach = get_detach_function(how);
 
-        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
-                if (auto dev = get_device(vhci, port); auto hdev = dev.get<UDECXUSBDEVICE>()) {
+        for (int i = 0; i < cnt; ++i) {
+                if (auto dev = get_device(vhci, ports[i]); auto hdev = dev.get<UDECXUSBDEVICE>()) {
                         detach(hdev);
                 }
         }
@@ -704,28 +890,35 @@ PAGED NTSTATUS usbip::vhci::fill(_Out_ imported_device &dev, _In_ const device_c
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void usbip::vhci::complete_read(_In_ WDFREQUEST request, _In_ WDFMEMORY evt)
+PAGED void usbip::vhci::complete_read(_In_ WDFREQUEST request, _In_ WDFCOLLECTION events, _In_opt_ WDFMEMORY evt)
 {
         PAGED_CODE();
 
         device_state *dst{};
-        auto dst_sz = sizeof(*dst);
+        size_t dst_len{};
+        size_t cnt = 0;
+
+        auto st = WdfRequestRetrieveOutputBuffer(request, sizeof(*dst), reinterpret_cast<PVOID*>(&dst), &dst_len);
 
-        auto st = WdfRequestRetrieveOutputBuffer(request, dst_sz, reinterpret_cast<PVOID*>(&dst), nullptr);
-        
         if (NT_SUCCESS(st)) {
-                size_t size{};
-                *dst = *reinterpret_cast<device_state*>(WdfMemoryGetBuffer(evt, &size));
-                NT_ASSERT(size == dst_sz);
+                auto max_cnt = dst_len/sizeof(*dst);
+
+                if (evt) {
+                        dst[cnt++] = get_device_state(evt);
+                }
+
+                for (WDFMEMORY item; cnt < max_cnt && (item = static_cast<WDFMEMORY>(WdfCollectionGetFirstItem(events))); ) {
+                        dst[cnt++] = get_device_state(item);
+                        WdfCollectionRemove(events, item); // decrements reference count
+                }
         } else {
                 Trace(TRACE_LEVEL_ERROR, "WdfRequestRetrieveOutputBuffer %!STATUS!", st);
-                dst_sz = 0;
         }
 
-        TraceDbg("fobj %04x, req %04x, device_state %04x, %!STATUS!", ptr04x(WdfRequestGetFileObject(request)), 
-                  ptr04x(request), ptr04x(evt), st);
+        TraceDbg("fobj %04x, req %04x, device_state %04x, count %Iu, %!STATUS!",
+                  ptr04x(WdfRequestGetFileObject(request)), ptr04x(request), ptr04x(evt), cnt, st);
 
-        WdfRequestCompleteWithInformation(request, st, dst_sz);
+        WdfRequestCompleteWithInformation(request, st, cnt*sizeof(*dst));
 }
 
 /*
@@ -741,6 +934,10 @@ PAGED void usbip::vhci::device_state_changed(
         auto &ctx = *get_vhci_ctx(vhci);
         auto subscribers = ctx.events_subscribers;
 
+        if (is_valid_port(port)) {
+                port_changed(vhci, port);
+        }
+
         TraceDbg("%!USTR!:%!USTR!/%!USTR!, port %d, %!vhci_state!, subscribers %d", 
                   &ext.node_name, &ext.service_name, &ext.busid, port, int(state), subscribers);
 
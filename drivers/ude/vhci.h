@@ -32,6 +32,34 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 wdf::ObjectRef get_device(_In_ WDFDEVICE vhci, _In_ int port);
 
+/*
+ * @param ports receives port numbers of plugged in devices in ascending order
+ * @return number of ports
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+int get_ports(_In_ WDFDEVICE vhci, _Out_writes_(MAX_PORTS) UCHAR *ports);
+
+/*
+ * Increments the generation, must be called if the state of the port is changed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void port_changed(_In_ WDFDEVICE vhci, _In_ int port);
+
+/*
+ * @param generation ports that were changed after it are returned
+ * @param ports receives port numbers in ascending order
+ * @param cnt number of ports
+ * @param full generation is zero or unknown, ports that were ever changed are returned
+ * @return current generation
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UINT64 get_changed_ports(
+        _In_ WDFDEVICE vhci, _In_ UINT64 generation, _Out_writes_(MAX_PORTS) UCHAR *ports, _Out_ int &cnt,
+        _Out_ bool &full);
+
 enum class detach_call { async_wait, async_nowait, direct };
 
 _IRQL_requires_same_
@@ -50,9 +78,13 @@ inline auto fill(_Out_ imported_device &dev, _In_ const device_ctx &ctx)
         return fill(dev, *ctx.ext, ctx.port);
 }
 
+/*
+ * Copies evt (if any), then moves pending events from the collection while they fit into the buffer.
+ * vhci_ctx::events_lock must be acquired.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void complete_read(_In_ WDFREQUEST request, _In_ WDFMEMORY evt);
+PAGED void complete_read(_In_ WDFREQUEST request, _In_ WDFCOLLECTION events, _In_opt_ WDFMEMORY evt);
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -12,12 +12,16 @@
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "batch_attach.h"
+#include "descriptor_snapshot.h"
+#include "descriptor_prefetch.h"
 
 #include <usbip\proto_op.h>
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\strconv.h>
 #include <libdrv\irp.h>
+#include <libdrv\wait_timeout.h>
 
 #include <ntstrsafe.h>
 #include <usbuser.h>
@@ -37,6 +41,7 @@ struct workitem_ctx
         WDFDEVICE vhci;
         device_ctx_ext *ext;
         ADDRINFOEXW *addrinfo; // list head
+        bool cached; // addrinfo was copied from vhci_ctx::addrinfo, see free_cached
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(workitem_ctx, get_workitem_ctx)
 
@@ -92,7 +97,7 @@ PAGED void log(_In_ const usbip_usb_device &d)
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto send_req_import(_In_ device_ctx_ext &ext)
+PAGED auto send_req_import(_In_ const device_ctx_ext &ext, _In_ wsk::SOCKET *sock)
 {
         PAGED_CODE();
 
@@ -111,21 +116,22 @@ PAGED auto send_req_import(_In_ device_ctx_ext &ext)
         PACK_OP_COMMON(false, &req.hdr);
         PACK_OP_IMPORT_REQUEST(false, &req.body);
 
-        return send(ext.sock, memory::stack, &req, sizeof(req));
+        return send(sock, memory::stack, &req, sizeof(req));
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_ op_import_reply &reply)
+PAGED NTSTATUS recv_rep_import(
+        _In_ const device_ctx_ext &ext, _In_ wsk::SOCKET *sock, _In_ memory pool, _Out_ op_import_reply &reply)
 {
         PAGED_CODE();
         RtlZeroMemory(&reply, sizeof(reply));
 
-        if (auto err = recv_op_common(ext.sock, OP_REP_IMPORT)) {
+        if (auto err = recv_op_common(sock, OP_REP_IMPORT)) {
                 return err;
         }
 
-        if (auto err = recv(ext.sock, pool, &reply, sizeof(reply))) {
+        if (auto err = recv(sock, pool, &reply, sizeof(reply))) {
                 Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
                 return err;
         }
@@ -143,32 +149,58 @@ PAGED NTSTATUS recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_
         return STATUS_SUCCESS;
 }
 
+/*
+ * @param rtt of OP_REQ_IMPORT, includes server's processing time
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
+PAGED NTSTATUS import_remote_device(
+        _In_ const device_ctx_ext &ext, _In_ wsk::SOCKET *sock, _Out_ usbip_usb_device &udev, _Out_ ULONGLONG &rtt)
 {
         PAGED_CODE();
+        auto start = KeQueryInterruptTime();
 
-        if (auto err = send_req_import(ext)) {
+        if (auto err = send_req_import(ext, sock)) {
                 Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
                 return err;
         }
 
         op_import_reply reply;
-        if (auto err = recv_rep_import(ext, memory::stack, reply)) {
+        if (auto err = recv_rep_import(ext, sock, memory::stack, reply)) {
                 return err;
         }
- 
-        auto &udev = reply.udev; 
+
+        rtt = KeQueryInterruptTime() - start;
+        udev = reply.udev;
         log(udev);
 
-        if (auto d = &ext.dev) {
-                d->devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
-                d->speed = static_cast<usb_device_speed>(udev.speed);
-                d->vendor = udev.idVendor;
-                d->product = udev.idProduct;
+        return STATUS_SUCCESS;
+}
+
+constexpr auto make_properties(_In_ const usbip_usb_device &udev)
+{
+        return vhci::imported_device_properties {
+                .devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum)),
+                .speed = static_cast<usb_device_speed>(udev.speed),
+                .vendor = udev.idVendor,
+                .product = udev.idProduct,
+        };
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        usbip_usb_device udev;
+        if (auto err = import_remote_device(ext, ext.sock, udev, ext.rtt)) {
+                return err;
         }
 
+        ext.dev = make_properties(udev);
+        ext.bcdDevice = udev.bcdDevice;
+
         return STATUS_SUCCESS;
 }
 
@@ -215,6 +247,35 @@ PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
         return device::recv_thread_start(device);
 }
 
+/*
+ * SO_RCVBUF disables receive window autotuning that is usually better than any fixed value.
+ * It is set only if value ReceiveBufferSize in the Parameters key of the driver is not zero.
+ * The window scale is negotiated during connect, so the option must be set before that.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void set_rcvbuf(_In_ wsk::SOCKET *sock)
+{
+        PAGED_CODE();
+
+        auto val = get_parameter(L"ReceiveBufferSize");
+        if (!val) {
+                return;
+        }
+
+        int cur{};
+        if (auto err = get_rcvbuf(sock, cur)) {
+                Trace(TRACE_LEVEL_ERROR, "get_rcvbuf %!STATUS!", err);
+        }
+
+        auto optval = static_cast<int>(min(val, INT_MAX));
+        Trace(TRACE_LEVEL_VERBOSE, "SO_RCVBUF %d -> %d", cur, optval);
+
+        if (auto err = wsk::set_rcvbuf(sock, optval)) {
+                Trace(TRACE_LEVEL_ERROR, "set_rcvbuf(%d) %!STATUS!", optval, err);
+        }
+}
+
 /*
  * TCP_NODELAY is not supported, see WSK_FLAG_NODELAY.
  */
@@ -275,14 +336,24 @@ PAGED NTSTATUS connected(_In_ WDFREQUEST request, _Inout_ device_ctx_ext* &ext)
 
         if (auto err = import_remote_device(*ext)) {
                 return err;
+        } else {
+                mark_stage(*ext, vhci::attach_stage::imported);
         }
 
         UDECXUSBDEVICE dev{};
         if (auto err = device::create(dev, vhci, ext)) {
                 return err;
         }
+        mark_stage(*ext, vhci::attach_stage::created);
         ext = nullptr; // now dev owns it
 
+        load_descriptor_snapshot(*get_device_ctx(dev));
+
+        if (auto err = prefetch_descriptors(*get_device_ctx(dev))) { // the connection is in unknown state
+                WdfObjectDelete(dev);
+                return err;
+        }
+
         if (auto err = start_device(r->port, dev)) {
                 WdfObjectDelete(dev); // UdecxUsbDevicePlugIn failed or was not called
                 return err;
@@ -291,6 +362,7 @@ PAGED NTSTATUS connected(_In_ WDFREQUEST request, _Inout_ device_ctx_ext* &ext)
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x plugged in, port %d", ptr04x(dev), r->port);
 
         if (auto ctx = get_device_ctx(dev)) {
+                mark_stage(*ctx->ext, vhci::attach_stage::plugged);
                 device_state_changed(*ctx, vhci::state::plugged);
         }
 
@@ -329,6 +401,8 @@ PAGED NTSTATUS create_socket(_Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW
                 return err;
         }
 
+        set_rcvbuf(sock);
+
         SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
                 .si_family = static_cast<ADDRESS_FAMILY>(ai.ai_family)
         };
@@ -343,14 +417,9 @@ PAGED NTSTATUS create_socket(_Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS connect(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+PAGED NTSTATUS connect(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _In_ wsk::SOCKET *sock, _In_ const ADDRINFOEXW &ai)
 {
         PAGED_CODE();
-
-        if (auto err = create_socket(sock, ai)) {
-                return err;
-        }
-
         auto sa = make_sockaddr_inet(ai);
 
         auto irp = set_args(request, __func__, &ai);
@@ -369,6 +438,89 @@ PAGED NTSTATUS connect(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ wsk
         return STATUS_PENDING;
 }
 
+/*
+ * Cached addresses could be stale.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void invalidate_addrinfo(_In_ WDFREQUEST request, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto &vhci = *get_vhci_ctx(get_vhci(request));
+        invalidate(vhci.addrinfo, ext.node_name, ext.service_name);
+}
+
+/*
+ * Addresses are tried in turn, starting from ai, until connect is initiated.
+ * The cache entry is invalidated if a socket can't be created for any of them.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS connect(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ device_ctx_ext &ext, _In_ const ADDRINFOEXW &ai)
+{
+        PAGED_CODE();
+        NTSTATUS st{};
+
+        for (auto cur = &ai; cur; cur = cur->ai_next) {
+                if (st = create_socket(ext.sock, *cur); !st) {
+                        return connect(request, wi, ext.sock, *cur);
+                }
+
+                if (auto &sock = ext.sock) {
+                        NT_VERIFY(NT_SUCCESS(close(sock)));
+                        free(sock);
+                }
+        }
+
+        invalidate_addrinfo(request, ext);
+        return st;
+}
+
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS connect_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        auto event = static_cast<KEVENT*>(context);
+        KeSetEvent(event, IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+/*
+ * Synchronous connect with a timeout, unlike ioctl::plugin_hardware it must not wait for too long. 
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS connect(_In_ wsk::SOCKET *sock, _In_ const SOCKADDR_INET &remote)
+{
+        PAGED_CODE();
+
+        libdrv::irp_ptr irp(CCHAR(1), false);
+        if (!irp) {
+                Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp error");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KEVENT done;
+        KeInitializeEvent(&done, NotificationEvent, false);
+
+        IoSetCompletionRoutine(irp.get(), connect_complete, &done, true, true, true);
+
+        auto addr = remote;
+        if (auto st = connect(sock, reinterpret_cast<SOCKADDR*>(&addr), irp.get()); st == STATUS_NOT_SUPPORTED) {
+                return st; // the socket is closed, IRP was not passed to WSK
+        }
+
+        if (auto timeout = make_timeout(5*wdm::second, wdm::period::relative);
+            KeWaitForSingleObject(&done, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT) {
+                IoCancelIrp(irp.get());
+                KeWaitForSingleObject(&done, Executive, KernelMode, false, nullptr);
+        }
+
+        return irp.get()->IoStatus.Status;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto on_connect(
@@ -379,20 +531,49 @@ PAGED auto on_connect(
         auto st = WdfRequestGetStatus(request);
 
         if (NT_SUCCESS(st)) {
+                ext->remote = make_sockaddr_inet(ai);
+                mark_stage(*ext, vhci::attach_stage::connected);
                 st = connected(request, ext);
                 NT_ASSERT(st != STATUS_PENDING);
         } else {
                 NT_VERIFY(NT_SUCCESS(close(ext->sock)));
                 free(ext->sock);
 
-                if (st != STATUS_CANCELLED && ai.ai_next) {
-                        st = connect(request, wi, ext->sock, *ai.ai_next);
+                if (st == STATUS_CANCELLED) {
+                        //
+                } else if (ai.ai_next) {
+                        st = connect(request, wi, *ext, *ai.ai_next);
+                } else {
+                        invalidate_addrinfo(request, *ext);
                 }
         }
 
         return st;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto on_addrinfo(_In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ workitem_ctx &ctx)
+{
+        PAGED_CODE();
+
+        auto &ext = *ctx.ext;
+        auto &cache = get_vhci_ctx(ctx.vhci)->addrinfo;
+
+        auto st = WdfRequestGetStatus(request);
+
+        if (NT_SUCCESS(st)) {
+                NT_ASSERT(ctx.addrinfo);
+                insert(cache, ext.node_name, ext.service_name, ctx.addrinfo);
+                mark_stage(ext, vhci::attach_stage::resolved);
+                st = connect(request, wi, ext, *ctx.addrinfo);
+        } else if (is_name_not_found(st)) { // transient failures are not cached
+                insert(cache, ext.node_name, ext.service_name, st);
+        }
+
+        return st;
+}
+
 _Function_class_(EVT_WDF_WORKITEM)
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -415,9 +596,8 @@ PAGED void NTAPI complete(_In_ WDFWORKITEM wi)
 
         if (auto ai = libdrv::argv<ADDRINFOEXW*, ARG_AI>(irp)) {
                 st = on_connect(request, wi, ctx.ext, *ai);
-        } else if (NT_SUCCESS(st)) { // on_addrinfo
-                NT_ASSERT(ctx.addrinfo);
-                st = connect(request, wi, ext.sock, *ctx.addrinfo);
+        } else {
+                st = on_addrinfo(request, wi, ctx);
         }
 
         if (st != STATUS_PENDING) {
@@ -438,7 +618,11 @@ PAGED void workitem_cleanup(_In_ WDFOBJECT obj)
         auto &ctx = *get_workitem_ctx(static_cast<WDFWORKITEM>(obj)); 
         TraceDbg("%04x, addrinfo %04x, device_ctx_ext %04x", ptr04x(obj), ptr04x(ctx.addrinfo), ptr04x(ctx.ext));
 
-        wsk::free(ctx.addrinfo);
+        if (ctx.cached) {
+                free_cached(ctx.addrinfo);
+        } else {
+                wsk::free(ctx.addrinfo);
+        }
         ctx.addrinfo = nullptr;
 
         if (auto &ext = ctx.ext) {
@@ -513,8 +697,21 @@ PAGED NTSTATUS plugin_hardware( _In_ WDFREQUEST request, _In_ const vhci::ioctl:
                 return err;
         }
 
+        mark_stage(*ctx.ext, vhci::attach_stage::started);
         device_state_changed(ctx.vhci, *ctx.ext, 0, vhci::state::connecting);
 
+        auto &ext = *ctx.ext;
+        auto &cache = get_vhci_ctx(ctx.vhci)->addrinfo;
+
+        if (NTSTATUS st; lookup(cache, ext.node_name, ext.service_name, ctx.addrinfo, st)) {
+                if (NT_SUCCESS(st)) {
+                        ctx.cached = true;
+                        mark_stage(ext, vhci::attach_stage::resolved);
+                        st = connect(request, wi, ext, *ctx.addrinfo);
+                }
+                return st;
+        }
+
         auto st = getaddrinfo(request, wi, ctx);
         TraceDbg("getaddrinfo %!STATUS!", st);
 
@@ -617,8 +814,11 @@ PAGED NTSTATUS get_imported_devices(_In_ WDFREQUEST request)
         auto vhci = get_vhci(request);
         ULONG cnt = 0;
 
-        for (int port = 1; port <= ARRAYSIZE(vhci_ctx::devices); ++port) {
-                if (auto dev = vhci::get_device(vhci, port); !dev) {
+        UCHAR ports[MAX_PORTS];
+        auto port_cnt = vhci::get_ports(vhci, ports);
+
+        for (int i = 0; i < port_cnt; ++i) {
+                if (auto dev = vhci::get_device(vhci, ports[i]); !dev) { // detached meanwhile
                         //
                 } else if (cnt == max_cnt) {
                         return STATUS_BUFFER_TOO_SMALL;
@@ -636,6 +836,126 @@ PAGED NTSTATUS get_imported_devices(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+/*
+ * Only the ports that were changed after the generation of the caller are reported.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_imported_devices_delta(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        size_t outlen;
+        vhci::ioctl::get_imported_devices_delta *r;
+
+        if (auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &outlen)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_imported_devices_delta.size %lu != sizeof(get_imported_devices_delta) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        }
+
+        auto items_size = outlen - offsetof(vhci::ioctl::get_imported_devices_delta, items); // size of array
+
+        auto max_cnt = items_size/sizeof(*r->items);
+        NT_ASSERT(max_cnt);
+
+        auto vhci = get_vhci(request);
+
+        UCHAR ports[MAX_PORTS];
+        int port_cnt;
+        bool full;
+        auto generation = vhci::get_changed_ports(vhci, r->generation, ports, port_cnt, full);
+
+        ULONG cnt = 0;
+
+        for (int i = 0; i < port_cnt; ++i) {
+                auto dev = vhci::get_device(vhci, ports[i]);
+                if (!dev && full) {
+                        continue;
+                } else if (cnt == max_cnt) {
+                        return STATUS_BUFFER_TOO_SMALL;
+                }
+
+                auto &item = r->items[cnt++];
+
+                if (dev) {
+                        item.unplugged = false;
+                        if (auto err = fill(item, *get_device_ctx(dev.get()))) {
+                                return err;
+                        }
+                } else { // a change after the generation will be reported by the next call
+                        RtlZeroMemory(&item, sizeof(item));
+                        item.port = ports[i];
+                        item.unplugged = true;
+                }
+        }
+
+        TraceDbg("generation %I64u -> %I64u, full %d, %lu port(s) reported", r->generation, generation, full, cnt);
+
+        r->generation = generation;
+        r->full = full;
+        r->count = cnt;
+
+        auto written = vhci::ioctl::get_imported_devices_delta_size(cnt);
+        NT_ASSERT(written <= outlen);
+        WdfRequestSetInformation(request, written);
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Offsets of attach stages of the device are returned.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS get_attach_timeline(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+        WdfRequestSetInformation(request, 0);
+
+        vhci::ioctl::get_attach_timeline *r{};
+
+        if (size_t length;
+            auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_attach_timeline.size %lu != sizeof(get_attach_timeline) %Iu",
+                                          r->size, sizeof(*r));
+
+                return USBIP_ERROR_ABI;
+        } else if (!is_valid_port(r->port)) {
+                return STATUS_INVALID_PARAMETER;
+        }
+
+        auto dev = vhci::get_device(get_vhci(request), r->port);
+        if (!dev) {
+                return STATUS_DEVICE_NOT_CONNECTED;
+        }
+
+        auto &timeline = get_device_ctx(dev.get())->ext->timeline;
+        auto start = timeline[static_cast<int>(vhci::attach_stage::started)];
+
+        r->reached = 0;
+
+        for (int i = 0; i < ARRAYSIZE(timeline); ++i) {
+                if (auto t = timeline[i]) {
+                        r->reached |= 1UL << i;
+                        r->usec[i] = (t - start)/wdm::usec;
+                } else {
+                        r->usec[i] = 0;
+                }
+        }
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto set_persistent(_In_ WDFREQUEST request)
@@ -729,9 +1049,6 @@ PAGED void device_control(
         NTSTATUS st;
 
         switch (IoControlCode) {
-        case vhci::ioctl::PLUGIN_HARDWARE:
-                st = plugin_hardware(Request);
-                break;
         case vhci::ioctl::PLUGOUT_HARDWARE:
                 st = plugout_hardware(Request);
                 break;
@@ -772,8 +1089,16 @@ PAGED decltype(get_persistent) *get_parallel_handler(_In_ ULONG IoControlCode)
         PAGED_CODE();
 
         switch (IoControlCode) {
+        case vhci::ioctl::PLUGIN_HARDWARE: // it is asynchronous, several attaches can be in progress
+                return plugin_hardware;
+        case vhci::ioctl::PLUGIN_HARDWARE_BATCH:
+                return plugin_hardware_batch;
         case vhci::ioctl::GET_IMPORTED_DEVICES:
                 return get_imported_devices;
+        case vhci::ioctl::GET_IMPORTED_DEVICES_DELTA:
+                return get_imported_devices_delta;
+        case vhci::ioctl::GET_ATTACH_TIMELINE:
+                return get_attach_timeline;
         case vhci::ioctl::SET_PERSISTENT:
                 return set_persistent;
         case vhci::ioctl::GET_PERSISTENT:
@@ -833,7 +1158,7 @@ PAGED void device_read(_In_ WDFQUEUE queue, _In_ WDFREQUEST request, _In_ size_t
 
         TraceDbg("fobj %04x, request %04x, length %Iu", ptr04x(fileobj), ptr04x(request), length);
 
-        if (length != sizeof(vhci::device_state)) {
+        if (length < sizeof(vhci::device_state) || length % sizeof(vhci::device_state)) {
                 WdfRequestCompleteWithInformation(request, STATUS_INVALID_BUFFER_SIZE, 0);
                 return;
         }
@@ -848,9 +1173,8 @@ PAGED void device_read(_In_ WDFQUEUE queue, _In_ WDFREQUEST request, _In_ size_t
                 val = true;
         }
 
-        if (auto evt = (WDFMEMORY)WdfCollectionGetFirstItem(fobj.events)) {
-                vhci::complete_read(request, evt);
-                WdfCollectionRemove(fobj.events, evt); // decrements reference count
+        if (WdfCollectionGetCount(fobj.events)) {
+                vhci::complete_read(request, fobj.events, WDF_NO_HANDLE);
         } else if (auto err = WdfRequestForwardToIoQueue(request, vhci.reads)) {
                 Trace(TRACE_LEVEL_ERROR, "WdfRequestForwardToIoQueue %!STATUS!", err);
                 if (err == STATUS_WDF_BUSY) { // the queue is not accepting new requests, purged
@@ -898,3 +1222,93 @@ PAGED NTSTATUS usbip::vhci::create_queues(_In_ WDFDEVICE vhci)
 
         return STATUS_SUCCESS;
 }
+
+/*
+ * The server's address is reused, the name resolution is not performed. 
+ * The same device must be imported again, it is checked by its devid, speed, vendor and product.
+ *
+ * The new socket is published in ext->next_sock, so detach can abort connect and import by closing it.
+ * The previous socket is retired rather than freed, other threads may still use it, see close_socket.
+ * State that belongs to the previous connection is reset: cached descriptors (including prefetched
+ * ones and the ones loaded from a snapshot) and the frame clock of the server.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::reconnect(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        auto &ext = *dev.ext;
+
+        ADDRINFOEXW ai {
+                .ai_family = ext.remote.si_family,
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP,
+        };
+
+        wsk::SOCKET *sock{};
+
+        if (auto err = create_socket(sock, ai)) {
+                close_socket(sock);
+                free(sock);
+                return err;
+        }
+
+        if (wdf::WaitLock lck(dev.sock_lock); dev.unplugged) {
+                lck.release();
+                close_socket(sock);
+                free(sock);
+                return STATUS_CANCELLED;
+        } else {
+                NT_ASSERT(!ext.next_sock);
+                ext.next_sock = sock;
+        }
+
+        auto retired = (retired_socket*)ExAllocatePoolZero(PagedPool, sizeof(retired_socket), pooltag);
+        usbip_usb_device udev{};
+        ULONGLONG rtt{};
+
+        auto st = retired ? connect(sock, ext.remote) : STATUS_INSUFFICIENT_RESOURCES;
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "connect %!USTR!:%!USTR! %!STATUS!", &ext.node_name, &ext.service_name, st);
+        } else if (st = import_remote_device(ext, sock, udev, rtt); st) {
+                //
+        } else if (auto d = make_properties(udev);
+                   d.devid != ext.dev.devid || d.speed != ext.dev.speed ||
+                   d.vendor != ext.dev.vendor || d.product != ext.dev.product) {
+                Trace(TRACE_LEVEL_ERROR, "Another device was imported: devid %#x, %!usb_device_speed!, %04x:%04x",
+                        d.devid, d.speed, d.vendor, d.product);
+                st = STATUS_NO_SUCH_DEVICE;
+        }
+
+        wdf::WaitLock lck(dev.sock_lock);
+        ext.next_sock = nullptr;
+
+        if (!st && dev.unplugged) { // detach has closed it
+                st = STATUS_CANCELLED;
+        }
+
+        if (st) {
+                lck.release();
+                close_socket(sock); // nobody else can access it now
+                free(sock);
+                if (retired) {
+                        ExFreePoolWithTag(retired, pooltag);
+                }
+                return st;
+        }
+
+        retired->sock = ext.sock; // closed by device::recover
+        retired->next = ext.retired;
+        ext.retired = retired;
+
+        ext.sock = sock; // device::recover clears device_ctx::recovering afterwards
+        ext.rtt = rtt;
+        ext.bcdDevice = udev.bcdDevice;
+
+        lck.release();
+
+        clear(dev.descriptors);
+        reset(dev.frames);
+
+        return STATUS_SUCCESS;
+}
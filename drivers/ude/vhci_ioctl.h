@@ -7,6 +7,11 @@
 #include <libdrv/codeseg.h>
 #include <libdrv/wdf_cpp.h>
 
+namespace usbip
+{
+        struct device_ctx;
+}
+
 namespace usbip::vhci
 {
 
@@ -14,4 +19,11 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create_queues(_In_ WDFDEVICE vhci);
 
+/*
+ * Connect to the same server and import the device again, see device::recover.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS reconnect(_Inout_ device_ctx &dev);
+
 } // namespace usbip::vhci
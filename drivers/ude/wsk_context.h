@@ -69,6 +69,8 @@ inline auto number_of_packets(_In_ const wsk_context &ctx)
 class wsk_context_ptr 
 {
 public:
+        wsk_context_ptr() = default;
+
         template<typename... Args>
         wsk_context_ptr(Args&&... args) : m_ctx(alloc_wsk_context(args...)) {}
 
@@ -9,12 +9,14 @@
 #include "context.h"
 #include "wsk_context.h"
 #include "device.h"
+#include "device_ioctl.h"
 #include "request_list.h"
 #include "network.h"
 #include "driver.h"
 #include "ioctl.h"
 
 #include <libdrv\usbd_helper.h>
+#include <libdrv\wait_timeout.h>
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbdsc.h>
 #include <libdrv\irp.h>
@@ -161,18 +163,20 @@ PAGED void fix_full_speed_endpoint_interval(_In_ USB_CONFIGURATION_DESCRIPTOR *c
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_ ULONG length, 
-	_In_ const usbip_iso_packet_descriptor *src)
+PAGED auto fill_isoc_data(
+	_Inout_ USBD_ISO_PACKET_DESCRIPTOR *packets, _In_ const isoch_part &part,
+	_In_opt_ UCHAR *buffer, _In_ ULONG length, _In_ const usbip_iso_packet_descriptor *src)
 {
 	PAGED_CODE();
 
-	NT_ASSERT(length <= r.TransferBufferLength);
+	NT_ASSERT(length <= part.length);
 	auto dir_out = !buffer;
 
-	for (auto i = LONG64(r.NumberOfPackets) - 1; i >= 0; --i) { // set dd.Status and dd.Length
+	for (auto i = LONG64(part.count) - 1; i >= 0; --i) { // set dd.Status and dd.Length
 
 		auto sd = src + i;
-		auto dd = r.IsoPacket + i;
+		auto dd = packets + i;
+		auto offset = dd->Offset - part.offset; // buffer points to the part
 
 		dd->Status = sd->status ? to_windows_status_isoch(sd->status) : USBD_STATUS_SUCCESS;
 
@@ -190,8 +194,8 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (sd->offset != dd->Offset) { // buffer is compacted, but offsets are intact
-			Trace(TRACE_LEVEL_ERROR, "src.offset(%u) != dst.Offset(%lu)", sd->offset, dd->Offset);
+		if (sd->offset != offset) { // buffer is compacted, but offsets are intact
+			Trace(TRACE_LEVEL_ERROR, "src.offset(%u) != dst.Offset(%lu)", sd->offset, offset);
 			return STATUS_INVALID_PARAMETER;
 		}
 
@@ -202,19 +206,19 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (dd->Offset + sd->actual_length > r.TransferBufferLength) {
-			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) + src.actual_length(%u) > r.TransferBufferLength(%lu)",
-				dd->Offset, sd->actual_length, r.TransferBufferLength);
+		if (offset + sd->actual_length > part.length) {
+			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) + src.actual_length(%u) > TransferBufferLength(%lu)",
+				offset, sd->actual_length, part.length);
 			return STATUS_INVALID_PARAMETER;
 		}
 		
-		if (dd->Offset < length) { // source buffer has no gaps
-			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) < length(%lu)", dd->Offset, length);
+		if (offset < length) { // source buffer has no gaps
+			Trace(TRACE_LEVEL_ERROR, "dst.Offset(%lu) < length(%lu)", offset, length);
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (dd->Offset > length) {
-			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
+		if (offset > length) {
+			RtlMoveMemory(buffer + offset, buffer + length, sd->actual_length);
 		}
 
 		dd->Length = sd->actual_length;
@@ -228,6 +232,33 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 	return STATUS_SUCCESS;
 }
 
+/*
+ * @return the part of the URB this RET_SUBMIT is for, see request_ctx::parts
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_part(_In_ const wsk_context &ctx, _In_ const _URB_ISOCH_TRANSFER &r)
+{
+	auto &req = *get_request_ctx(ctx.request);
+
+	auto index = (ctx.hdr.base.seqnum - req.seqnum)/2;
+	NT_ASSERT(index < req.parts);
+
+	return get_isoch_part(r, index);
+}
+
+/*
+ * @return frames since start_frame until the response has arrived,
+ *         the interval of the endpoint is supposed to be one (micro)frame
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto frames_elapsed(_In_ const device_ctx &dev, _In_ int number_of_packets)
+{
+	auto frames = dev.speed() >= USB_SPEED_HIGH ? (number_of_packets + 7)/8 : number_of_packets;
+	return ULONG(frames + dev.ext->rtt/2/wdm::msec);
+}
+
 /*
  * Layout: transfer buffer(IN only), usbip_iso_packet_descriptor[].
  */
@@ -239,21 +270,39 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_sub
 	auto cnt = ret.number_of_packets;
 
 	auto &r = urb.UrbIsochronousTransfer;
-	r.ErrorCount = ret.error_count;
+	auto &req = *get_request_ctx(ctx.request);
+	auto part = get_part(ctx, r);
 
-	if (cnt && cnt == ret.error_count) {
+	if (auto st = ret.status ? to_windows_status(ret.status) : USBD_STATUS_SUCCESS;
+	    req.pending == req.parts - 1) { // the first received part
+		r.Hdr.Status = st;
+		r.ErrorCount = ret.error_count;
+	} else {
+		if (USBD_SUCCESS(r.Hdr.Status)) {
+			r.Hdr.Status = st;
+		}
+		r.ErrorCount += ret.error_count;
+	}
+
+	if (!req.pending && r.NumberOfPackets && r.ErrorCount == r.NumberOfPackets) { // the last received part
 		r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
 	}
 
-	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
-		r.StartFrame = ret.start_frame;
+	auto &clock = ctx.dev->frames;
+
+	if (cnt > 0 && cnt != ret.error_count) { // start_frame is valid
+		update(clock, ret.start_frame, frames_elapsed(*ctx.dev, cnt));
 	}
 
-	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
-		NT_ASSERT(r.NumberOfPackets == number_of_packets(ctx));
+	if ((r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) && !part.first) {
+		r.StartFrame = is_synced(clock) ? from_server_frame(clock, ret.start_frame) : ret.start_frame;
+	}
+
+	if (cnt >= 0 && ULONG(cnt) == part.count) {
+		NT_ASSERT(part.count == number_of_packets(ctx));
 		byteswap(ctx.isoc, cnt);
 	} else {
-		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) != NumberOfPackets(%lu)", cnt, r.NumberOfPackets);
+		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) != NumberOfPackets(%lu)", cnt, part.count);
 		return STATUS_INVALID_PARAMETER;
 	}
 
@@ -265,9 +314,10 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_sub
 			Trace(TRACE_LEVEL_ERROR, "UdecxUrbRetrieveBuffer %!STATUS!", err);
 			return err;
 		}
+		buffer += part.offset;
 	}
 
-	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc);
+	return fill_isoc_data(r.IsoPacket + part.first, part, buffer, ret.actual_length, ctx.isoc);
 }
 
 _IRQL_requires_same_
@@ -279,9 +329,25 @@ PAGED void complete_and_set_null(_Inout_ WDFREQUEST &request, _In_ NTSTATUS stat
 	request = WDF_NO_HANDLE;
 }
 
+/*
+ * RET_SUBMIT of a part of isoch URB that is not the last one was processed.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void post_control_transfer(_In_ const device_ctx &dev, _In_ const _URB_CONTROL_TRANSFER &r, _In_ void *TransferBuffer)
+PAGED void release_and_set_null(_Inout_ device_ctx &dev, _Inout_ WDFREQUEST &request, _In_ NTSTATUS status)
+{
+	PAGED_CODE();
+
+	if (auto err = device::release_request(dev, request, status)) {
+		device::send_cmd_unlink_and_complete(get_handle(&dev), request, err);
+	}
+
+	request = WDF_NO_HANDLE;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void post_control_transfer(_Inout_ device_ctx &dev, _In_ const _URB_CONTROL_TRANSFER &r, _In_ void *TransferBuffer)
 {
 	PAGED_CODE();
 
@@ -300,30 +366,16 @@ PAGED void post_control_transfer(_In_ const device_ctx &dev, _In_ const _URB_CON
 	TraceUrb("bLength %d, %!usb_descriptor_type!%!BIN!", 
 		  dsc->bLength, dsc->bDescriptorType, WppBinary(dsc, dsc_len));
 
-	switch (dsc->bDescriptorType) {
-	case USB_CONFIGURATION_DESCRIPTOR_TYPE:
-		if (auto &d = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR&>(*dsc);
-		    dsc_len > sizeof(d) && d.bLength == sizeof(d) && d.wTotalLength == dsc_len) {
-			NT_ASSERT(libdrv::is_valid(d));
-			log(d);
-			if (dev.speed() == USB_SPEED_FULL) {
-				fix_full_speed_endpoint_interval(&d);
-			}
-		}
-		break;
-	case USB_DEVICE_DESCRIPTOR_TYPE:
-		if (auto &d = reinterpret_cast<USB_DEVICE_DESCRIPTOR&>(*dsc); 
-		    dsc_len == sizeof(d) && d.bLength == dsc_len) {
-			NT_ASSERT(libdrv::is_valid(d));
-			log(d);
-		}
-		break;
+	post_get_descriptor(dev, dsc, dsc_len);
+
+	if (auto &pkt = get_setup_packet(r); USBD_SUCCESS(r.Hdr.Status) && is_cacheable(pkt)) {
+		insert(dev.descriptors, pkt, dsc, dsc_len); // after fix_full_speed_endpoint_interval
 	}
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void post_process_transfer_buffer(_In_ const device_ctx &dev, _In_ const URB &urb, _In_ void *TransferBuffer)
+PAGED void post_process_transfer_buffer(_Inout_ device_ctx &dev, _In_ const URB &urb, _In_ void *TransferBuffer)
 {
 	PAGED_CODE();
 
@@ -340,12 +392,13 @@ _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit &ret, _Inout_ URB &urb)
 {
 	PAGED_CODE();
-	urb.UrbHeader.Status = ret.status ? to_windows_status(ret.status) : USBD_STATUS_SUCCESS;
 
 	if (is_isoch(urb)) {
-		return isoch_transfer(ctx, ret, urb);
+		return isoch_transfer(ctx, ret, urb); // sets the status from all parts
 	}
 
+	urb.UrbHeader.Status = ret.status ? to_windows_status(ret.status) : USBD_STATUS_SUCCESS;
+
 	UCHAR *TransferBuffer{};
 	ULONG TransferBufferLength{};
 
@@ -439,8 +492,13 @@ PAGED auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ UR
 	auto dir_out = is_transfer_dir_out(ctx.hdr);
 	bool fail{};
 
+	isoch_part part{ .length = TransferBufferLength };
+	if (is_isoch(urb)) {
+		part = get_part(ctx, urb.UrbIsochronousTransfer);
+	}
+
 	if (ctx.is_isoc) { // always has payload
-		fail = check(TransferBufferLength, ret.actual_length); // do not change buffer length
+		fail = check(part.length, ret.actual_length); // do not change buffer length
 	} else { // actual_length MUST be assigned, must not have payload for OUT
 		fail = assign(TransferBufferLength, ret.actual_length) || dir_out;
 		UdecxUrbSetBytesCompleted(ctx.request, TransferBufferLength);
@@ -455,7 +513,7 @@ PAGED auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ UR
 	if (dir_out) {
 		NT_ASSERT(ctx.is_isoc);
 		NT_ASSERT(!ctx.mdl_buf);
-	} else if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, ret.actual_length, IoWriteAccess, urb)) {
+	} else if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, ret.actual_length, IoWriteAccess, urb, part.offset)) {
 		Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
 		return err;
 	}
@@ -638,7 +696,11 @@ PAGED void recv_loop(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx)
 
 		if (auto &req = ctx.request) {
 			auto st = status ? status : ret_submit(ctx);
-			complete_and_set_null(req, st);
+			if (get_request_ctx(req)->busy) {
+				release_and_set_null(dev, req, st);
+			} else {
+				complete_and_set_null(req, st);
+			}
 		}
 	}
 }
@@ -646,6 +708,35 @@ PAGED void recv_loop(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx)
 } // namespace
 
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::post_get_descriptor(_Inout_ device_ctx &dev, _Inout_ USB_COMMON_DESCRIPTOR *dsc, _In_ USHORT dsc_len)
+{
+	PAGED_CODE();
+
+	switch (dsc->bDescriptorType) {
+	case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+		if (auto &d = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR&>(*dsc);
+		    dsc_len > sizeof(d) && d.bLength == sizeof(d) && d.wTotalLength == dsc_len) {
+			NT_ASSERT(libdrv::is_valid(d));
+			log(d);
+			mark_stage(*dev.ext, vhci::attach_stage::configuration_descriptor);
+			if (dev.speed() == USB_SPEED_FULL) {
+				fix_full_speed_endpoint_interval(&d);
+			}
+		}
+		break;
+	case USB_DEVICE_DESCRIPTOR_TYPE:
+		if (auto &d = reinterpret_cast<USB_DEVICE_DESCRIPTOR&>(*dsc);
+		    dsc_len == sizeof(d) && d.bLength == dsc_len) {
+			NT_ASSERT(libdrv::is_valid(d));
+			log(d);
+			mark_stage(*dev.ext, vhci::attach_stage::device_descriptor);
+		}
+		break;
+	}
+}
+
 _IRQL_requires_same_
 _Function_class_(KSTART_ROUTINE)
 PAGED void usbip::recv_thread_function(_In_ void *context)
@@ -659,8 +750,10 @@ PAGED void usbip::recv_thread_function(_In_ void *context)
 	auto dev = get_device_ctx(device);
 
 	if (auto ctx = alloc_wsk_context(dev, WDF_NO_HANDLE)) {
-		recv_loop(*dev, *ctx);
-		NT_ASSERT(!ctx->request);
+		do {
+			recv_loop(*dev, *ctx);
+			NT_ASSERT(!ctx->request);
+		} while (device::recover(device)); // connection is reestablished
 		free(ctx, true);
 	}
 
@@ -7,9 +7,13 @@
 #include <libdrv/codeseg.h>
 #include <libdrv/wdf_cpp.h>
 
+struct _USB_COMMON_DESCRIPTOR;
+
 namespace usbip
 {
 
+struct device_ctx;
+
 _IRQL_requires_same_
 _Function_class_(KSTART_ROUTINE)
 PAGED void recv_thread_function(_In_ void *context);
@@ -28,4 +32,12 @@ inline void complete(_In_ WDFREQUEST request)
         complete(request, WdfRequestGetStatus(request));
 }
 
+/*
+ * Must be called for a response to GET_DESCRIPTOR before it is put into the descriptor cache.
+ * Patches the descriptor if needed and marks attach stages.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void post_get_descriptor(_Inout_ device_ctx &dev, _Inout_ _USB_COMMON_DESCRIPTOR *dsc, _In_ USHORT dsc_len);
+
 } // namespace usbip
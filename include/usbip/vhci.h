@@ -64,6 +64,16 @@ struct device_state : base, imported_device
         state state;
 };
 
+/*
+ * Stages of attach, from IOCTL_PLUGIN_HARDWARE to the configured device.
+ */
+enum class attach_stage
+{
+        started, resolved, connected, imported, created, plugged, // plugin_hardware
+        first_control, device_descriptor, configuration_descriptor, set_configuration, // enumeration
+        count
+};
+
 } // namespace usbip::vhci
 
 
@@ -76,6 +86,9 @@ enum class function { // 12 bit
         get_imported_devices,
         set_persistent,
         get_persistent,
+        plugin_hardware_batch,
+        get_attach_timeline,
+        get_imported_devices_delta,
 };
 
 constexpr auto make(function id)
@@ -89,10 +102,40 @@ enum {
         GET_IMPORTED_DEVICES = make(function::get_imported_devices),
         SET_PERSISTENT = make(function::set_persistent),
         GET_PERSISTENT = make(function::get_persistent),
+        PLUGIN_HARDWARE_BATCH = make(function::plugin_hardware_batch),
+        GET_ATTACH_TIMELINE = make(function::get_attach_timeline),
+        GET_IMPORTED_DEVICES_DELTA = make(function::get_imported_devices_delta),
 };
 
 struct plugin_hardware : base, imported_device_location {};
 
+/*
+ * Devices are imported concurrently, the same buffer is used for output.
+ */
+struct plugin_hardware_batch : base
+{
+        struct item : imported_device_location
+        {
+                LONG status; // OUT, NTSTATUS
+        };
+
+        ULONG count; // IN, number of items
+        item items[ANYSIZE_ARRAY];
+};
+
+constexpr auto plugin_hardware_batch_size(_In_ ULONG n)
+{
+        return offsetof(plugin_hardware_batch, items) + n*sizeof(*plugin_hardware_batch::items);
+}
+
+struct get_attach_timeline : base
+{
+        int port; // IN
+
+        ULONG reached; // OUT, bitmask of attach_stage
+        UINT64 usec[static_cast<int>(attach_stage::count)]; // OUT, since attach_stage::started
+};
+
 struct plugout_hardware : base
 {
         int port; // all ports if <= 0
@@ -108,4 +151,28 @@ constexpr auto get_imported_devices_size(_In_ ULONG n)
         return offsetof(get_imported_devices, devices) + n*sizeof(*get_imported_devices::devices);
 }
 
+/*
+ * The driver increments the generation on every plug, unplug and state change of a port.
+ * Only the ports that were changed after the given generation are returned,
+ * count is zero and the generation is the same if nothing was changed.
+ */
+struct get_imported_devices_delta : base
+{
+        UINT64 generation; // IN, returned by the previous call or zero; OUT, the current one
+        bool full; // OUT, items are all imported devices, the caller must discard its copy
+        ULONG count; // OUT, number of items
+
+        struct item : imported_device
+        {
+                bool unplugged; // the port is free, only imported_device::port is set
+        };
+
+        item items[ANYSIZE_ARRAY];
+};
+
+constexpr auto get_imported_devices_delta_size(_In_ ULONG n)
+{
+        return offsetof(get_imported_devices_delta, items) + n*sizeof(*get_imported_devices_delta::items);
+}
+
 } // namespace usbip::vhci::ioctl
@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "vhci.h"
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stop_token>
+#include <utility>
+
+/*
+ * Asynchronous API on top of overlapped I/O and I/O completion port.
+ * Handles must be opened by vhci::open(true) and associated with IoContext.
+ * Coroutines are resumed on the threads that call IoContext::run_one().
+ * A stop request cancels pending I/O of the operations that received its token.
+ */
+
+namespace usbip
+{
+
+template<typename T = void>
+class task;
+
+/**
+ * I/O completion port, one thread can drive any number of concurrent operations.
+ */
+class IoContext
+{
+public:
+        explicit IoContext(_In_ DWORD concurrency = 1) :
+                m_port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, concurrency)) {}
+
+        explicit operator bool() const noexcept { return bool(m_port); }
+        auto operator!() const noexcept { return !m_port; }
+
+        /**
+         * Successful synchronous calls do not queue completions, a coroutine continues without suspension.
+         * @param dev handle opened for overlapped I/O
+         * @return call GetLastError() if false is returned
+         */
+        bool associate(_In_ HANDLE dev) noexcept
+        {
+                return m_port &&
+                       CreateIoCompletionPort(dev, m_port.get(), 0, 0) &&
+                       SetFileCompletionNotificationModes(dev, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS);
+        }
+
+        /**
+         * Dequeues one completion and resumes the coroutine that awaits it.
+         * @return false if stop() was called, the timeout has expired or an error occurred, call GetLastError()
+         */
+        bool run_one(_In_ DWORD timeout = INFINITE) noexcept;
+
+        /**
+         * Starts the task and resumes coroutines until it is done, then call task::get().
+         * Other threads must not call run_one() meanwhile, the task could be finished by them.
+         * @return see run_one()
+         */
+        template<typename T>
+        bool run(_Inout_ task<T> &t);
+
+        /**
+         * Makes one call of run_one() return false.
+         */
+        bool stop() noexcept { return PostQueuedCompletionStatus(m_port.get(), 0, 0, nullptr); }
+
+private:
+        NullableHandle m_port;
+};
+
+/**
+ * Awaitable overlapped call of DeviceIoControl or ReadFile.
+ * The call is cancelled by CancelIoEx if stop is requested, it completes with ERROR_OPERATION_ABORTED.
+ */
+class IoOperation : OVERLAPPED
+{
+public:
+        struct result
+        {
+                DWORD error; // Win32 error code
+                DWORD length; // number of bytes transferred
+        };
+
+        IoOperation(_In_ HANDLE dev, _Inout_ vhci::ioctl_request &r, _In_ std::stop_token stop = {}) :
+                OVERLAPPED{}, m_dev(dev), m_stop(std::move(stop)), m_ioctl(&r) {}
+
+        IoOperation(_In_ HANDLE dev, _Out_writes_bytes_(len) void *buf, _In_ DWORD len, _In_ std::stop_token stop = {}) :
+                OVERLAPPED{}, m_dev(dev), m_stop(std::move(stop)), m_buf(buf), m_len(len) {}
+
+        IoOperation(const IoOperation&) = delete;
+        IoOperation& operator =(const IoOperation&) = delete;
+
+        bool await_ready() noexcept
+        {
+                if (m_stop.stop_requested()) {
+                        m_result.error = ERROR_OPERATION_ABORTED;
+                        return true;
+                }
+
+                return false;
+        }
+
+        bool await_suspend(_In_ std::coroutine_handle<> h) noexcept
+        {
+                m_continuation = h;
+                m_cancel.emplace(m_stop, canceller{ m_dev, this }); // before the call to not miss a request
+
+                if (start()) { // FILE_SKIP_COMPLETION_PORT_ON_SUCCESS, nothing is queued
+                        return false;
+                } else if (auto err = GetLastError(); err != ERROR_IO_PENDING) {
+                        m_result.error = err;
+                        return false;
+                }
+
+                if (m_stop.stop_requested()) { // could be requested before the call
+                        CancelIoEx(m_dev, this);
+                }
+
+                return !m_handoff.exchange(true); // complete() can be called already
+        }
+
+        auto await_resume() noexcept
+        {
+                m_cancel.reset();
+                return m_result;
+        }
+
+private:
+        friend class IoContext;
+
+        struct canceller
+        {
+                HANDLE dev;
+                OVERLAPPED *ov;
+                void operator()() const noexcept { CancelIoEx(dev, ov); }
+        };
+
+        HANDLE m_dev;
+        std::stop_token m_stop;
+        std::optional<std::stop_callback<canceller>> m_cancel;
+
+        vhci::ioctl_request *m_ioctl{};
+        void *m_buf{};
+        DWORD m_len{};
+
+        std::coroutine_handle<> m_continuation;
+        std::atomic<bool> m_handoff{}; // the second of await_suspend and complete resumes the coroutine
+        result m_result{};
+
+        bool start() noexcept
+        {
+                if (auto r = m_ioctl) {
+                        auto buf = r->buf.data();
+                        return DeviceIoControl(m_dev, r->code, buf, r->inlen, r->outlen ? buf : nullptr, r->outlen,
+                                               &m_result.length, this);
+                } else {
+                        return ReadFile(m_dev, m_buf, m_len, &m_result.length, this);
+                }
+        }
+
+        void complete(_In_ DWORD error, _In_ DWORD length) noexcept
+        {
+                m_result = { error, length };
+                if (m_handoff.exchange(true)) {
+                        m_continuation.resume();
+                }
+        }
+};
+
+
+namespace detail
+{
+
+struct promise_base
+{
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        struct final_awaiter
+        {
+                bool await_ready() const noexcept { return false; }
+
+                template<typename P>
+                std::coroutine_handle<> await_suspend(_In_ std::coroutine_handle<P> h) noexcept
+                {
+                        auto c = h.promise().continuation;
+                        return c ? c : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+        };
+
+        auto initial_suspend() const noexcept { return std::suspend_always{}; }
+        auto final_suspend() const noexcept { return final_awaiter{}; }
+
+        void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+        void rethrow() const
+        {
+                if (exception) {
+                        std::rethrow_exception(exception);
+                }
+        }
+};
+
+template<typename T>
+struct promise : promise_base
+{
+        std::optional<T> value;
+
+        void return_value(_In_ T v) { value.emplace(std::move(v)); }
+
+        T result()
+        {
+                rethrow();
+                return std::move(*value);
+        }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+        void return_void() const noexcept {}
+        void result() const { rethrow(); }
+};
+
+} // namespace detail
+
+
+/**
+ * Lazily started coroutine, it runs when awaited or started by IoContext::run().
+ * Must not be destroyed while it is suspended on I/O.
+ */
+template<typename T>
+class [[nodiscard]] task
+{
+public:
+        struct promise_type;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        struct promise_type : detail::promise<T>
+        {
+                auto get_return_object() noexcept { return task(handle_type::from_promise(*this)); }
+        };
+
+        task(task &&t) noexcept : m_coro(std::exchange(t.m_coro, {})) {}
+
+        task& operator =(task &&t) noexcept
+        {
+                if (this != &t) {
+                        reset();
+                        m_coro = std::exchange(t.m_coro, {});
+                }
+                return *this;
+        }
+
+        ~task() { reset(); }
+
+        bool done() const noexcept { return !m_coro || m_coro.done(); }
+
+        void start()
+        {
+                assert(m_coro && !m_coro.done());
+                m_coro.resume();
+        }
+
+        /**
+         * @return result of the finished task, its exception is rethrown
+         */
+        T get()
+        {
+                assert(m_coro.done());
+                return m_coro.promise().result();
+        }
+
+        auto operator co_await() && noexcept { return awaiter<true>{ m_coro }; }
+
+        /**
+         * Awaits completion of the task without obtaining its result.
+         */
+        auto when_ready() noexcept { return awaiter<false>{ m_coro }; }
+
+private:
+        handle_type m_coro;
+
+        explicit task(_In_ handle_type h) noexcept : m_coro(h) {}
+
+        void reset() noexcept
+        {
+                if (auto h = std::exchange(m_coro, {})) {
+                        h.destroy();
+                }
+        }
+
+        template<bool with_result>
+        struct awaiter
+        {
+                handle_type coro;
+
+                bool await_ready() const noexcept { return coro.done(); }
+
+                auto await_suspend(_In_ std::coroutine_handle<> h) noexcept
+                {
+                        coro.promise().continuation = h;
+                        return coro; // symmetric transfer
+                }
+
+                decltype(auto) await_resume()
+                {
+                        if constexpr (with_result) {
+                                return coro.promise().result();
+                        }
+                }
+        };
+};
+
+
+namespace detail
+{
+
+struct latch
+{
+        std::atomic<size_t> count;
+        std::coroutine_handle<> waiter{};
+
+        void count_down() noexcept
+        {
+                if (count.fetch_sub(1) == 1) {
+                        waiter.resume();
+                }
+        }
+};
+
+/*
+ * Eagerly started coroutine, its frame is destroyed when it finishes.
+ */
+struct detached_task
+{
+        struct promise_type
+        {
+                auto get_return_object() const noexcept { return detached_task{}; }
+                auto initial_suspend() const noexcept { return std::suspend_never{}; }
+                auto final_suspend() const noexcept { return std::suspend_never{}; }
+                void return_void() const noexcept {}
+                void unhandled_exception() const noexcept { std::terminate(); }
+        };
+};
+
+template<typename T>
+detached_task count_down_when_ready(_Inout_ task<T> &t, _Inout_ latch &l)
+{
+        co_await t.when_ready();
+        l.count_down();
+}
+
+template<typename T>
+class when_all_awaiter
+{
+public:
+        explicit when_all_awaiter(_Inout_ std::vector<task<T>> &tasks) :
+                m_tasks(tasks), m_latch{ tasks.size() + 1 } {}
+
+        bool await_ready() const noexcept { return m_tasks.empty(); }
+
+        bool await_suspend(_In_ std::coroutine_handle<> h) noexcept
+        {
+                m_latch.waiter = h;
+
+                for (auto &t: m_tasks) {
+                        count_down_when_ready(t, m_latch);
+                }
+
+                return m_latch.count.fetch_sub(1) > 1; // all tasks could complete synchronously
+        }
+
+        void await_resume() const noexcept {}
+
+private:
+        std::vector<task<T>> &m_tasks;
+        latch m_latch;
+};
+
+} // namespace detail
+
+
+/**
+ * Runs the tasks concurrently.
+ * @return results in the same order as the tasks, an exception of a task is rethrown
+ */
+template<typename T>
+task<std::vector<T>> when_all(std::vector<task<T>> tasks)
+{
+        co_await detail::when_all_awaiter<T>(tasks);
+
+        std::vector<T> result;
+        result.reserve(tasks.size());
+
+        for (auto &t: tasks) {
+                result.push_back(t.get());
+        }
+
+        co_return result;
+}
+
+
+inline bool IoContext::run_one(_In_ DWORD timeout) noexcept
+{
+        DWORD length{};
+        ULONG_PTR key{};
+        OVERLAPPED *ov{};
+
+        auto ok = GetQueuedCompletionStatus(m_port.get(), &length, &key, &ov, timeout);
+
+        if (!ov) { // see stop()
+                if (ok) {
+                        SetLastError(ERROR_CANCELLED);
+                }
+                return false;
+        }
+
+        auto &op = *static_cast<IoOperation*>(ov);
+        op.complete(ok ? DWORD(ERROR_SUCCESS) : GetLastError(), length);
+
+        return true;
+}
+
+template<typename T>
+inline bool IoContext::run(_Inout_ task<T> &t)
+{
+        for (t.start(); !t.done(); ) {
+                if (!run_one()) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+} // namespace usbip
+
+
+namespace usbip::vhci::async
+{
+
+/**
+ * @see vhci::attach
+ */
+inline task<attach_result> attach(_In_ HANDLE dev, _In_ device_location location, _In_ std::stop_token stop = {})
+{
+        ioctl_request r;
+        if (!make_attach_request(r, location)) {
+                co_return attach_result{ .port = 0, .error = GetLastError() };
+        }
+
+        auto [err, length] = co_await IoOperation(dev, r, stop);
+
+        auto port = get_attach_result(r, err, length);
+        co_return attach_result{ .port = port, .error = port ? DWORD(ERROR_SUCCESS) : GetLastError() };
+}
+
+/**
+ * @see vhci::detach
+ * @return Win32 error code
+ */
+inline task<DWORD> detach(_In_ HANDLE dev, _In_ int port, _In_ std::stop_token stop = {})
+{
+        ioctl_request r;
+        make_detach_request(r, port);
+
+        auto [err, length] = co_await IoOperation(dev, r, stop);
+        co_return err;
+}
+
+/**
+ * @see vhci::get_imported_devices
+ * @return Win32 error code
+ */
+inline task<DWORD> get_imported_devices(
+        _In_ HANDLE dev, _Out_ std::vector<imported_device> &result, _In_ std::stop_token stop = {})
+{
+        ioctl_request r;
+
+        for (DWORD cnt = 4; true; cnt <<= 1) {
+                make_get_imported_devices_request(r, cnt);
+
+                if (auto [err, length] = co_await IoOperation(dev, r, stop); !err) {
+                        bool ok;
+                        result = get_imported_devices_result(r, length, ok);
+                        co_return ok ? DWORD(ERROR_SUCCESS) : GetLastError();
+                } else if (err != ERROR_INSUFFICIENT_BUFFER) {
+                        co_return err;
+                }
+        }
+}
+
+/**
+ * @see vhci::read_device_states
+ * @return Win32 error code
+ */
+inline task<DWORD> read_device_states(
+        _In_ HANDLE dev, _Out_ std::vector<device_state> &result, _In_ std::stop_token stop = {},
+        _In_ DWORD max_count = 64)
+{
+        std::vector<char> buf(max_count*get_device_state_size());
+
+        if (auto [err, length] = co_await IoOperation(dev, buf.data(), DWORD(buf.size()), stop); err) {
+                co_return err;
+        } else if (!length) {
+                co_return ERROR_HANDLE_EOF;
+        } else if (!get_device_states(result, buf.data(), length)) {
+                co_return GetLastError();
+        }
+
+        co_return ERROR_SUCCESS;
+}
+
+} // namespace usbip::vhci::async
@@ -17,14 +17,36 @@ namespace libusbip
  */
 using output_func_type = std::function<void(std::string)>;
 
+/*
+ * Messages of a level greater than set are not formatted at all.
+ */
+enum class output_level { error, info, debug };
+
 /*
  * Set a function if you want to get debug messages from the library.
+ * Must not be called concurrently with other functions of the library.
+ * @param f empty function disables the output
+ * @param level maximum level of the messages to pass
  */
-USBIP_API void set_debug_output(const output_func_type &f);
+USBIP_API void set_debug_output(const output_func_type &f, output_level level = output_level::debug);
 
 /*
  * Get installed debug function.
  */
 USBIP_API const output_func_type& get_debug_output() noexcept;
 
+/*
+ * Messages are put into a lock-free ring instead of calling the debug function from the threads of the library.
+ * A message is dropped if the ring is full, long messages are truncated.
+ * Must not be called concurrently with other functions of the library.
+ * @param capacity number of messages, rounded up to a power of two, each takes 1 KB; zero removes the ring
+ */
+USBIP_API void set_debug_ring(size_t capacity);
+
+/*
+ * Passes the messages from the ring to the debug function, can be called from one thread at a time.
+ * @return number of messages passed
+ */
+USBIP_API size_t drain_debug_ring();
+
 } // namespace libusbip
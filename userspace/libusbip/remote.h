@@ -9,6 +9,10 @@
 
 #include <usbspec.h>
 #include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <stop_token>
 
 namespace usbip
 {
@@ -109,4 +113,43 @@ USBIP_API bool enum_exportable_devices(
         _In_ const usb_interface_f &on_intf,
         _In_opt_ const usb_device_cnt_f &on_dev_cnt = nullptr);
 
+struct server_address
+{
+        std::string hostname;
+        std::string service; // TCP/IP port number or symbolic name
+};
+
+struct exported_device
+{
+        usb_device device;
+        std::vector<usb_interface> interfaces;
+};
+
+/**
+ * @param idx zero-based index of the server in the list
+ * @param error Win32 error code, ERROR_TIMEOUT if the server did not answer in time
+ * @param devices exportable devices of the server, empty if error is not zero
+ */
+using server_devices_f = std::function<void(
+        _In_ int idx, _In_ DWORD error, _In_ const std::vector<exported_device> &devices)>;
+
+/**
+ * Servers are connected to and enumerated concurrently, at most max_parallel at once.
+ * The call blocks until all servers are answered or have failed, run it in a separate thread
+ * to not block GUI. The callback is invoked from worker threads as soon as a server answers,
+ * the calls are serialized.
+ *
+ * @param servers servers to enumerate
+ * @param on_server will be called once for every server
+ * @param timeout for connecting to and enumeration of one server
+ * @param max_parallel maximum number of concurrent connections
+ * @param stop servers that are not enumerated yet will be reported with ERROR_CANCELLED
+ */
+USBIP_API void enum_exportable_devices(
+        _In_ const std::vector<server_address> &servers,
+        _In_ const server_devices_f &on_server,
+        _In_ std::chrono::milliseconds timeout = std::chrono::seconds(10),
+        _In_ int max_parallel = 8,
+        _In_ std::stop_token stop = {});
+
 } // namespace usbip
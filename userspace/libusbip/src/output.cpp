@@ -7,12 +7,122 @@
 #include "..\output.h"
 #include "output.h"
 
-void libusbip::set_debug_output(const output_func_type &f)
+#include <bit>
+#include <memory>
+
+namespace
+{
+
+using namespace libusbip;
+
+/*
+ * Bounded multi-producer queue, a slot is claimed by CAS on the sequence number.
+ * @see Dmitry Vyukov's bounded MPMC queue
+ */
+class Ring
+{
+public:
+        explicit Ring(_In_ size_t capacity) :
+                m_slots(std::make_unique<slot[]>(capacity)),
+                m_mask(capacity - 1)
+        {
+                for (size_t i = 0; i < capacity; ++i) {
+                        m_slots[i].seq.store(i, std::memory_order_relaxed);
+                }
+        }
+
+        bool push(_In_ std::string_view msg) noexcept
+        {
+                for (auto pos = m_head.load(std::memory_order_relaxed); true; ) {
+
+                        auto &s = m_slots[pos & m_mask];
+                        auto seq = s.seq.load(std::memory_order_acquire);
+
+                        if (auto diff = static_cast<ptrdiff_t>(seq - pos); diff < 0) {
+                                return false; // full
+                        } else if (diff) {
+                                pos = m_head.load(std::memory_order_relaxed); // another producer took it
+                        } else if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                                s.len = msg.copy(s.text, sizeof(s.text));
+                                s.seq.store(pos + 1, std::memory_order_release);
+                                return true;
+                        }
+                }
+        }
+
+        template<typename F>
+        bool pop(_In_ const F &f)
+        {
+                auto pos = m_tail.load(std::memory_order_relaxed);
+
+                auto &s = m_slots[pos & m_mask];
+                if (s.seq.load(std::memory_order_acquire) != pos + 1) {
+                        return false; // empty or being written
+                }
+
+                f(std::string_view(s.text, s.len));
+
+                m_tail.store(pos + 1, std::memory_order_relaxed);
+                s.seq.store(pos + m_mask + 1, std::memory_order_release);
+                return true;
+        }
+
+private:
+        struct slot
+        {
+                std::atomic<size_t> seq;
+                size_t len;
+                char text[max_message_size];
+        };
+
+        std::unique_ptr<slot[]> m_slots;
+        size_t m_mask;
+
+        std::atomic<size_t> m_head{};
+        std::atomic<size_t> m_tail{}; // single consumer
+};
+
+std::unique_ptr<Ring> ring;
+
+} // namespace
+
+
+void libusbip::write_output(_In_ std::string_view msg)
+{
+        if (ring) {
+                ring->push(msg);
+        } else if (auto &f = output_function) {
+                f(std::string(msg));
+        }
+}
+
+void libusbip::set_debug_output(const output_func_type &f, _In_ output_level level)
 {
         output_function = f;
+        output_max_level = f ? static_cast<int>(level) : -1;
 }
 
 auto libusbip::get_debug_output() noexcept -> const output_func_type&
 {
         return output_function;
 }
+
+void libusbip::set_debug_ring(_In_ size_t capacity)
+{
+        if (capacity) {
+                ring = std::make_unique<Ring>(std::bit_ceil(capacity));
+        } else {
+                ring.reset();
+        }
+}
+
+size_t libusbip::drain_debug_ring()
+{
+        size_t cnt = 0;
+
+        if (auto &f = output_function; ring && f) {
+                for ( ; ring->pop([&f] (auto msg) { f(std::string(msg)); }); ++cnt);
+        }
+
+        return cnt;
+}
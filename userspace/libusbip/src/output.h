@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ * Copyright (C) 2023 - 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
  */
 
 #pragma once
@@ -7,6 +7,8 @@
 #include "..\output.h"
 #include "strconv.h"
 
+#include <algorithm>
+#include <atomic>
 #include <format>
 
 namespace libusbip
@@ -14,22 +16,71 @@ namespace libusbip
 
 inline output_func_type output_function;
 
+/*
+ * Maximum output_level of the messages to pass, negative if the output is disabled.
+ */
+inline std::atomic<int> output_max_level{-1};
+
+enum { max_message_size = 1024 }; // longer messages are truncated
+
+/*
+ * Disabled output costs one relaxed load and one branch.
+ * Use it to skip the evaluation of arguments that are expensive to obtain.
+ */
+inline auto output_enabled(_In_ output_level level) noexcept
+{
+        return static_cast<int>(level) <= output_max_level.load(std::memory_order_relaxed);
+}
+
+/*
+ * Passes a formatted message to the ring or to the output function.
+ */
+void write_output(_In_ std::string_view msg);
+
+template<typename CharT>
+inline auto truncated(_Inout_ CharT *buf, _In_ size_t len, _In_ size_t cap)
+{
+        if (len > cap) {
+                len = cap;
+                std::fill_n(buf + cap - 3, 3, CharT('.'));
+        }
+        return len;
+}
+
 template<typename... Args>
-inline void output(std::string_view fmt, Args&&... args)
+inline void output(_In_ output_level level, _In_ std::format_string<Args...> fmt, _In_ Args&&... args)
 {
-        if (output_function) {
-                auto s = vformat(fmt, std::make_format_args(args...));
-                output_function(std::move(s));
+        if (output_enabled(level)) [[unlikely]] {
+                char buf[max_message_size];
+                auto ret = std::format_to_n(buf, sizeof(buf), fmt, std::forward<Args>(args)...);
+                write_output(std::string_view(buf, truncated(buf, size_t(ret.size), sizeof(buf))));
         }
 }
 
 template<typename... Args>
-inline void output(std::wstring_view fmt, Args&&... args)
+inline void output(_In_ output_level level, _In_ std::wformat_string<Args...> fmt, _In_ Args&&... args)
 {
-        if (output_function) {
-                auto ws = vformat(fmt, std::make_wformat_args(args...));
-                output_function(usbip::wchar_to_utf8(ws));
+        if (output_enabled(level)) [[unlikely]] {
+                wchar_t buf[max_message_size];
+                auto ret = std::format_to_n(buf, std::size(buf), fmt, std::forward<Args>(args)...);
+                auto s = usbip::wchar_to_utf8(std::wstring_view(buf, truncated(buf, size_t(ret.size), std::size(buf))));
+                write_output(s);
         }
 }
 
+/*
+ * Errors are reported without a level.
+ */
+template<typename... Args>
+inline void output(_In_ std::format_string<Args...> fmt, _In_ Args&&... args)
+{
+        output(output_level::error, fmt, std::forward<Args>(args)...);
+}
+
+template<typename... Args>
+inline void output(_In_ std::wformat_string<Args...> fmt, _In_ Args&&... args)
+{
+        output(output_level::error, fmt, std::forward<Args>(args)...);
+}
+
 } // namespace libusbip
@@ -14,6 +14,9 @@
 #include <usbip\proto_op.h>
 
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include <ws2tcpip.h>
 #include <mstcpip.h>
@@ -23,6 +26,7 @@ namespace
 {
 
 using namespace usbip;
+using libusbip::output_level;
 
 /*
  * @see inet_ntop 
@@ -124,33 +128,72 @@ auto set_options(_Inout_ set_last_error &last, _In_ SOCKET s)
 		set_nodelay(last, s);
 }
 
-auto recv(_In_ SOCKET s, _In_ void *buf, _In_ size_t len, _Out_opt_ bool *eof = nullptr)
+/*
+ * Reads the socket in large chunks, records are copied from the buffer.
+ * OP_REP_DEVLIST takes a few recv() calls instead of one per record.
+ * Data after the last record read is discarded with the reader, it is used for a single reply only.
+ */
+class stream_reader
 {
-	assert(s != INVALID_SOCKET);
+public:
+	explicit stream_reader(_In_ SOCKET s) : m_sock(s) { assert(s != INVALID_SOCKET); }
 
-	if (eof) {
-		*eof = false;
-	}
+	bool read(_Out_writes_bytes_(len) void *buf, _In_ size_t len);
+
+	template<typename T>
+	auto read(_Out_ T &r) { return read(&r, sizeof(r)); }
+
+private:
+	SOCKET m_sock;
+	size_t m_pos{};
+	size_t m_end{};
+	char m_buf[16*1024]; // more than 50 records of usbip_usb_device
 
-	switch (auto ret = ::recv(s, static_cast<char*>(buf), static_cast<int>(len), MSG_WAITALL)) {
+	bool fill();
+};
+
+bool stream_reader::fill()
+{
+	assert(m_pos == m_end);
+	m_pos = m_end = 0;
+
+	switch (auto ret = ::recv(m_sock, m_buf, sizeof(m_buf), 0)) {
 	case SOCKET_ERROR:
-		if (wsa_set_last_error wsa; wsa) {
+		if (wsa_set_last_error wsa; !wsa) {
 			libusbip::output("recv error {}", wsa.error);
 		}
 		return false;
 	case 0: // connection has been gracefully closed
-		if (len) {
-			libusbip::output("recv EOF");
-			if (eof) {
-				*eof = true;
-			}
-		}
-		[[fallthrough]];
+		libusbip::output(output_level::info, "recv EOF");
+		SetLastError(ERROR_HANDLE_EOF);
+		return false;
 	default:
-		return ret == len;
+		m_end = ret;
+		return true;
 	}
 }
 
+bool stream_reader::read(_Out_writes_bytes_(len) void *buf, _In_ size_t len)
+{
+	for (auto dst = static_cast<char*>(buf); len; ) {
+
+		if (m_pos == m_end && !fill()) {
+			return false;
+		}
+
+		auto avail = m_end - m_pos;
+		auto cnt = len < avail ? len : avail;
+
+		memcpy(dst, m_buf + m_pos, cnt);
+
+		m_pos += cnt;
+		dst += cnt;
+		len -= cnt;
+	}
+
+	return true;
+}
+
 auto send(_In_ SOCKET s, _In_ const void *buf, _In_ size_t len)
 {
 	assert(s != INVALID_SOCKET);
@@ -186,12 +229,10 @@ auto send_op_common(_In_ SOCKET s, _In_ uint16_t code)
 	return send(s, &r, sizeof(r));
 }
 
-auto recv_op_common(_In_ SOCKET s, _In_ uint16_t expected_code)
+auto recv_op_common(_Inout_ stream_reader &rd, _In_ uint16_t expected_code)
 {
-	assert(s != INVALID_SOCKET);
-
 	op_common r{};
-	if (recv(s, &r, sizeof(r))) {
+	if (rd.read(r)) {
 		PACK_OP_COMMON(false, &r);
 	} else {
 		return GetLastError();
@@ -256,7 +297,9 @@ auto prepare_event(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ WSAEVENT ev
 
 auto try_connect(_In_ SOCKET s, _In_ WSAEVENT evt, _In_ const sockaddr &addr, _In_ DWORD len)
 {
-	libusbip::output(L"connecting to {}", address_to_string(addr, len));
+	if (libusbip::output_enabled(output_level::info)) { // address_to_string is expensive
+		libusbip::output(output_level::info, L"connecting to {}", address_to_string(addr, len));
+	}
 
 	if (auto err = connect(s, &addr, len) ? WSAGetLastError() : 0; !err) {
 		return 0;
@@ -278,7 +321,7 @@ auto try_connect(_In_ SOCKET s, _In_ WSAEVENT evt, _In_ const sockaddr &addr, _I
 		}
 		break;
 	case WSA_WAIT_IO_COMPLETION: // see QueueUserAPC
-		libusbip::output("connect cancelled");
+		libusbip::output(output_level::info, "connect cancelled");
 		err = ERROR_CANCELLED;
 		break;
 	default:
@@ -304,7 +347,7 @@ INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_ HANDLE cancel, _In_ bool ale
 		}
 		break;
 	case WAIT_IO_COMPLETION: // see QueueUserAPC
-		libusbip::output("GetAddrInfoEx cancelled by APC");
+		libusbip::output(output_level::info, "GetAddrInfoEx cancelled by APC");
 		if (err = GetAddrInfoExCancel(&cancel); err) {
 			libusbip::output("GetAddrInfoExOverlappedResult error {}", err);
 		} else {
@@ -343,7 +386,7 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 	ADDRINFOEX *result{};
 	HANDLE cancel{};
 
-	libusbip::output("resolving {}:{}", hostname, service);
+	libusbip::output(output_level::info, "resolving {}:{}", hostname, service);
 
 	last.error = GetAddrInfoEx(host.c_str(), svc.c_str(), NS_ALL, nullptr, 
 				   &hints, &result, nullptr, &ovlp, nullptr, &cancel);
@@ -372,6 +415,82 @@ inline auto connect_by_name(_In_ SOCKET s, _In_ LPCWSTR hostname, _In_ _In_ LPCW
 				nullptr, nullptr);
 }
 
+void CALLBACK timer_apc(_In_opt_ void*, _In_ DWORD, _In_ DWORD) {} // see CANCEL_BY_APC
+void CALLBACK stop_apc(_In_ ULONG_PTR) {}
+
+/*
+ * Cancels connect(,,CANCEL_BY_APC) of the calling thread when the timeout expires.
+ */
+auto start_timer(_In_ HANDLE timer, _In_ std::chrono::milliseconds timeout)
+{
+	LARGE_INTEGER due{ .QuadPart = -timeout.count()*10'000 }; // relative, in 100 nanosecond units
+
+	auto ok = SetWaitableTimer(timer, &due, 0, timer_apc, nullptr, false);
+	if (!ok) {
+		libusbip::output("SetWaitableTimer error {}", GetLastError());
+	}
+	return ok;
+}
+
+void stop_timer(_In_ HANDLE timer)
+{
+	CancelWaitableTimer(timer);
+	SleepEx(0, true); // run APC if it is queued already, otherwise it will cancel the next connect
+}
+
+/*
+ * @return remaining time in milliseconds, at least one
+ */
+auto remaining(_In_ std::chrono::steady_clock::time_point deadline)
+{
+	using namespace std::chrono;
+	auto ms = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+	return ms > 0 ? static_cast<int>(ms) : 1;
+}
+
+auto enum_server(
+	_In_ const server_address &srv, _In_ std::chrono::milliseconds timeout, _In_ HANDLE timer,
+	_Out_ std::vector<exported_device> &devices) -> DWORD
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	if (!start_timer(timer, timeout)) {
+		return GetLastError();
+	}
+
+	auto sock = usbip::connect(srv.hostname.c_str(), srv.service.c_str(), CANCEL_BY_APC);
+	auto err = sock ? ERROR_SUCCESS : GetLastError();
+	stop_timer(timer);
+
+	switch (err) {
+	case ERROR_SUCCESS:
+		break;
+	case ERROR_CANCELLED:
+	case WSA_E_CANCELLED:
+		return ERROR_TIMEOUT;
+	default:
+		return err;
+	}
+
+	if (set_last_error last; !(do_setsockopt(last, sock.get(), SOL_SOCKET, SO_RCVTIMEO, remaining(deadline)) &&
+				   do_setsockopt(last, sock.get(), SOL_SOCKET, SO_SNDTIMEO, remaining(deadline)))) {
+		return last.error;
+	}
+
+	auto on_dev = [&devices] (auto, auto &dev) { devices.push_back({ .device = dev }); };
+	auto on_intf = [&devices] (auto, auto&, auto, auto &intf) { devices.back().interfaces.push_back(intf); };
+	auto on_cnt = [&devices] (auto cnt) { devices.reserve(cnt); };
+
+	if (usbip::enum_exportable_devices(sock.get(), on_dev, on_intf, on_cnt)) {
+		return ERROR_SUCCESS;
+	}
+
+	err = GetLastError();
+	devices.clear();
+
+	return err == WSAETIMEDOUT ? ERROR_TIMEOUT : err;
+}
+
 } // namespace
 
 
@@ -477,20 +596,22 @@ bool usbip::enum_exportable_devices(
 		return false;
 	}
 
-	if (auto err = recv_op_common(s, OP_REP_DEVLIST)) {
+	stream_reader rd(s);
+
+	if (auto err = recv_op_common(rd, OP_REP_DEVLIST)) {
 		SetLastError(err);
 		return false;
 	}
 
 	op_devlist_reply reply{};
 	
-	if (recv(s, &reply, sizeof(reply))) {
+	if (rd.read(reply)) {
 		PACK_OP_DEVLIST_REPLY(false, &reply);
 	} else {
 		return false;
 	}
 
-	libusbip::output("{} exportable device(s)", reply.ndev);
+	libusbip::output(output_level::debug, "{} exportable device(s)", reply.ndev);
 	assert(reply.ndev <= INT_MAX);
 
 	if (on_dev_cnt) {
@@ -503,7 +624,7 @@ bool usbip::enum_exportable_devices(
 
 		usbip_usb_device dev{};
 
-		if (recv(s, &dev, sizeof(dev))) {
+		if (rd.read(dev)) {
 			usbip_net_pack_usb_device(false, &dev);
 			lib_dev = as_usb_device(dev);
 			on_dev(i, lib_dev);
@@ -515,7 +636,7 @@ bool usbip::enum_exportable_devices(
 
 			usbip_usb_interface intf{};
 
-			if (recv(s, &intf, sizeof(intf))) {
+			if (rd.read(intf)) {
 				usbip_net_pack_usb_interface(false, &intf);
 				static_assert(sizeof(intf) == sizeof(usb_interface));
 				on_intf(i, lib_dev, j, reinterpret_cast<usb_interface&>(intf));
@@ -527,3 +648,65 @@ bool usbip::enum_exportable_devices(
 
 	return true;
 }
+
+/*
+ * A worker has own waitable timer, the timer's APC cancels connect(,,CANCEL_BY_APC).
+ * Send and receive are limited by SO_SNDTIMEO and SO_RCVTIMEO, set to the rest of the timeout.
+ * Stop request queues APC to all workers, that cancels connects in progress.
+ */
+void usbip::enum_exportable_devices(
+	_In_ const std::vector<server_address> &servers,
+	_In_ const server_devices_f &on_server,
+	_In_ std::chrono::milliseconds timeout,
+	_In_ int max_parallel,
+	_In_ std::stop_token stop)
+{
+	auto cnt = static_cast<int>(servers.size());
+	if (!cnt) {
+		return;
+	}
+
+	std::atomic<int> next{};
+	std::mutex mtx; // serializes on_server
+
+	auto worker = [&]
+	{
+		NullableHandle timer(CreateWaitableTimer(nullptr, true, nullptr));
+		auto timer_err = timer ? ERROR_SUCCESS : GetLastError();
+
+		for (int i; (i = next++) < cnt; ) {
+			std::vector<exported_device> devices;
+			DWORD err;
+
+			if (stop.stop_requested()) {
+				err = ERROR_CANCELLED;
+			} else if (timer_err) {
+				err = timer_err;
+			} else if (err = enum_server(servers[i], timeout, timer.get(), devices);
+				   err && stop.stop_requested()) {
+				err = ERROR_CANCELLED;
+			}
+
+			std::lock_guard lock(mtx);
+			on_server(i, err, devices);
+		}
+	};
+
+	std::vector<std::jthread> threads(max_parallel <= 1 ? 1 : max_parallel < cnt ? max_parallel : cnt);
+	libusbip::output(output_level::debug, "{} server(s), {} worker(s)", cnt, threads.size());
+
+	for (auto &t: threads) {
+		t = std::jthread(worker);
+	}
+
+	std::stop_callback on_stop(stop, [&threads]
+	{
+		for (auto &t: threads) {
+			QueueUserAPC(stop_apc, t.native_handle(), 0);
+		}
+	});
+
+	for (auto &t: threads) {
+		t.join(); // while on_stop is registered
+	}
+}
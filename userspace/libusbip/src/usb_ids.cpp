@@ -6,51 +6,566 @@
 #include "output.h"
 
 #include <cassert>
+#include <cctype>
 #include <charconv>
-#include <functional>
+#include <cstring>
+#include <vector>
+#include <span>
+#include <memory>
+#include <mutex>
+#include <algorithm>
 
 namespace
 {
 
-uint16_t remove_prefix_hex(std::string_view &s, int cnt)
+using namespace usbip;
+using libusbip::output_level;
+
+bool remove_prefix_hex(_Out_ uint16_t &val, _Inout_ std::string_view &s, _In_ int cnt)
 {
-        int val{};
-        auto end = s.data() + cnt;
+        if (s.size() < size_t(cnt)) {
+                return false;
+        }
 
-        auto [ptr, ec] = std::from_chars(s.data(), end, val, 16);
+        auto end = s.data() + cnt;
 
-        if (ec != std::errc{}) {
-		return 0;
-	}
+        if (auto [ptr, ec] = std::from_chars(s.data(), end, val, 16); ec != std::errc{} || ptr != end) {
+                return false;
+        }
 
-        assert(ptr == end);
         s.remove_prefix(cnt);
+        return true;
+}
 
-        auto res = static_cast<uint16_t>(val);
-        assert(res == val);
+bool remove_prefix_hex(_Out_ uint8_t &val, _Inout_ std::string_view &s, _In_ int cnt)
+{
+        uint16_t v{};
+        auto ok = remove_prefix_hex(v, s, cnt);
 
-        return res;
+        val = static_cast<uint8_t>(v);
+        return ok;
 }
 
-using line_f = std::function<bool(std::string_view&, std::string_view&)>;
-
-void for_each_line(std::string_view text, const line_f &f)
+/*
+ * usb.ids must be in Unix format, 0xA line endings.
+ * @param f returns true to stop
+ */
+template<typename F>
+void for_each_line(_In_ std::string_view text, _In_ F &&f)
 {
-        while (!text.empty()) {
-                auto pos = text.find('\n'); // usb.ids must be in Unix format, 0xA line endings
-                if (pos == text.npos) {
-                        std::string_view tail;
-                        f(text, tail);
+        for (auto cur = text.data(), end = cur + text.size(); cur != end; ) {
+
+                auto eol = static_cast<const char*>(memchr(cur, '\n', end - cur));
+                if (!eol) {
+                        eol = end;
+                }
+
+                if (std::string_view line(cur, eol - cur); !line.empty() && f(line)) {
                         break;
                 }
 
-                auto line = text.substr(0, pos);
-                text.remove_prefix(pos + 1); // line + '\n'
+                cur = eol == end ? end : eol + 1;
+        }
+}
 
-                if (!line.empty() && f(line, text)) {
-                        break;
+/*
+ * Children of an entry are contiguous in the table of the next level.
+ */
+template<typename T>
+struct entry
+{
+        T id;
+        std::string_view name;
+
+        uint32_t first; // index of the first child
+        uint32_t count; // number of children
+};
+
+template<typename T>
+using entries = std::vector<entry<T>>;
+
+/*
+ * The content of usb.ids is sorted, therefore sort is usually not called.
+ * std::stable_sort preserves the first entry among duplicates.
+ */
+template<typename T>
+void sort_entries(_Inout_ entry<T> *first, _Inout_ entry<T> *last)
+{
+        auto less = [] (auto &a, auto &b) { return a.id < b.id; };
+
+        if (!std::is_sorted(first, last, less)) {
+                std::stable_sort(first, last, less);
+        }
+}
+
+template<typename T>
+inline void sort_entries(_Inout_ entries<T> &v)
+{
+        sort_entries(v.data(), v.data() + v.size());
+}
+
+/*
+ * Sorts children of every parent, the order of the parents is not changed.
+ */
+template<typename T, typename U>
+void sort_children(_In_ const entries<T> &parents, _Inout_ entries<U> &children)
+{
+        for (auto &p: parents) {
+                auto first = children.data() + p.first;
+                sort_entries(first, first + p.count);
+        }
+}
+
+/*
+ * Appends the child to the last parent.
+ */
+template<typename T, typename U>
+void add_child(_Inout_ entries<T> &parents, _Inout_ entries<U> &children, _In_ U id, _In_ std::string_view name)
+{
+        assert(!parents.empty());
+        auto &p = parents.back();
+
+        if (!p.count) {
+                p.first = static_cast<uint32_t>(children.size());
+        }
+        assert(p.first + p.count == children.size()); // contiguous
+
+        children.push_back({ .id = id, .name = name });
+        ++p.count;
+}
+
+/*
+ * Text usb.ids parsed into flat tables, names refer to the text.
+ */
+struct parser
+{
+        entries<uint16_t> vendors;
+        entries<uint16_t> products;
+
+        entries<uint8_t> classes;
+        entries<uint8_t> subclasses;
+        entries<uint8_t> protocols;
+
+        void parse(_In_ std::string_view text);
+
+        bool parse_vid_pid(_In_ std::string_view line);
+        bool parse_class_sub_proto(_In_ std::string_view line);
+};
+
+void parser::parse(_In_ std::string_view text)
+{
+        products.reserve(text.size()/32); // average length of a line
+
+        auto vendor_section = true;
+
+        for_each_line(text, [this, &vendor_section] (auto line)
+        {
+                if (!vendor_section) {
+                        return parse_class_sub_proto(line);
+                } else if (parse_vid_pid(line)) {
+                        vendor_section = false;
+                }
+                return false;
+        });
+
+        sort_children(vendors, products);
+        sort_entries(vendors);
+
+        sort_children(subclasses, protocols);
+        sort_children(classes, subclasses);
+        sort_entries(classes);
+}
+
+bool parser::parse_vid_pid(_In_ std::string_view line)
+{
+        if (line.starts_with("# List of known device classes, subclasses and protocols")) {
+                return true;
+        } else if (line.starts_with('#')) {
+                // continue;
+        } else if (line.starts_with("\t\t")) { // \t \t interface  interface_name
+                assert(!"\\t\\t detected");
+        } else if (line.starts_with('\t')) { // \t device  device_name
+                line.remove_prefix(1);
+                if (uint16_t pid; !vendors.empty() && remove_prefix_hex(pid, line, 4)) {
+                        line.remove_prefix(2); // device_name
+                        add_child(vendors, products, pid, line);
+                }
+        } else if (uint16_t vid; remove_prefix_hex(vid, line, 4)) { // vendor  vendor_name
+                line.remove_prefix(2); // vendor_name
+                vendors.push_back({ .id = vid, .name = line });
+        }
+
+        return false;
+}
+
+bool parser::parse_class_sub_proto(_In_ std::string_view line)
+{
+        if (line.starts_with("# List of Audio Class Terminal Types")) {
+                return true;
+        } else if (line.starts_with('#')) {
+                // continue;
+        } else if (line.starts_with("\t\t")) {
+                line.remove_prefix(2);
+                if (uint8_t prot; !classes.empty() && classes.back().count && remove_prefix_hex(prot, line, 2)) {
+                        line.remove_prefix(2);
+                        add_child(subclasses, protocols, prot, line);
+                }
+        } else if (line.starts_with('\t')) {
+                line.remove_prefix(1);
+                if (uint8_t subcls; !classes.empty() && remove_prefix_hex(subcls, line, 2)) {
+                        line.remove_prefix(2);
+                        add_child(classes, subclasses, subcls, line);
+                }
+        } else if (line.starts_with("C ")) {
+                line.remove_prefix(2);
+
+                if (uint8_t cls; remove_prefix_hex(cls, line, 2)) { // "C 00  (Defined at Interface level)"
+                        line.remove_prefix(2);
+                        classes.push_back({ .id = cls, .name = line });
+                }
+        }
+
+        return false;
+}
+
+/*
+ * Compiled usb.ids, see UsbIds::compile.
+ * It is queried in place, all offsets are relative to the beginning of the image.
+ * Little-endian, the image must be aligned at least on a four-byte boundary.
+ */
+enum table_index { VENDORS, PRODUCTS, CLASSES, SUBCLASSES, PROTOCOLS, TABLE_CNT };
+
+enum {
+        VID_SHIFT = 4, // a bucket has a few vendors
+        VID_BUCKETS = (UINT16_MAX >> VID_SHIFT) + 2, // index of the first vendor with vid >> VID_SHIFT
+        IMAGE_ALIGN = 4,
+};
+
+constexpr char image_magic[8] { 'U', 'S', 'B', 'I', 'D', 'S', '\0', '\1' }; // the last byte is the version
+
+struct section
+{
+        uint32_t offset;
+        uint32_t count; // of elements
+};
+
+struct image_header
+{
+        char magic[sizeof(image_magic)];
+        uint32_t size; // of the image
+
+        section strings; // names are not null-terminated
+        section ids[TABLE_CNT]; // sorted, T[] where T is uint16_t or uint8_t
+        section records[TABLE_CNT]; // record[], in the same order as ids
+        section vid_buckets; // uint32_t[VID_BUCKETS]
+};
+
+struct record
+{
+        uint32_t name; // offset in strings
+        uint16_t name_len;
+        uint16_t count; // number of children
+        uint32_t first; // index of the first child
+};
+
+static_assert(sizeof(image_header) % IMAGE_ALIGN == 0);
+static_assert(sizeof(record) % IMAGE_ALIGN == 0);
+
+auto is_image(_In_ std::string_view s) noexcept
+{
+        return s.size() >= sizeof(image_header) && !memcmp(s.data(), image_magic, sizeof(image_magic));
+}
+
+class image_writer
+{
+public:
+        image_writer() : m_buf(sizeof(image_header), '\0') {}
+
+        template<typename T>
+        auto append(_In_ const T *data, _In_ size_t cnt)
+        {
+                m_buf.resize((m_buf.size() + IMAGE_ALIGN - 1) & ~size_t(IMAGE_ALIGN - 1));
+
+                section s { .offset = static_cast<uint32_t>(m_buf.size()), .count = static_cast<uint32_t>(cnt) };
+                m_buf.append(reinterpret_cast<const char*>(data), cnt*sizeof(*data));
+
+                return s;
+        }
+
+        template<typename T>
+        bool append_table(_Inout_ image_header &hdr, _In_ table_index idx, _In_ const entries<T> &v, _Inout_ std::string &strings);
+
+        auto release(_Inout_ image_header &hdr)
+        {
+                hdr.size = static_cast<uint32_t>(m_buf.size());
+                memcpy(m_buf.data(), &hdr, sizeof(hdr));
+                return std::move(m_buf);
+        }
+
+private:
+        std::string m_buf;
+};
+
+template<typename T>
+bool image_writer::append_table(
+        _Inout_ image_header &hdr, _In_ table_index idx, _In_ const entries<T> &v, _Inout_ std::string &strings)
+{
+        std::vector<T> ids;
+        ids.reserve(v.size());
+
+        std::vector<record> records;
+        records.reserve(v.size());
+
+        for (auto &e: v) {
+                if (e.count > UINT16_MAX) {
+                        return false;
+                }
+
+                auto name = e.name.substr(0, UINT16_MAX);
+
+                ids.push_back(e.id);
+                records.push_back({
+                        .name = static_cast<uint32_t>(strings.size()),
+                        .name_len = static_cast<uint16_t>(name.size()),
+                        .count = static_cast<uint16_t>(e.count),
+                        .first = e.first });
+
+                strings += name;
+        }
+
+        hdr.ids[idx] = append(ids.data(), ids.size());
+        hdr.records[idx] = append(records.data(), records.size());
+
+        return true;
+}
+
+auto make_vid_buckets(_In_ const entries<uint16_t> &vendors)
+{
+        std::vector<uint32_t> v(VID_BUCKETS);
+
+        for (uint32_t i = 0, b = 0; b < v.size(); ++b) {
+                for ( ; i < vendors.size() && vendors[i].id >> VID_SHIFT < b; ++i);
+                v[b] = i;
+        }
+
+        return v;
+}
+
+std::string compile(_In_ std::string_view text)
+{
+        parser p;
+        p.parse(text);
+
+        image_header hdr{};
+        memcpy(hdr.magic, image_magic, sizeof(hdr.magic));
+
+        image_writer w;
+
+        std::string strings;
+        strings.reserve(text.size());
+
+        if (!(w.append_table(hdr, VENDORS, p.vendors, strings) &&
+              w.append_table(hdr, PRODUCTS, p.products, strings) &&
+              w.append_table(hdr, CLASSES, p.classes, strings) &&
+              w.append_table(hdr, SUBCLASSES, p.subclasses, strings) &&
+              w.append_table(hdr, PROTOCOLS, p.protocols, strings))) {
+                return {};
+        }
+
+        auto buckets = make_vid_buckets(p.vendors);
+        hdr.vid_buckets = w.append(buckets.data(), buckets.size());
+
+        hdr.strings = w.append(strings.data(), strings.size());
+
+        return w.release(hdr);
+}
+
+/*
+ * A table of the image. Records come from a file and are not trusted, their ranges are checked.
+ */
+template<typename T>
+struct table
+{
+        const T *ids{};
+        const record *records{};
+        uint32_t size{};
+
+        const record* find(_In_ uint32_t first, _In_ uint32_t count, _In_ T id) const noexcept
+        {
+                if (!count || first > size || count > size - first) {
+                        return nullptr;
+                }
+
+                auto i = ids + first;
+                auto end = i + count;
+
+                for (auto n = count; n > 1; ) { // branchless lower bound, ids of lookups are unpredictable
+                        auto half = n/2;
+                        i = i[half] < id ? i + half : i;
+                        n -= half;
+                }
+
+                i += *i < id;
+                return i != end && *i == id ? records + (i - ids) : nullptr;
+        }
+
+        auto find(_In_ T id) const noexcept { return find(0, size, id); }
+
+        auto find_child(_In_ const record &parent, _In_ T id) const noexcept
+        {
+                return find(parent.first, parent.count, id);
+        }
+};
+
+inline auto fold(_In_ char c) noexcept
+{
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+/*
+ * Only ASCII letters are folded, names in usb.ids are mostly ASCII.
+ */
+void append_folded(_Inout_ std::string &dst, _In_ std::string_view s)
+{
+        for (auto c: s) {
+                dst += fold(c);
+        }
+}
+
+inline uint32_t trigram(_In_ const char *s) noexcept
+{
+        return uint8_t(s[0]) << 16 | uint8_t(s[1]) << 8 | uint8_t(s[2]);
+}
+
+/*
+ * Posting lists of trigrams of the names of vendors and products, the names are folded.
+ */
+class trigram_index
+{
+public:
+        struct doc
+        {
+                uint32_t offset; // of the name in m_text
+                uint32_t length;
+                name_match id;
+        };
+
+        void add(_In_ std::string_view name, _In_ const name_match &id);
+        void build();
+
+        auto& docs() const noexcept { return m_docs; }
+        auto name(_In_ const doc &d) const noexcept { return std::string_view(m_text).substr(d.offset, d.length); }
+
+        std::vector<uint32_t> candidates(_In_ std::string_view query) const;
+
+private:
+        std::string m_text;
+        std::vector<doc> m_docs;
+
+        std::vector<uint32_t> m_trigrams; // sorted
+        std::vector<uint32_t> m_offsets; // of posting lists in m_postings, one more than m_trigrams
+        std::vector<uint32_t> m_postings; // indices of docs
+
+        std::span<const uint32_t> postings(_In_ uint32_t tri) const noexcept;
+};
+
+void trigram_index::add(_In_ std::string_view name, _In_ const name_match &id)
+{
+        auto offset = static_cast<uint32_t>(m_text.size());
+        append_folded(m_text, name);
+
+        m_docs.push_back({ .offset = offset, .length = static_cast<uint32_t>(name.size()), .id = id });
+}
+
+void trigram_index::build()
+{
+        std::vector<uint64_t> pairs; // trigram << 32 | doc
+        pairs.reserve(m_text.size());
+
+        for (uint32_t i = 0; i < m_docs.size(); ++i) {
+                auto s = name(m_docs[i]);
+                for (size_t j = 0; j + 3 <= s.size(); ++j) {
+                        pairs.push_back(uint64_t(trigram(s.data() + j)) << 32 | i);
+                }
+        }
+
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+        m_postings.reserve(pairs.size());
+
+        for (auto p: pairs) {
+                if (auto tri = static_cast<uint32_t>(p >> 32); m_trigrams.empty() || m_trigrams.back() != tri) {
+                        m_trigrams.push_back(tri);
+                        m_offsets.push_back(static_cast<uint32_t>(m_postings.size()));
+                }
+                m_postings.push_back(static_cast<uint32_t>(p));
+        }
+
+        m_offsets.push_back(static_cast<uint32_t>(m_postings.size()));
+}
+
+std::span<const uint32_t> trigram_index::postings(_In_ uint32_t tri) const noexcept
+{
+        auto i = std::lower_bound(m_trigrams.begin(), m_trigrams.end(), tri);
+        if (i == m_trigrams.end() || *i != tri) {
+                return {};
+        }
+
+        auto n = i - m_trigrams.begin();
+        return { m_postings.data() + m_offsets[n], m_postings.data() + m_offsets[n + 1] };
+}
+
+/*
+ * @param query folded, at least three characters
+ * @return sorted indices of docs that have all trigrams of the query
+ */
+std::vector<uint32_t> trigram_index::candidates(_In_ std::string_view query) const
+{
+        assert(query.size() >= 3);
+        std::vector<std::span<const uint32_t>> lists;
+
+        for (size_t i = 0; i + 3 <= query.size(); ++i) {
+                if (auto v = postings(trigram(query.data() + i)); v.empty()) {
+                        return {};
+                } else {
+                        lists.push_back(v);
                 }
         }
+
+        std::sort(lists.begin(), lists.end(), [] (auto &a, auto &b) { return a.size() < b.size(); });
+
+        std::vector<uint32_t> res(lists.front().begin(), lists.front().end());
+        std::vector<uint32_t> tmp;
+
+        for (size_t i = 1; i < lists.size() && !res.empty(); ++i) {
+                tmp.clear();
+                std::set_intersection(res.begin(), res.end(), lists[i].begin(), lists[i].end(), std::back_inserter(tmp));
+                res.swap(tmp);
+        }
+
+        return res;
+}
+
+/*
+ * @return the lower the better
+ */
+auto rank(_In_ std::string_view name, _In_ std::string_view query) noexcept
+{
+        enum { WHOLE, PREFIX, WORD, ANYWHERE, NONE };
+        int best = NONE;
+
+        for (auto pos = name.find(query); pos != name.npos && best > PREFIX; pos = name.find(query, pos + 1)) {
+                if (!pos) {
+                        best = name.size() == query.size() ? WHOLE : PREFIX;
+                } else if (auto c = uint8_t(name[pos - 1]); !isalnum(c)) {
+                        best = std::min(best, int(WORD));
+                } else {
+                        best = std::min(best, int(ANYWHERE));
+                }
+        }
+
+        return best < NONE ? best : -1;
 }
 
 } // namespace
@@ -124,9 +639,9 @@ std::string_view win::Resource::str() const noexcept { return m_impl->str(); }
 class usbip::UsbIds::Impl
 {
 public:
-        Impl(std::string_view content);
+        Impl(std::string_view content) { load(content); }
 
-        auto operator!() const noexcept { return m_vendor.empty() || m_class.empty(); } 
+        auto operator!() const noexcept { return !(m_vendors.size && m_classes.size); }
         explicit operator bool() const noexcept { return !!*this; }
 
         void load(std::string_view content);
@@ -139,142 +654,171 @@ public:
         std::tuple<std::string_view, std::string_view, std::string_view> 
                 find_class_subclass_proto(uint8_t class_id, uint8_t subclass_id, uint8_t prot_id) const noexcept;
 
+        std::vector<name_match> search(std::string_view query, size_t max_results) const;
+
 private:
-        using products_t = std::unordered_map<uint16_t, std::string_view>;
-        using vendors_t = std::unordered_map<uint16_t, std::pair<std::string_view, products_t>>;
-        vendors_t m_vendor;
+        std::string m_image; // if the content is not an image or is misaligned
+        std::string_view m_strings;
 
-        using proto_t = std::unordered_map<uint8_t, std::string_view>;
-        using subclass_t = std::unordered_map<uint8_t, std::pair<std::string_view, proto_t>>;
-        using class_t = std::unordered_map<uint8_t, std::pair<std::string_view, subclass_t>>;
-        class_t m_class;
+        table<uint16_t> m_vendors;
+        table<uint16_t> m_products;
+        const uint32_t *m_vid_buckets{};
 
-        bool parse_vid_pid(uint16_t &vid, uint16_t &pid, std::string_view &line, std::string_view &tail);
-        bool parse_class_sub_proto(uint8_t &cls, uint8_t &subcls, std::string_view &line, std::string_view &tail);
-};
+        table<uint8_t> m_classes;
+        table<uint8_t> m_subclasses;
+        table<uint8_t> m_protocols;
 
-usbip::UsbIds::Impl::Impl(std::string_view content)
-{
-        load(content);
-        
-        //dump_vendors();
-        //printf("CLASSES\n");
-        //dump_classes();
-}
+        bool attach(std::string_view image) noexcept;
+
+        template<typename T>
+        bool attach(table<T> &t, std::string_view image, table_index idx) noexcept;
+
+        std::string_view name(const record &r) const noexcept;
+
+        mutable std::mutex m_index_mtx;
+        mutable std::shared_ptr<const trigram_index> m_index; // built on demand
+
+        std::shared_ptr<const trigram_index> get_index() const;
+};
 
+/*
+ * A text is compiled into the image, names are copied.
+ */
 void usbip::UsbIds::Impl::load(std::string_view content)
 {
-        uint16_t vid{};
-        uint16_t pid{};
-        
-        auto f = [this, &vid, &pid] (auto&&... args) 
-        { 
-                return parse_vid_pid(vid, pid, std::forward<decltype(args)>(args)...); 
-        };
-        
-        for_each_line(content, std::move(f));
+        auto aligned = !(reinterpret_cast<uintptr_t>(content.data()) % IMAGE_ALIGN);
+
+        if (!is_image(content)) {
+                m_image = compile(content);
+                content = m_image;
+        } else if (!aligned) {
+                m_image = content;
+                content = m_image;
+        } else {
+                m_image.clear();
+        }
+
+        if (!attach(content)) {
+                libusbip::output("usb.ids image is corrupted");
+                attach({});
+        }
+
+        std::lock_guard lock(m_index_mtx);
+        m_index.reset();
 }
 
-void usbip::UsbIds::Impl::dump_vendors() const
+/*
+ * @param image can be empty to reset the tables
+ */
+bool usbip::UsbIds::Impl::attach(std::string_view image) noexcept
 {
-        for (auto& [vid, pair]: m_vendor) {
-
-                auto& [vendor_name, products] = pair;
-                libusbip::output("{:04x}  {}", vid, vendor_name);
+        auto hdr = image.empty() ? nullptr : reinterpret_cast<const image_header*>(image.data());
 
-                for (auto& [pid, name]: products) {
-                        libusbip::output("\t{:04x}  {}", pid, name);
+        if (hdr) {
+                if (!is_image(image) || hdr->size > image.size()) {
+                        return false;
                 }
+                image = image.substr(0, hdr->size);
         }
+
+        auto ok = attach(m_vendors, image, VENDORS) &&
+                  attach(m_products, image, PRODUCTS) &&
+                  attach(m_classes, image, CLASSES) &&
+                  attach(m_subclasses, image, SUBCLASSES) &&
+                  attach(m_protocols, image, PROTOCOLS);
+
+        if (!hdr) {
+                m_strings = {};
+                m_vid_buckets = nullptr;
+                return ok;
+        }
+
+        auto &buckets = hdr->vid_buckets;
+        auto &strings = hdr->strings;
+
+        if (!ok || buckets.count != VID_BUCKETS || buckets.offset % alignof(uint32_t) ||
+            buckets.offset > image.size() || (image.size() - buckets.offset)/sizeof(uint32_t) < buckets.count ||
+            strings.offset > image.size() || image.size() - strings.offset < strings.count) {
+                return false;
+        }
+
+        m_vid_buckets = reinterpret_cast<const uint32_t*>(image.data() + buckets.offset);
+        m_strings = image.substr(strings.offset, strings.count);
+
+        return true;
 }
 
-void usbip::UsbIds::Impl::dump_classes() const
+template<typename T>
+bool usbip::UsbIds::Impl::attach(table<T> &t, std::string_view image, table_index idx) noexcept
 {
-        for (auto& [cls_id, pair]: m_class) {
+        t = {};
 
-                auto& [cls_name, subclasses] = pair;
-                libusbip::output("C {:02x}  {}", cls_id, cls_name);
+        if (image.empty()) {
+                return true;
+        }
 
-                for (auto& [sub_id, sub_pair]: subclasses) {
+        auto hdr = reinterpret_cast<const image_header*>(image.data());
+        auto &ids = hdr->ids[idx];
+        auto &records = hdr->records[idx];
 
-                        auto& [sub_name, protocols] = sub_pair;
-                        libusbip::output("\t{:02x}  {}", sub_id, sub_name);
+        auto fits = [size = image.size()] (auto &s, size_t elem_size, size_t align)
+        {
+                return !(s.offset % align) && s.offset <= size && (size - s.offset)/elem_size >= s.count;
+        };
 
-                        for (auto& [prot_id, name]: protocols) {
-                                libusbip::output("\t\t{:02x}  {}", prot_id, name);
-                        }
-                }
+        if (ids.count != records.count || !fits(ids, sizeof(T), alignof(T)) ||
+            !fits(records, sizeof(record), alignof(record))) {
+                return false;
         }
+
+        t.ids = reinterpret_cast<const T*>(image.data() + ids.offset);
+        t.records = reinterpret_cast<const record*>(image.data() + records.offset);
+        t.size = ids.count;
+
+        return true;
 }
 
-bool usbip::UsbIds::Impl::parse_vid_pid(
-        uint16_t &vid, uint16_t &pid, std::string_view &line, std::string_view &tail)
+std::string_view usbip::UsbIds::Impl::name(const record &r) const noexcept
 {
-        if (line.starts_with("# List of known device classes, subclasses and protocols")) {
-                uint8_t cls{};
-                uint8_t subcls{};
-                auto f = [this, &cls, &subcls] (auto&&... args) 
-                { 
-                        return parse_class_sub_proto(cls, subcls, std::forward<decltype(args)>(args)...); 
-                };
-                for_each_line(tail, std::move(f));
-                return true;
-        } else if (line.starts_with('#')) {
-                // continue;
-        } else if (line.starts_with("\t\t")) { // \t \t interface  interface_name
-                assert(!"\\t\\t detected");
-        } else if (line.starts_with('\t')) { // \t device  device_name
-                line.remove_prefix(1);
-                if (bool(pid = remove_prefix_hex(line, 4))) {
-                        line.remove_prefix(2); // device_name
-                        auto &prod = m_vendor[vid].second;
-                        auto [it, inserted] = prod.emplace(pid, line);
-                        assert(inserted);
-                }
-        } else if (bool(vid = remove_prefix_hex(line, 4))) { // vendor  vendor_name
-                line.remove_prefix(2); // vendor_name
-                auto [it, inserted] = m_vendor.emplace(vid, std::make_pair(line, products_t()));
-                assert(inserted);
+        auto sz = m_strings.size();
+        return r.name <= sz ? m_strings.substr(r.name, r.name_len) : std::string_view();
+}
+
+void usbip::UsbIds::Impl::dump_vendors() const
+{
+        if (!libusbip::output_enabled(output_level::debug)) {
+                return;
         }
 
-        return false;
+        for (uint32_t i = 0; i < m_vendors.size; ++i) {
+                auto &v = m_vendors.records[i];
+                libusbip::output(output_level::debug, "{:04x}  {}", m_vendors.ids[i], name(v));
+
+                for (auto j = v.first; j < v.first + v.count && j < m_products.size; ++j) {
+                        libusbip::output(output_level::debug, "\t{:04x}  {}", m_products.ids[j], name(m_products.records[j]));
+                }
+        }
 }
 
-bool usbip::UsbIds::Impl::parse_class_sub_proto(
-        uint8_t &cls, uint8_t &subcls, std::string_view &line, std::string_view&)
+void usbip::UsbIds::Impl::dump_classes() const
 {
-        if (line.starts_with("# List of Audio Class Terminal Types")) {
-                return true;
-        } else if (line.starts_with('#')) {
-                // continue;
-        } else if (line.starts_with("\t\t")) {
-                line.remove_prefix(2);
-                if (auto prot = (uint8_t)remove_prefix_hex(line, 2)) {
-                        line.remove_prefix(2);
-                        auto &sub = m_class[cls].second;
-                        auto &proto = sub[subcls].second;
-                        auto [it, inserted] = proto.emplace(prot, line);
-                        assert(inserted);
-                }
-        } else if (line.starts_with('\t')) {
-                line.remove_prefix(1);
-                if (bool(subcls = (uint8_t)remove_prefix_hex(line, 2))) {
-                        line.remove_prefix(2);
-                        auto &sub = m_class[cls].second;
-                        auto [it, inserted] = sub.emplace(subcls, std::make_pair(line, proto_t()));
-                        assert(inserted);
-                }
-        } else if (line.starts_with("C ")) {
-                line.remove_prefix(2);
+        if (!libusbip::output_enabled(output_level::debug)) {
+                return;
+        }
 
-                cls = (uint8_t)remove_prefix_hex(line, 2); // "C 00  (Defined at Interface level)"
-                line.remove_prefix(2);
+        for (uint32_t i = 0; i < m_classes.size; ++i) {
+                auto &c = m_classes.records[i];
+                libusbip::output(output_level::debug, "C {:02x}  {}", m_classes.ids[i], name(c));
 
-                auto [it, inserted] = m_class.emplace(cls, std::make_pair(line, subclass_t()));
-                assert(inserted);
-        }
+                for (auto j = c.first; j < c.first + c.count && j < m_subclasses.size; ++j) {
+                        auto &sub = m_subclasses.records[j];
+                        libusbip::output(output_level::debug, "\t{:02x}  {}", m_subclasses.ids[j], name(sub));
 
-        return false;
+                        for (auto k = sub.first; k < sub.first + sub.count && k < m_protocols.size; ++k) {
+                                libusbip::output(output_level::debug, "\t\t{:02x}  {}", m_protocols.ids[k], name(m_protocols.records[k]));
+                        }
+                }
+        }
 }
 
 std::pair<std::string_view, std::string_view> 
@@ -282,17 +826,22 @@ usbip::UsbIds::Impl::find_product(uint16_t vid, uint16_t pid) const noexcept
 {
         std::pair<std::string_view, std::string_view> res;
 
-        auto v = m_vendor.find(vid);
-        if (v == m_vendor.end()) {
+        if (!m_vid_buckets) {
                 return res;
         }
 
-        res.first = v->second.first;
-        auto &prod = v->second.second;
+        auto b = vid >> VID_SHIFT;
+        auto first = m_vid_buckets[b];
 
-        auto p = prod.find(pid);
-        if (p != prod.end()) {
-                res.second = p->second;
+        auto v = m_vendors.find(first, m_vid_buckets[b + 1] - first, vid);
+        if (!v) {
+                return res;
+        }
+
+        res.first = name(*v);
+
+        if (auto p = m_products.find_child(*v, pid)) {
+                res.second = name(*p);
         }
 
         return res;
@@ -304,25 +853,108 @@ usbip::UsbIds::Impl::find_class_subclass_proto(
 {
         std::tuple<std::string_view, std::string_view, std::string_view>  res;
 
-        auto c = m_class.find(class_id);
-        if (c == m_class.end()) {
+        auto c = m_classes.find(class_id);
+        if (!c) {
                 return res;
         }
 
-        std::get<0>(res) = c->second.first;
-        auto &subcls = c->second.second;
+        std::get<0>(res) = name(*c);
 
-        auto s = subcls.find(subclass_id);
-        if (s == subcls.end()) {
+        auto s = m_subclasses.find_child(*c, subclass_id);
+        if (!s) {
                 return res;
         }
 
-        std::get<1>(res) = s->second.first;
-        auto &prot = s->second.second;
+        std::get<1>(res) = name(*s);
 
-        auto p = prot.find(prot_id);
-        if (p != prot.end()) {
-                std::get<2>(res) = p->second;
+        if (auto p = m_protocols.find_child(*s, prot_id)) {
+                std::get<2>(res) = name(*p);
+        }
+
+        return res;
+}
+
+auto usbip::UsbIds::Impl::get_index() const -> std::shared_ptr<const trigram_index>
+{
+        std::lock_guard lock(m_index_mtx);
+
+        if (m_index) {
+                return m_index;
+        }
+
+        auto idx = std::make_shared<trigram_index>();
+
+        for (uint32_t i = 0; i < m_vendors.size; ++i) {
+                auto &v = m_vendors.records[i];
+                auto vid = m_vendors.ids[i];
+
+                idx->add(name(v), { .vid = vid });
+
+                for (auto j = v.first; j < v.first + v.count && j < m_products.size; ++j) {
+                        name_match id { .vid = vid, .pid = m_products.ids[j], .product = true };
+                        idx->add(name(m_products.records[j]), id);
+                }
+        }
+
+        idx->build();
+
+        m_index = std::move(idx);
+        return m_index;
+}
+
+auto usbip::UsbIds::Impl::search(std::string_view query, size_t max_results) const -> std::vector<name_match>
+{
+        std::string q;
+        append_folded(q, query);
+
+        if (q.empty()) {
+                return {};
+        }
+
+        auto idx = get_index();
+        auto &docs = idx->docs();
+
+        std::vector<uint32_t> cand;
+
+        if (q.size() >= 3) {
+                cand = idx->candidates(q);
+        } else { // no trigrams, scan all names
+                cand.resize(docs.size());
+                for (uint32_t i = 0; i < cand.size(); ++i) {
+                        cand[i] = i;
+                }
+        }
+
+        struct ranked
+        {
+                int rank;
+                uint32_t length;
+                uint32_t doc;
+        };
+
+        std::vector<ranked> v;
+
+        for (auto i: cand) {
+                auto &d = docs[i];
+                if (auto r = rank(idx->name(d), q); r >= 0) {
+                        v.push_back({ .rank = r, .length = d.length, .doc = i });
+                }
+        }
+
+        auto less = [] (auto &a, auto &b) { return std::tie(a.rank, a.length, a.doc) < std::tie(b.rank, b.length, b.doc); };
+
+        if (max_results && max_results < v.size()) {
+                std::partial_sort(v.begin(), v.begin() + max_results, v.end(), less);
+                v.resize(max_results);
+        } else {
+                std::sort(v.begin(), v.end(), less);
+        }
+
+        std::vector<name_match> res;
+        res.reserve(v.size());
+
+        for (auto &r: v) {
+                res.push_back(docs[r.doc].id);
         }
 
         return res;
@@ -347,6 +979,8 @@ bool usbip::UsbIds::operator !() const noexcept { return !*m_impl; }
 
 void usbip::UsbIds::load(std::string_view content) { m_impl->load(content); }
 
+std::string usbip::UsbIds::compile(std::string_view text) { return ::compile(text); }
+
 std::pair<std::string_view, std::string_view> 
 usbip::UsbIds::find_product(uint16_t vid, uint16_t pid) const noexcept 
 { 
@@ -358,3 +992,8 @@ usbip::UsbIds::find_class_subclass_proto(uint8_t class_id, uint8_t subclass_id,
 {
         return m_impl->find_class_subclass_proto(class_id, subclass_id, prot_id);
 }
+
+auto usbip::UsbIds::search(std::string_view query, size_t max_results) const -> std::vector<name_match>
+{
+        return m_impl->search(query, max_results);
+}
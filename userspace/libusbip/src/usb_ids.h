@@ -8,6 +8,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include <windows.h>
 
@@ -53,6 +54,16 @@ private:
 namespace usbip
 {
 
+/*
+ * @see UsbIds::search
+ */
+struct name_match
+{
+	uint16_t vid;
+	uint16_t pid; // if product is true
+	bool product; // the name of the product matches, otherwise the name of the vendor
+};
+
 class USBIP_API UsbIds
 {
 public:
@@ -68,12 +79,30 @@ public:
 	explicit operator bool() const noexcept;
 	bool operator !() const noexcept;
 
+	/*
+	 * @param content text of usb.ids or its image made by compile(), the image is used in place and must outlive this object
+	 */
 	void load(std::string_view content);
 
+	/*
+	 * Builds a binary image of usb.ids that is queried in place, without parsing and allocations.
+	 * @return empty string if the text can't be compiled
+	 */
+	static std::string compile(std::string_view text);
+
 	std::pair<std::string_view, std::string_view> find_product(uint16_t vid, uint16_t pid) const noexcept;
 
 	std::tuple<std::string_view, std::string_view, std::string_view> 
 		find_class_subclass_proto(uint8_t class_id, uint8_t subclass_id, uint8_t prot_id) const noexcept;
+
+	/*
+	 * Case-insensitive substring search in the names of vendors and products.
+	 * A trigram index is built on the first call, it is thread-safe.
+	 * Ranking: the whole name, its prefix, the beginning of a word, anywhere.
+	 * Ties are resolved by a shorter name, then by the order in usb.ids.
+	 * @param max_results zero means unlimited
+	 */
+	std::vector<name_match> search(std::string_view query, size_t max_results = 0) const;
 private:
 	class Impl;
 	Impl *m_impl{}; // std::unique_ptr is not compatible with __declspec(dllexport) for the class
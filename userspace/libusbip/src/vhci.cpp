@@ -9,6 +9,7 @@
 
 #include <resources\messages.h>
 #include <cfgmgr32.h>
+#include <winternl.h>
 
 #include <initguid.h>
 #include <usbip\vhci.h>
@@ -112,6 +113,12 @@ void assign(_Out_ std::vector<imported_device> &dst, _In_ const vhci::imported_d
         }
 }
 
+auto device_io_control(_In_ HANDLE dev, _Inout_ vhci::ioctl_request &r, _Out_ DWORD &BytesReturned)
+{
+        auto buf = r.buf.data();
+        return DeviceIoControl(dev, r.code, buf, r.inlen, r.outlen ? buf : nullptr, r.outlen, &BytesReturned, nullptr);
+}
+
 auto get_path()
 {
         auto guid = const_cast<GUID*>(&vhci::GUID_DEVINTERFACE_USB_HOST_CONTROLLER);
@@ -181,6 +188,23 @@ const char* usbip::vhci::get_state_str(_In_ usbip::state state) noexcept
         return idx >= 0 && idx < ARRAYSIZE(v) ? v[idx] : "";
 }
 
+const char* usbip::vhci::get_attach_stage_str(_In_ attach_stage stage) noexcept
+{
+        static_assert(int(attach_stage::count) == int(vhci::attach_stage::count));
+        static_assert(int(attach_stage::started) == int(vhci::attach_stage::started));
+        static_assert(int(attach_stage::plugged) == int(vhci::attach_stage::plugged));
+        static_assert(int(attach_stage::set_configuration) == int(vhci::attach_stage::set_configuration));
+
+        const char* v[] = { 
+                "started", "resolved", "connected", "imported", "created", "plugged",
+                "first control transfer", "device descriptor", "configuration descriptor", "set configuration" 
+        };
+        static_assert(ARRAYSIZE(v) == int(attach_stage::count));
+
+        auto idx = static_cast<int>(stage);
+        return idx >= 0 && idx < ARRAYSIZE(v) ? v[idx] : "";
+}
+
 auto usbip::vhci::open(_In_ bool overlapped) -> Handle
 {
         DWORD FlagsAndAttributes = FILE_ATTRIBUTE_NORMAL;
@@ -204,87 +228,249 @@ auto usbip::vhci::open(_In_ bool overlapped) -> Handle
 }
 
 std::vector<usbip::imported_device> usbip::vhci::get_imported_devices(_In_ HANDLE dev, _Out_ bool &success)
+{
+        success = false;
+        ioctl_request r;
+
+        for (DWORD cnt = 4; true; cnt <<= 1) {
+                make_get_imported_devices_request(r, cnt);
+
+                if (DWORD BytesReturned{}; // must be set if the last arg is NULL
+                    device_io_control(dev, r, BytesReturned)) {
+                        return get_imported_devices_result(r, BytesReturned, success);
+                } else if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+                        return {};
+                }
+        }
+}
+
+void usbip::vhci::make_get_imported_devices_request(_Out_ ioctl_request &r, _In_ DWORD max_count)
+{
+        r.code = ioctl::GET_IMPORTED_DEVICES;
+        r.buf.assign(ioctl::get_imported_devices_size(max_count), 0);
+
+        auto &req = *reinterpret_cast<ioctl::get_imported_devices*>(r.buf.data());
+        req.size = sizeof(req);
+
+        r.inlen = DWORD(sizeof(req.size));
+        r.outlen = DWORD(r.buf.size());
+}
+
+std::vector<usbip::imported_device> usbip::vhci::get_imported_devices_result(
+        _In_ const ioctl_request &r, _In_ DWORD length, _Out_ bool &success)
 {
         success = false;
         std::vector<usbip::imported_device> result;
 
         constexpr auto devices_offset = offsetof(ioctl::get_imported_devices, devices);
+        auto &req = *reinterpret_cast<const ioctl::get_imported_devices*>(r.buf.data());
+
+        if (length < devices_offset || length > r.buf.size()) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return result;
+        }
+
+        auto devices_size = length - devices_offset;
+        success = !(devices_size % sizeof(*req.devices));
+
+        if (!success) {
+                libusbip::output("{}: N*sizeof(imported_device) != {}", __func__, devices_size);
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+        } else if (auto cnt = devices_size/sizeof(*req.devices)) {
+                assign(result, req.devices, cnt);
+        }
+
+        return result;
+}
 
-        ioctl::get_imported_devices *r{};
+bool usbip::vhci::get_imported_devices_delta(
+        _In_ HANDLE dev, _In_ UINT64 generation, _Out_ imported_devices_delta &result)
+{
+        result = { .generation = generation };
+
+        constexpr auto items_offset = offsetof(ioctl::get_imported_devices_delta, items);
+        constexpr auto inlen = offsetof(ioctl::get_imported_devices_delta, full);
+
+        ioctl::get_imported_devices_delta *r{};
         std::vector<char> buf;
 
         for (auto cnt = 4; true; cnt <<= 1) {
-                buf.resize(ioctl::get_imported_devices_size(cnt));
+                buf.resize(ioctl::get_imported_devices_delta_size(cnt));
 
-                r = reinterpret_cast<ioctl::get_imported_devices*>(buf.data());
+                r = reinterpret_cast<ioctl::get_imported_devices_delta*>(buf.data());
                 r->size = sizeof(*r);
+                r->generation = generation;
 
                 if (DWORD BytesReturned{}; // must be set if the last arg is NULL
-                    DeviceIoControl(dev, ioctl::GET_IMPORTED_DEVICES, r, sizeof(r->size), 
+                    DeviceIoControl(dev, ioctl::GET_IMPORTED_DEVICES_DELTA, r, inlen,
                                     buf.data(), DWORD(buf.size()), &BytesReturned, nullptr)) {
 
-                        if (BytesReturned < devices_offset) [[unlikely]] {
+                        if (BytesReturned < items_offset ||
+                            BytesReturned != ioctl::get_imported_devices_delta_size(r->count)) [[unlikely]] {
+                                libusbip::output("{}: unexpected response length {}", __func__, BytesReturned);
                                 SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
-                                return result;
+                                return false;
                         }
-                                
-                        buf.resize(BytesReturned);
+
                         break;
 
                 } else if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-                        return result;
+                        return false;
                 }
         }
 
-        auto devices_size = buf.size() - devices_offset;
-        success = !(devices_size % sizeof(*r->devices));
+        result.generation = r->generation;
+        result.full = r->full;
 
-        if (!success) {
-                libusbip::output("{}: N*sizeof(imported_device) != {}", __func__, devices_size);
-                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
-        } else if (auto cnt = devices_size/sizeof(*r->devices)) {
-                assign(result, r->devices, cnt);
+        for (ULONG i = 0; i < r->count; ++i) {
+                if (auto &item = r->items[i]; item.unplugged) {
+                        result.unplugged.push_back(item.port);
+                } else {
+                        result.devices.push_back(make_imported_device(item));
+                }
         }
 
-        return result;
+        return true;
 }
 
 int usbip::vhci::attach(_In_ HANDLE dev, _In_ const device_location &location)
 {
-        ioctl::plugin_hardware r {{ .size = sizeof(r) }};
-        if (!assign(r, location)) {
-                SetLastError(ERROR_INVALID_PARAMETER);
+        ioctl_request r;
+        if (!make_attach_request(r, location)) {
                 return 0;
         }
 
-        constexpr auto outlen = offsetof(ioctl::plugin_hardware, port) + sizeof(r.port);
+        DWORD BytesReturned{}; // must be set if the last arg is NULL
+        auto ok = device_io_control(dev, r, BytesReturned);
 
-        if (DWORD BytesReturned{}; // must be set if the last arg is NULL
-            DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE, &r, sizeof(r), &r, outlen, &BytesReturned, nullptr)) {
+        return get_attach_result(r, ok ? ERROR_SUCCESS : GetLastError(), BytesReturned);
+}
 
-                if (BytesReturned != outlen) [[unlikely]] {
-                        SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
-                } else {
-                        assert(r.port > 0);
-                        return r.port;
-                }
+bool usbip::vhci::make_attach_request(_Out_ ioctl_request &r, _In_ const device_location &location)
+{
+        r.code = ioctl::PLUGIN_HARDWARE;
+        r.buf.assign(sizeof(ioctl::plugin_hardware), 0);
+
+        auto &req = *reinterpret_cast<ioctl::plugin_hardware*>(r.buf.data());
+        req.size = sizeof(req);
+
+        if (!assign(req, location)) {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return false;
         }
 
-        auto err = GetLastError();
-        if (auto code = map_attach_error(err); code != err) {
-                SetLastError(code);
+        r.inlen = DWORD(sizeof(req));
+        r.outlen = DWORD(offsetof(ioctl::plugin_hardware, port) + sizeof(req.port));
+        return true;
+}
+
+int usbip::vhci::get_attach_result(_In_ const ioctl_request &r, _In_ DWORD error, _In_ DWORD length)
+{
+        auto &req = *reinterpret_cast<const ioctl::plugin_hardware*>(r.buf.data());
+
+        if (error) {
+                SetLastError(map_attach_error(error));
+        } else if (length != r.outlen) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+        } else {
+                assert(req.port > 0);
+                return req.port;
         }
 
         return 0;
 }
 
-bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
+auto usbip::vhci::attach(_In_ HANDLE dev, _In_ const std::vector<device_location> &locations, _Out_ bool &success)
+        -> std::vector<attach_result>
 {
-        ioctl::plugout_hardware r { .port = port };
+        success = false;
+        std::vector<attach_result> result;
+
+        auto cnt = static_cast<ULONG>(locations.size());
+        if (!cnt) {
+                success = true;
+                return result;
+        }
+
+        std::vector<char> buf(ioctl::plugin_hardware_batch_size(cnt));
+
+        auto &r = *reinterpret_cast<ioctl::plugin_hardware_batch*>(buf.data());
+        r.size = sizeof(r);
+        r.count = cnt;
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                if (!assign(r.items[i], locations[i])) {
+                        SetLastError(ERROR_INVALID_PARAMETER);
+                        return result;
+                }
+        }
+
+        if (DWORD BytesReturned{}; // must be set if the last arg is NULL
+            !DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE_BATCH, buf.data(), DWORD(buf.size()), 
+                             buf.data(), DWORD(buf.size()), &BytesReturned, nullptr)) {
+                return result;
+        } else if (BytesReturned != buf.size()) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return result;
+        }
+
+        result.reserve(cnt);
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &item = r.items[i];
+                auto err = item.status ? map_attach_error(RtlNtStatusToDosError(item.status)) : ERROR_SUCCESS;
+
+                assert(err || item.port > 0);
+                result.push_back({ .port = err ? 0 : item.port, .error = err });
+        }
+
+        success = true;
+        return result;
+}
+
+bool usbip::vhci::get_attach_timeline(_In_ HANDLE dev, _In_ int port, _Out_ attach_timeline &result)
+{
+        ioctl::get_attach_timeline r { .port = port };
         r.size = sizeof(r);
 
+        if (DWORD BytesReturned{}; // must be set if the last arg is NULL
+            !DeviceIoControl(dev, ioctl::GET_ATTACH_TIMELINE, &r, sizeof(r), &r, sizeof(r), &BytesReturned, nullptr)) {
+                return false;
+        } else if (BytesReturned != sizeof(r)) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return false;
+        }
+
+        static_assert(ARRAYSIZE(result.usec) == ARRAYSIZE(r.usec));
+        result.reached = r.reached;
+
+        for (int i = 0; i < ARRAYSIZE(r.usec); ++i) {
+                result.usec[i] = r.usec[i];
+        }
+
+        return true;
+}
+
+bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
+{
+        ioctl_request r;
+        make_detach_request(r, port);
+
         DWORD BytesReturned{}; // must be set if the last arg is NULL
-        return DeviceIoControl(dev, ioctl::PLUGOUT_HARDWARE, &r, sizeof(r), nullptr, 0, &BytesReturned, nullptr);
+        return device_io_control(dev, r, BytesReturned);
+}
+
+void usbip::vhci::make_detach_request(_Out_ ioctl_request &r, _In_ int port)
+{
+        r.code = ioctl::PLUGOUT_HARDWARE;
+        r.buf.assign(sizeof(ioctl::plugout_hardware), 0);
+
+        auto &req = *reinterpret_cast<ioctl::plugout_hardware*>(r.buf.data());
+        req.size = sizeof(req);
+        req.port = port;
+
+        r.inlen = DWORD(sizeof(req));
+        r.outlen = 0;
 }
 
 USBIP_API DWORD usbip::vhci::get_device_state_size() noexcept
@@ -327,3 +513,56 @@ bool usbip::vhci::read_device_state(_In_ HANDLE dev, _Out_ usbip::device_state &
                 return get_device_state(result, &r, actual);
         }
 }
+
+/*
+ * @see read_device_state
+ */
+std::vector<usbip::device_state> usbip::vhci::read_device_states(
+        _In_ HANDLE dev, _Out_ bool &success, _In_ DWORD max_count)
+{
+        success = false;
+        std::vector<usbip::device_state> result;
+
+        if (!max_count) {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return result;
+        }
+
+        std::vector<vhci::device_state> buf(max_count);
+
+        if (DWORD actual; !ReadFile(dev, buf.data(), DWORD(buf.size()*sizeof(buf[0])), &actual, nullptr)) {
+                return result;
+        } else if (!actual) {
+                SetLastError(ERROR_HANDLE_EOF);
+                return result;
+        } else {
+                success = get_device_states(result, buf.data(), actual);
+        }
+
+        return result;
+}
+
+bool usbip::vhci::get_device_states(
+        _Out_ std::vector<usbip::device_state> &result, _In_ const void *data, _In_ DWORD length)
+{
+        result.clear();
+
+        constexpr auto size = sizeof(vhci::device_state);
+        if (length % size) {
+                libusbip::output("{}: N*sizeof(device_state) != {}", __func__, length);
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return false;
+        }
+
+        auto cnt = length/size;
+        result.resize(cnt);
+
+        for (size_t i = 0; i < cnt; ++i) {
+                if (!get_device_state(result[i], static_cast<const char*>(data) + i*size, size)) {
+                        result.clear();
+                        return false;
+                }
+        }
+
+        return true;
+}
@@ -45,6 +45,39 @@ struct device_state
         state state;
 };
 
+/*
+ * Stages of attach, the last four are reached during enumeration of the device by Windows.
+ */
+enum class attach_stage
+{
+        started, resolved, connected, imported, created, plugged,
+        first_control, device_descriptor, configuration_descriptor, set_configuration,
+        count
+};
+
+struct attach_timeline
+{
+        UINT32 reached; // bitmask, bit N is set if attach_stage(N) was reached
+        UINT64 usec[static_cast<int>(attach_stage::count)]; // elapsed since attach_stage::started
+};
+
+/*
+ * @see vhci::get_imported_devices_delta
+ */
+struct imported_devices_delta
+{
+        UINT64 generation; // pass it to the next call
+        bool full; // devices are all imported devices, the previous copy must be discarded
+        std::vector<imported_device> devices; // plugged in since the given generation
+        std::vector<int> unplugged; // hub port numbers that became free since the given generation
+};
+
+struct attach_result
+{
+        int port; // hub port number, >= 1 or zero if an error
+        DWORD error; // Win32 error code if port is zero
+};
+
 } // namespace usbip
 
 
@@ -65,6 +98,16 @@ USBIP_API Handle open(_In_ bool overlapped = false);
  */
 USBIP_API std::vector<imported_device> get_imported_devices(_In_ HANDLE dev, _Out_ bool &success);
 
+/**
+ * Cheap polling of imported devices, nothing is copied if they were not changed.
+ * A port can be in both lists if its device was replaced, unplugged lists the ports that are free now.
+ * @param dev handle of the driver device
+ * @param generation zero or the one returned by the previous call
+ * @param result both lists are empty and the generation is the same if nothing was changed
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_imported_devices_delta(_In_ HANDLE dev, _In_ UINT64 generation, _Out_ imported_devices_delta &result);
+
 /**
  * @param dev handle of the driver device
  * @param location remote device to attach to
@@ -72,6 +115,17 @@ USBIP_API std::vector<imported_device> get_imported_devices(_In_ HANDLE dev, _Ou
  */
 USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
 
+/**
+ * Remote devices are attached concurrently. The first device of each server is attached before the others, 
+ * so they reuse resolved address of the server and are not attached if the server is unreachable.
+ * @param dev handle of the driver device
+ * @param locations remote devices to attach to
+ * @param success call GetLastError() if false is returned, the result is empty in this case
+ * @return results in the same order as locations
+ */
+USBIP_API std::vector<attach_result> attach(
+        _In_ HANDLE dev, _In_ const std::vector<device_location> &locations, _Out_ bool &success);
+
 /**
  * @param dev handle of the driver device
  * @param port hub port number, <= 0 means detach all ports
@@ -79,13 +133,71 @@ USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
  */
 USBIP_API bool detach(_In_ HANDLE dev, _In_ int port);
 
+/**
+ * Attach stages are recorded by the driver, a stage is timestamped when it is reached for the first time.
+ * @param dev handle of the driver device
+ * @param port hub port number of the attached device
+ * @param result timeline of the attach
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_attach_timeline(_In_ HANDLE dev, _In_ int port, _Out_ attach_timeline &result);
+
+/**
+ * Buffer of IOCTL, its layout is private to the library.
+ * It is used to issue the request asynchronously, see async.h.
+ */
+struct ioctl_request
+{
+        DWORD code{}; // for DeviceIoControl
+        DWORD inlen{}; // bytes at the beginning of buf
+        DWORD outlen{}; // at most buf.size()
+        std::vector<char> buf; // input and output
+};
+
+/**
+ * @param r receives IOCTL for attach()
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool make_attach_request(_Out_ ioctl_request &r, _In_ const device_location &location);
+
+/**
+ * @param error of the completed IOCTL
+ * @param length number of bytes returned
+ * @return hub port number, >= 1. Call GetLastError() if zero is returned.
+ */
+USBIP_API int get_attach_result(_In_ const ioctl_request &r, _In_ DWORD error, _In_ DWORD length);
+
+/**
+ * @param r receives IOCTL for detach()
+ */
+USBIP_API void make_detach_request(_Out_ ioctl_request &r, _In_ int port);
+
+/**
+ * @param r receives IOCTL for get_imported_devices()
+ * @param max_count if the buffer is too small, the request fails with ERROR_INSUFFICIENT_BUFFER
+ */
+USBIP_API void make_get_imported_devices_request(_Out_ ioctl_request &r, _In_ DWORD max_count);
+
+/**
+ * @param length number of bytes returned by successfully completed IOCTL
+ * @param success call GetLastError() if false is returned
+ */
+USBIP_API std::vector<imported_device> get_imported_devices_result(
+        _In_ const ioctl_request &r, _In_ DWORD length, _Out_ bool &success);
+
 /**
  * @return textual representation of the given constant
  */
 USBIP_API const char* get_state_str(_In_ state state) noexcept;
 
 /**
- * Read this number of bytes and pass them to get_device_state()
+ * @return textual representation of the given constant
+ */
+USBIP_API const char* get_attach_stage_str(_In_ attach_stage stage) noexcept;
+
+/**
+ * Read this number of bytes and pass them to get_device_state().
+ * A read of N times this size returns up to N states at once.
  * @return bytes to read from the device handle, constant
  */
 USBIP_API DWORD get_device_state_size() noexcept;
@@ -98,6 +210,14 @@ USBIP_API DWORD get_device_state_size() noexcept;
  */
 USBIP_API bool get_device_state(_Out_ device_state &result, _In_ const void *data, _In_ DWORD length);
 
+/**
+ * @param result constructed from passed data
+ * @param data that was read from the device handle
+ * @param length data length, must be a multiple of get_device_state_size()
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_device_states(_Out_ std::vector<device_state> &result, _In_ const void *data, _In_ DWORD length);
+
 /**
  * @param dev handle of the driver device that must be opened for serialized I/O
  * @param result data that was obtained by read operation on the given handle
@@ -105,4 +225,14 @@ USBIP_API bool get_device_state(_Out_ device_state &result, _In_ const void *dat
  */
 USBIP_API bool read_device_state(_In_ HANDLE dev, _Out_ device_state &result);
 
+/**
+ * Reads all pending states at once, blocks until there is at least one.
+ * If the reader lags, the driver keeps only the latest state of each device.
+ * @param dev handle of the driver device that must be opened for serialized I/O
+ * @param success true if the result is valid, call GetLastError() otherwise
+ * @param max_count maximum number of states to read
+ * @return states in the order of their changes
+ */
+USBIP_API std::vector<device_state> read_device_states(_In_ HANDLE dev, _Out_ bool &success, _In_ DWORD max_count = 64);
+
 } // namespace usbip::vhci
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2024 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+// Compiles usb.ids into the binary image that is embedded as a resource, see UsbIds::compile.
+
+#include <libusbip\src\usb_ids.h>
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+int wmain(int argc, wchar_t *argv[])
+{
+        if (argc != 3) {
+                std::wcerr << L"Usage: " << argv[0] << L" <usb.ids> <image>\n";
+                return EXIT_FAILURE;
+        }
+
+        auto &input = argv[1];
+        auto &output = argv[2];
+
+        std::ifstream in(input, std::ios::binary);
+        if (!in) {
+                std::wcerr << L"Can't open " << input << L'\n';
+                return EXIT_FAILURE;
+        }
+
+        std::ostringstream text;
+        text << in.rdbuf();
+
+        auto image = usbip::UsbIds::compile(text.view());
+        if (image.empty() || !usbip::UsbIds(image)) {
+                std::wcerr << L"Can't compile " << input << L'\n';
+                return EXIT_FAILURE;
+        }
+
+        std::ofstream out(output, std::ios::binary | std::ios::trunc);
+        if (!out.write(image.data(), image.size())) {
+                std::wcerr << L"Can't write " << output << L'\n';
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -8,6 +8,9 @@
 
 #include <spdlog\spdlog.h>
 
+#include <chrono>
+#include <thread>
+
 namespace
 {
 
@@ -29,6 +32,47 @@ auto attach_stashed_devices(HANDLE dev)
         return success;
 }
 
+auto reached(_In_ const attach_timeline &t, _In_ attach_stage stage)
+{
+        return t.reached & (1U << static_cast<int>(stage));
+}
+
+/*
+ * Enumeration of the device by Windows continues after the attach has completed, 
+ * wait a bit for SET_CONFIGURATION.
+ */
+void print_timing(_In_ HANDLE dev, _In_ int port)
+{
+        using namespace std::chrono_literals;
+        attach_timeline t{};
+
+        for (auto deadline = std::chrono::steady_clock::now() + 5s; true; std::this_thread::sleep_for(100ms)) {
+                if (!vhci::get_attach_timeline(dev, port, t)) {
+                        spdlog::error(GetLastErrorMsg());
+                        return;
+                } else if (reached(t, attach_stage::set_configuration) || std::chrono::steady_clock::now() >= deadline) {
+                        break;
+                }
+        }
+
+        printf("%-26s %12s %12s\n", "stage", "elapsed, ms", "delta, ms");
+        UINT64 prev = 0;
+
+        for (int i = 0; i < static_cast<int>(attach_stage::count); ++i) {
+                auto stage = static_cast<attach_stage>(i);
+                auto name = vhci::get_attach_stage_str(stage);
+
+                if (!reached(t, stage)) {
+                        printf("%-26s %12s %12s\n", name, "-", "-");
+                        continue;
+                }
+
+                auto usec = t.usec[i];
+                printf("%-26s %12.3f %12.3f\n", name, usec/1000.0, (usec - prev)/1000.0);
+                prev = usec;
+        }
+}
+
 } // namespace
 
 
@@ -64,5 +108,9 @@ bool usbip::cmd_attach(void *p)
                 printf("succesfully attached to port %d\n", port);
         }
 
+        if (args.timing) {
+                print_timing(dev.get(), port);
+        }
+
         return true;
 }
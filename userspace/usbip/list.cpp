@@ -72,6 +72,43 @@ auto list_stashed_devices()
 	return success;
 }
 
+auto list_remotes(_In_ const std::vector<std::string> &hosts)
+{
+	std::vector<server_address> servers;
+	servers.reserve(hosts.size());
+
+	for (auto &host: hosts) {
+		servers.push_back({ .hostname = host, .service = global_args.tcp_port });
+	}
+
+	bool success = true;
+
+	auto on_server = [&hosts, &success] (auto idx, auto err, auto &devices)
+	{
+		auto &host = hosts[idx];
+
+		if (err) {
+			spdlog::error("{}:{} {}", host, global_args.tcp_port, GetLastErrorMsg(err));
+			success = false;
+			return;
+		}
+
+		printf("%s:%s\n", host.c_str(), global_args.tcp_port.c_str());
+		on_device_count(static_cast<int>(devices.size()));
+
+		for (int i = 0; auto &d: devices) {
+			on_device(i, d.device);
+			for (int j = 0; auto &intf: d.interfaces) {
+				on_interface(i, d.device, j++, intf);
+			}
+			++i;
+		}
+	};
+
+	enum_exportable_devices(servers, on_server);
+	return success;
+}
+
 } // namespace
 
 
@@ -82,13 +119,19 @@ bool usbip::cmd_list(void *p)
 		return list_stashed_devices();
 	}
 
-	auto sock = connect(args.remote.c_str(), global_args.tcp_port.c_str());
+	if (args.remote.size() > 1) {
+		return list_remotes(args.remote);
+	}
+
+	auto &remote = args.remote.front();
+
+	auto sock = connect(remote.c_str(), global_args.tcp_port.c_str());
 	if (!sock) {
 		spdlog::error(GetLastErrorMsg());
 		return false;
 	}
 
-	spdlog::debug("connected to {}:{}", args.remote, global_args.tcp_port);
+	spdlog::debug("connected to {}:{}", remote, global_args.tcp_port);
 
 	if (!enum_exportable_devices(sock.get(), on_device, on_interface, on_device_count)) {
 		spdlog::error(GetLastErrorMsg());
@@ -69,6 +69,7 @@ void add_cmd_attach(CLI::App &app)
 		->required();	
 
 	rem->add_flag("-t,--terse", r.terse, "Show port number as a result");
+	rem->add_flag("--timing", r.timing, "Show how long each stage of the attach took");
 
 	cmd->add_option_group("stashed", "Attach to stashed USB devices")
 		->add_flag("-s,--stashed", r.stashed, "Attach to devices stashed by 'port --stash'");
@@ -97,7 +98,7 @@ void add_cmd_list(CLI::App &app)
 		->require_option(1);
 
 	cmd->add_option_group("remote", "List exportable USB devices")
-		->add_option("-r,--remote", r.remote, "List exportable devices on a remote")
+		->add_option("-r,--remote", r.remote, "List exportable devices on remote(s), they are queried concurrently")
 		->required();
 
 	cmd->add_option_group("stashed", "List stashed USB devices")
@@ -131,6 +132,14 @@ void init_spdlog()
 {
 	set_default_logger(spdlog::stderr_color_st("stderr"));
 	spdlog::set_pattern("%^%l%$: %v");
+}
+
+/*
+ * Messages of the library are not even formatted without this option.
+ */
+void enable_debug_output()
+{
+	spdlog::set_level(spdlog::level::debug);
 
 	using fn = void(const std::string&);
 	fn &f = spdlog::debug; // pick this overload
@@ -142,8 +151,7 @@ void init(CLI::App &app)
 	app.option_defaults()->always_capture_default();
 	app.set_version_flag("-V,--version", get_version());
 
-	app.add_flag("-d,--debug", 
-		[] (auto) { spdlog::set_level(spdlog::level::debug); }, "Debug output");
+	app.add_flag("-d,--debug", [] (auto) { enable_debug_output(); }, "Debug output");
 
 	app.add_option("-t,--tcp-port", global_args.tcp_port, "TCP/IP port number of USB/IP server")
 		->check(CLI::Range(1024, USHRT_MAX));
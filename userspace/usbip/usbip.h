@@ -31,6 +31,7 @@ struct attach_args
         std::string remote;
         std::string busid;
         bool terse{};
+        bool timing{};
 
         // --stash
         bool stashed;
@@ -46,7 +47,7 @@ command_t cmd_detach;
 struct list_args
 {
         // --remote
-        std::string remote;
+        std::vector<std::string> remote;
 
         // --stashed
         bool stashed;
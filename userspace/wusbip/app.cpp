@@ -25,7 +25,7 @@ bool App::OnInit()
 
         wxString err;
 
-        if (auto read = init(err) ? vhci::open() : Handle()) {
+        if (auto read = init(err) ? vhci::open(true) : Handle()) { // overlapped, see MainFrame::read_loop
                 if (auto &frame = *new MainFrame(std::move(read)); frame.start_in_tray()) {
                         frame.iconize_to_tray();
                 } else {
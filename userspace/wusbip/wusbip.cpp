@@ -476,40 +476,45 @@ void MainFrame::iconize_to_tray()
 
 void MainFrame::read_loop()
 {
-        auto on_exit = [] (auto frame)
-        {
-                std::lock_guard<std::mutex> lock(frame->m_read_close_mtx);
-                frame->m_read.close();
-        };
-
-        std::unique_ptr<MainFrame, decltype(on_exit)> ptr(this, on_exit);
-
-        for (device_state st; vhci::read_device_state(m_read.get(), st); ) {
-                auto evt = new DeviceStateEvent(std::move(st));
-                QueueEvent(evt); // see on_device_state()
+        if (!m_read_ctx.associate(m_read.get())) {
+                auto err = GetLastError();
+                wxLogError(_("Could not associate the handle with I/O completion port, error %lu\n%s"),
+                             err, GetLastErrorMsg(err));
+                return;
         }
 
-        if (auto err = GetLastError(); err != ERROR_OPERATION_ABORTED) { // see CancelSynchronousIo
-                wxLogError(_("vhci::read_device_state error %lu\n%s"), err, GetLastErrorMsg(err));
+        auto t = read_device_states(m_read_stop.get_token());
+
+        if (!m_read_ctx.run(t)) {
+                auto err = GetLastError();
+                wxLogError(_("GetQueuedCompletionStatus error %lu\n%s"), err, GetLastErrorMsg(err));
+        } else if (auto err = t.get(); err != ERROR_OPERATION_ABORTED) { // see break_read_loop
+                wxLogError(_("vhci::read_device_states error %lu\n%s"), err, GetLastErrorMsg(err));
         }
 }
 
-void MainFrame::break_read_loop()
+usbip::task<DWORD> MainFrame::read_device_states(_In_ std::stop_token stop)
 {
-        auto cancel_read = [this] // CancelSynchronousIo hangs if thread was terminated
-        {
-                std::lock_guard<std::mutex> lock(m_read_close_mtx);
-                return !m_read || CancelSynchronousIo(m_read_thread.native_handle());
-        };
+        for (std::vector<device_state> states; true; ) {
+                if (auto err = co_await vhci::async::read_device_states(m_read.get(), states, stop)) {
+                        co_return err;
+                }
 
-        for (int i = 0; i < 300 && !cancel_read(); ++i, std::this_thread::sleep_for(std::chrono::milliseconds(100))) {
-                if (auto err = GetLastError(); err != ERROR_NOT_FOUND) { // could not find a request to cancel
-                        wxLogError(L"CancelSynchronousIo error %lu\n%s", err, wxSysErrorMsg(err));
-                        break; // wxLogSysError does not compile if wxNO_IMPLICIT_WXSTRING_ENCODING is set
+                for (auto &st: states) {
+                        auto evt = new DeviceStateEvent(std::move(st));
+                        QueueEvent(evt); // see on_device_state()
                 }
         }
 }
 
+/*
+ * Cancels pending read, read_loop() exits.
+ */
+void MainFrame::break_read_loop()
+{
+        m_read_stop.request_stop();
+}
+
 /*
  * GUI thread!
  * vhci::open() is used instead of get_vhci() becase of GUI thread locking:
@@ -947,34 +952,6 @@ void MainFrame::on_help_about(wxCommandEvent&)
         wxAboutBox(d, this);
 }
 
-auto MainFrame::connect(
-        _In_ const wxString &hostname, _In_ const wxString &service, 
-        _In_ const std::string &hostname_u8, _In_ const std::string &service_u8)
-{
-        Socket sock;
-        DWORD err{};
-
-        auto f = [&sock, &err, host = hostname_u8.c_str(), svc = service_u8.c_str()]
-        {
-                sock = usbip::connect(host, svc, CANCEL_BY_APC);
-                err = sock ? ERROR_SUCCESS : GetLastError();
-        };
-
-        auto msg = wxString::Format(L"%s:%s", hostname, service);
-        run_cancellable(this, msg, _("Connecting"), std::move(f), cancel_connect);
-
-        switch (err) {
-        case ERROR_SUCCESS:
-        case WSA_E_CANCELLED:
-        case ERROR_CANCELLED:
-                break;
-        default:
-                wxLogError(_("Could not connect to %s:%s\nError %lu\n%s"), hostname, service, err, GetLastErrorMsg(err));
-        }
-
-        return sock;
-}
-
 void MainFrame::add_exported_devices(wxCommandEvent&)
 {
         auto &cb = *m_comboBoxServer;
@@ -988,44 +965,75 @@ void MainFrame::add_exported_devices(wxCommandEvent&)
         auto port = wxString::Format(L"%d", m_spinCtrlPort->GetValue());
         wxLogVerbose(L"%s, host='%s', port='%s'", wxString::FromAscii(__func__), host, port);
 
-        auto u8_host = host.ToStdString(wxConvUTF8);
-        auto u8_port = port.ToStdString(wxConvUTF8);
+        std::vector<server_address> servers{{
+                .hostname = host.ToStdString(wxConvUTF8),
+                .service = port.ToStdString(wxConvUTF8)
+        }};
 
-        auto sock = connect(host, port, u8_host, u8_port);
-        if (!sock) {
-                return;
-        }
+        std::vector<std::vector<exported_device>> result(servers.size());
+        std::vector<DWORD> errors(servers.size());
+
+        auto on_server = [&result, &errors] (auto idx, auto err, auto &devices)
+        {
+                errors[idx] = err;
+                result[idx] = devices;
+        };
+
+        std::stop_source stop;
+
+        auto f = [&servers, &on_server, token = stop.get_token()]
+        {
+                enum_exportable_devices(servers, on_server, std::chrono::seconds(10), 8, token);
+        };
+
+        auto cancel = [&stop] (auto) { return BOOL(stop.request_stop()); };
+
+        auto msg = wxString::Format(L"%s:%s", host, port);
+        run_cancellable(this, msg, _("Enumerating"), std::move(f), cancel); // enumeration runs on a worker thread
 
         auto persistent = get_persistent();
         auto saved = as_set(get_saved());
 
-        auto dev = [this, host = std::move(u8_host), port = std::move(u8_port), &persistent, &saved] (auto, auto &device)
-        {
-                device_state st {
-                        .device = make_imported_device(std::move(host), std::move(port), device),
-                        .state = state::unplugged
-                };
+        for (size_t i = 0; i < servers.size(); ++i) {
 
-                auto [dc, flags] = make_device_columns(st);
-                flags = update_from_saved(dc, flags, persistent, &saved);
+                auto &srv = servers[i];
 
-                auto [item, added] = find_or_add_device(dc);
-                if (!added) {
-                        flags &= ~mkflag(COL_STATE); // clear
+                switch (auto err = errors[i]) {
+                case ERROR_SUCCESS:
+                        break;
+                case WSA_E_CANCELLED:
+                case ERROR_CANCELLED:
+                        continue;
+                default:
+                        wxLogError(_("Could not enumerate %s:%s\nError %lu\n%s"),
+                                   wxString::FromUTF8(srv.hostname), wxString::FromUTF8(srv.service),
+                                   err, GetLastErrorMsg(err));
+                        continue;
                 }
 
-                update_device(item, dc, flags);
-        };
+                for (auto &[device, interfaces]: result[i]) {
 
-        auto intf = [this] (auto /*dev_idx*/, auto& /*dev*/, auto /*idx*/, auto& /*intf*/) {};
+                        device_state st {
+                                .device = make_imported_device(srv.hostname, srv.service, device),
+                                .state = state::unplugged
+                        };
 
-        if (!enum_exportable_devices(sock.get(), dev, intf)) {
-                auto err = GetLastError();
-                wxLogError(_("enum_exportable_devices error %lu\n%s"), err, GetLastErrorMsg(err));
-        } else if (cb.FindString(host) != wxNOT_FOUND) {
-                // already exists
-        } else if (auto pos = cb.Append(host); cb.GetCount() > 32) {
-                cb.Delete(pos > 0 ? --pos : ++pos);
+                        auto [dc, flags] = make_device_columns(st);
+                        flags = update_from_saved(dc, flags, persistent, &saved);
+
+                        auto [item, added] = find_or_add_device(dc);
+                        if (!added) {
+                                flags &= ~mkflag(COL_STATE); // clear
+                        }
+
+                        update_device(item, dc, flags);
+                }
+
+                if (cb.FindString(host) != wxNOT_FOUND) {
+                        // already exists
+                } else if (auto pos = cb.Append(host); cb.GetCount() > 32) {
+                        cb.Delete(pos > 0 ? --pos : ++pos);
+                }
         }
 }
 
@@ -9,9 +9,9 @@
 #include "tree_comparator.h"
 
 #include <libusbip/win_handle.h>
+#include <libusbip/async.h>
 
 #include <thread>
-#include <mutex>
 
 class wxLogWindow;
 class TaskBarIcon;
@@ -49,7 +49,8 @@ private:
 	std::unique_ptr<wxMenu> m_tree_popup_menu;
 
 	usbip::Handle m_read;
-	std::mutex m_read_close_mtx;
+	usbip::IoContext m_read_ctx;
+	std::stop_source m_read_stop;
 
 	std::thread m_read_thread{ &MainFrame::read_loop, this };
 
@@ -115,6 +116,7 @@ private:
 	void restore_state();
 
 	void read_loop();
+	usbip::task<DWORD> read_device_states(_In_ std::stop_token stop);
 	void break_read_loop();
 
 	wxTreeListItem find_or_add_server(_In_ const wxString &url);
@@ -133,9 +135,6 @@ private:
 	void set_persistent(_In_ wxTreeListItem device, _In_ bool persistent);
 
 	void update_device(_In_ wxTreeListItem device, _In_ const usbip::device_columns &dc, _In_ unsigned int flags);
-	
-	auto connect(_In_ const wxString &hostname, _In_ const wxString &service, 
-		              _In_ const std::string &hostname_u8, _In_ const std::string &service_u8);
 
 	wxDataViewColumn* find_column(_In_ const wxString &title) const noexcept;
 	wxDataViewColumn* find_column(_In_ int item_id) const noexcept;